@@ -0,0 +1,175 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "fh_table.h"
+
+#include <ep/ep_mem.h>
+
+/* Every slot starts with this, followed by the caller's slot_size bytes. */
+typedef struct {
+    uint32_t next_free;     // handle + 1 of the next free handle, 0 at the end
+    uint32_t in_use;
+} fh_slot_hdr_t;
+
+static inline size_t stride(fh_table_t *fht)
+{
+    return sizeof(fh_slot_hdr_t) + ((fht->slot_size + 7) & ~(size_t) 7);
+}
+
+/* The header of fh's slot, or NULL if its chunk hasn't been allocated. */
+static inline fh_slot_hdr_t *slot_hdr(fh_table_t *fht, uint64_t fh)
+{
+    char *chunk;
+
+    if (fh >= FH_TABLE_MAX)
+        return NULL;
+    chunk = __atomic_load_n(&fht->chunks[fh >> FH_TABLE_CHUNK_BITS],
+            __ATOMIC_ACQUIRE);
+    if (chunk == NULL)
+        return NULL;
+    return (fh_slot_hdr_t *) (chunk + (fh & (FH_TABLE_CHUNK - 1)) * stride(fht));
+}
+
+fh_table_t *fh_table_create(size_t slot_size)
+{
+    fh_table_t *fht;
+
+    fht = ep_mem_zalloc(sizeof(fh_table_t));
+    if (fht)
+        fht->slot_size = slot_size;
+    return fht;
+}
+
+/* Hands out a handle nobody has had yet, allocating its chunk if need be. */
+static uint64_t fresh_handle(fh_table_t *fht)
+{
+    uint64_t fh;
+    char **chunkp;
+    char *chunk;
+    char *expected = NULL;
+
+    fh = __atomic_fetch_add(&fht->next, 1, __ATOMIC_RELAXED);
+    if (fh >= FH_TABLE_MAX)
+    {
+        __atomic_fetch_sub(&fht->next, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    chunkp = &fht->chunks[fh >> FH_TABLE_CHUNK_BITS];
+    if (__atomic_load_n(chunkp, __ATOMIC_ACQUIRE) == NULL)
+    {
+        // Whoever loses the race frees theirs and uses the winner's.
+        chunk = ep_mem_zalloc(FH_TABLE_CHUNK * stride(fht));
+        if (chunk == NULL)
+            return -1;
+        if (!__atomic_compare_exchange_n(chunkp, &expected, chunk, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            ep_mem_free(chunk);
+    }
+    return fh;
+}
+
+uint64_t fh_table_reserve(fh_table_t *fht)
+{
+    uint64_t head;
+    uint64_t new_head;
+    uint64_t fh;
+    fh_slot_hdr_t *hdr;
+
+    if (!fht)
+        return -1;
+    head = __atomic_load_n(&fht->free_head, __ATOMIC_ACQUIRE);
+    do
+    {
+        if ((uint32_t) head == 0)
+        {
+            fh = fresh_handle(fht);
+            if (fh == -1)
+                return -1;
+            goto reserved;
+        }
+        fh = (uint32_t) head - 1;
+        hdr = slot_hdr(fht, fh);
+        // The tag changes on every push and pop, so a stale next_free read
+        // here fails the exchange instead of corrupting the stack.
+        new_head = ((head >> 32) + 1) << 32 |
+                __atomic_load_n(&hdr->next_free, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&fht->free_head, &head, new_head,
+                true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+reserved:
+    hdr = slot_hdr(fht, fh);
+    __atomic_store_n(&hdr->in_use, 1, __ATOMIC_RELEASE);
+    return fh;
+}
+
+int fh_table_release(fh_table_t *fht, uint64_t fh)
+{
+    uint64_t head;
+    uint64_t new_head;
+    fh_slot_hdr_t *hdr;
+
+    if (!fht)
+        return -1;
+    hdr = slot_hdr(fht, fh);
+    if (hdr == NULL || !__atomic_exchange_n(&hdr->in_use, 0, __ATOMIC_ACQ_REL))
+        return -1;
+
+    head = __atomic_load_n(&fht->free_head, __ATOMIC_ACQUIRE);
+    do
+    {
+        __atomic_store_n(&hdr->next_free, (uint32_t) head, __ATOMIC_RELAXED);
+        new_head = ((head >> 32) + 1) << 32 | (fh + 1);
+    } while (!__atomic_compare_exchange_n(&fht->free_head, &head, new_head,
+                true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return 0;
+}
+
+void *fh_table_slot(fh_table_t *fht, uint64_t fh)
+{
+    fh_slot_hdr_t *hdr;
+
+    if (!fht)
+        return NULL;
+    hdr = slot_hdr(fht, fh);
+    if (hdr == NULL || !__atomic_load_n(&hdr->in_use, __ATOMIC_ACQUIRE))
+        return NULL;
+    return hdr + 1;
+}
+
+void fh_table_free(fh_table_t *fht)
+{
+    int i;
+
+    for (i = 0; i < FH_TABLE_MAX_CHUNKS; i++)
+    {
+        if (fht->chunks[i])
+            ep_mem_free(fht->chunks[i]);
+    }
+    ep_mem_free(fht);
+}
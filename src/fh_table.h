@@ -0,0 +1,65 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#ifndef _FH_TABLE_H_
+#define _FH_TABLE_H_
+
+#include <ep/ep.h>
+
+/*
+ * File handle table. Handles are small integers, each with a slot of
+ * caller-defined size that stays put for the life of the table. Reserve and
+ * release are lock free: freed handles go on a tagged Treiber stack and new
+ * ones are carved off the end, with slots allocated a chunk at a time as the
+ * table grows, up to FH_TABLE_MAX handles. Looking up a slot is two loads.
+ */
+
+#define FH_TABLE_CHUNK_BITS 12
+#define FH_TABLE_CHUNK (1 << FH_TABLE_CHUNK_BITS)      // handles per chunk
+#define FH_TABLE_MAX_CHUNKS 1024
+#define FH_TABLE_MAX ((uint64_t) FH_TABLE_CHUNK * FH_TABLE_MAX_CHUNKS)
+
+typedef struct {
+    size_t slot_size;
+    uint64_t free_head;     // tag << 32 | (handle + 1) of the top free handle
+    uint64_t next;          // handles below this have been handed out before
+    char *chunks[FH_TABLE_MAX_CHUNKS];
+} fh_table_t;
+
+// returns NULL if alloc fails
+fh_table_t *fh_table_create(size_t slot_size);
+// returns -1 if the table is full
+uint64_t fh_table_reserve(fh_table_t *fht);
+// 0 on success, negative if error
+int fh_table_release(fh_table_t *fht, uint64_t fh);
+// the handle's slot, or NULL if fh isn't reserved
+void *fh_table_slot(fh_table_t *fht, uint64_t fh);
+void fh_table_free(fh_table_t *fht);
+
+#endif // _FH_TABLE_H_
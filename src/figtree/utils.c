@@ -107,6 +107,10 @@ void get_dirty_helper(struct subtree_ptr* node, gdpfs_recno_t recno, struct ft_n
      * when loaded from the GDP.
      */
     for (i = 0; i < written->subtrees_len; i++) {
+        if (!written->subtrees[i].inmemory) {
+            // Never loaded, so it is still where an earlier checkpoint put it.
+            continue;
+        }
         if (written->subtrees[i].st != NULL) {
             written->subtrees[i].inmemory = false;
             written->subtrees[i].st = NULL;
@@ -133,8 +137,15 @@ void get_dirty(struct ft_node** dirty, int* dirty_len, struct figtree* ft, gdpfs
     get_dirty_helper(&root, chkpt_recno, dirty, &dirty_cap, dirty_len);
 }
 
+/* Safe to call from several readers at once: a node that isn't in memory
+ * yet has a NULL st, and whoever swings st to their copy first wins. The
+ * others drop theirs. Writers must exclude readers, as before.
+ */
 struct ft_node* subtree_get(struct subtree_ptr* sptr, gdpfs_log_t* log) {
-    if (!sptr->inmemory) {
+    struct ft_node* node;
+    struct ft_node* expected = NULL;
+
+    if (!__atomic_load_n(&sptr->inmemory, __ATOMIC_ACQUIRE)) {
         // Need to go the GDP to get the subtree
         gdpfs_log_ent_t log_ent;
         gdpfs_fmeta_t entry;
@@ -160,9 +171,16 @@ struct ft_node* subtree_get(struct subtree_ptr* sptr, gdpfs_log_t* log) {
 
         gdpfs_log_ent_drain(&log_ent, sptr->offset);
 
-        sptr->st = mem_alloc(sizeof(struct ft_node));
+        node = mem_alloc(sizeof(struct ft_node));
 
-        gdpfs_log_ent_read(&log_ent, sptr->st, sizeof(struct ft_node));
+        gdpfs_log_ent_read(&log_ent, node, sizeof(struct ft_node));
+        gdpfs_log_ent_close(&log_ent);
+
+        if (!__atomic_compare_exchange_n(&sptr->st, &expected, node, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            mem_free(node);
+        }
+        __atomic_store_n(&sptr->inmemory, true, __ATOMIC_RELEASE);
     }
     return sptr->st;
 }
@@ -285,6 +285,25 @@ gdpfs_write(const char *path, const char *buf, size_t size, off_t offset,
     return gdpfs_file_write(fi->fh, buf, size, offset);
 }
 
+static int
+gdpfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    (void)path;
+    if (!EP_STAT_ISOK(gdpfs_file_flush(fi->fh)))
+        return -EIO;
+    return 0;
+}
+
+static int
+gdpfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void)path;
+    (void)datasync;
+    if (!EP_STAT_ISOK(gdpfs_file_sync(fi->fh)))
+        return -EIO;
+    return 0;
+}
+
 static int
 gdpfs_truncate(const char *file, off_t file_size)
 {
@@ -294,7 +313,7 @@ gdpfs_truncate(const char *file, off_t file_size)
     if ((res = _open(file, &fh, GDPFS_FILE_TYPE_REGULAR)) != 0)
         return res;
     res = gdpfs_file_ftruncate(fh, file_size);
-    res = _release(file, fh) || res;
+    _release(file, fh);
     return res;
 }
 
@@ -457,11 +476,12 @@ gdpfs_chmod (const char *filepath, mode_t mode)
     if (_open(filepath, &fh, GDPFS_FILE_TYPE_UNKNOWN) != 0)
         return -ENOENT;
     estat = gdpfs_file_set_perm(fh, gdpfs_extract_perm(mode));
+    _release(filepath, fh);
     if (!EP_STAT_ISOK(estat))
     {
         ep_app_error("Failed to set permissions");
+        return -EIO;
     }
-    _release(filepath, fh);
     return 0;
 }
 
@@ -489,6 +509,9 @@ static struct fuse_operations gdpfs_oper = {
     .releasedir     = gdpfs_releasedir,
     .read           = gdpfs_read,
     .write          = gdpfs_write,
+    .flush          = gdpfs_flush,
+    .fsync          = gdpfs_fsync,
+    .fsyncdir       = gdpfs_fsync,
     .truncate       = gdpfs_truncate,
     .ftruncate      = gdpfs_ftruncate,
     .create         = gdpfs_create,
@@ -502,7 +525,10 @@ static struct fuse_operations gdpfs_oper = {
     .utimens        = gdpfs_utimens,
 };
 
-int gdpfs_run(char *root_log, char *gdp_router_addr, bool ro, bool use_cache, int fuse_argc, char *fuse_argv[])
+int gdpfs_run(char *root_log, char *gdp_router_addr, bool ro, bool use_cache,
+        bool mock_log, size_t mem_cache_bytes, int append_window,
+        int append_window_global, bool compress, int chkpt_records, int chkpt_mb,
+        int chkpt_age, char *journal_path, int fuse_argc, char *fuse_argv[])
 {
     EP_STAT estat;
     int ret;
@@ -513,7 +539,9 @@ int gdpfs_run(char *root_log, char *gdp_router_addr, bool ro, bool use_cache, in
         fs_mode = GDPFS_FILE_MODE_RW;
 
     // need to init file before dir
-    estat = init_gdpfs_file(fs_mode, use_cache, gdp_router_addr);
+    estat = init_gdpfs_file(fs_mode, use_cache, mock_log, mem_cache_bytes,
+            append_window, append_window_global, compress, chkpt_records,
+            chkpt_mb, chkpt_age, gdp_router_addr, journal_path);
     if (!EP_STAT_ISOK(estat))
         exit(EX_UNAVAILABLE);
     estat = init_gdpfs_dir(root_log);
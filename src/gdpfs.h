@@ -31,12 +31,17 @@
 #define _GDPFS_PRIV_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #define CACHE_DIR "/tmp/gdpfs-cache"
+#define PRECREATED_FILE "/tmp/gdpfs-precreated"
 #define BITMAP_EXTENSION "-bitmap"
 
 int
-gdpfs_run(char *root_log, char *gdp_router_addr, bool ro_mode, bool use_cache, int fuse_argc, char *fuse_argv[]);
+gdpfs_run(char *root_log, char *gdp_router_addr, bool ro_mode, bool use_cache,
+        bool mock_log, size_t mem_cache_bytes, int append_window,
+        int append_window_global, bool compress, int chkpt_records, int chkpt_mb,
+        int chkpt_age, char *journal_path, int fuse_argc, char *fuse_argv[]);
 
 void
 gdpfs_stop();
@@ -0,0 +1,152 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "gdpfs_compress.h"
+#include "gdpfs_stat.h"
+
+#include <ep/ep_app.h>
+#include <string.h>
+#include <zlib.h>
+
+// Compressed output must be at most 7/8 of the input to be kept.
+#define COMPRESS_KEEP_NUM       7
+#define COMPRESS_KEEP_DEN       8
+
+static bool compress_enabled = false;
+
+EP_STAT
+init_gdpfs_compress(bool enabled)
+{
+    compress_enabled = enabled;
+    return GDPFS_STAT_OK;
+}
+
+void
+gdpfs_compress_state_init(gdpfs_compress_state_t *state)
+{
+    state->skip = 0;
+    state->backoff = 0;
+}
+
+bool
+gdpfs_compress(gdpfs_compress_state_t *state, const void *data, size_t len,
+        void **out, size_t *outlen)
+{
+    uLongf zlen;
+    void *zbuf;
+    bool keep;
+    int skip;
+    int backoff;
+
+    if (!compress_enabled || len < COMPRESS_MIN_SIZE)
+        return false;
+
+    // The state only steers a heuristic, so appends racing on it at worst
+    // compress a record more or less than they would have.
+    skip = __atomic_load_n(&state->skip, __ATOMIC_RELAXED);
+    while (skip > 0)
+    {
+        if (__atomic_compare_exchange_n(&state->skip, &skip, skip - 1, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return false;
+    }
+
+    zlen = compressBound(len);
+    zbuf = ep_mem_malloc(zlen);
+    if (zbuf == NULL)
+        return false;
+    keep = compress2(zbuf, &zlen, data, len, COMPRESS_LEVEL) == Z_OK &&
+            zlen * COMPRESS_KEEP_DEN <= len * COMPRESS_KEEP_NUM;
+
+    if (keep)
+    {
+        __atomic_store_n(&state->backoff, 0, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        backoff = __atomic_load_n(&state->backoff, __ATOMIC_RELAXED);
+        backoff = backoff == 0 ? 1 : backoff << 1;
+        if (backoff > COMPRESS_MAX_BACKOFF)
+            backoff = COMPRESS_MAX_BACKOFF;
+        __atomic_store_n(&state->backoff, backoff, __ATOMIC_RELAXED);
+        __atomic_store_n(&state->skip, backoff, __ATOMIC_RELAXED);
+    }
+
+    if (!keep)
+    {
+        ep_mem_free(zbuf);
+        return false;
+    }
+    *out = zbuf;
+    *outlen = zlen;
+    return true;
+}
+
+bool
+gdpfs_decompress_size_ok(size_t inlen, size_t outlen)
+{
+    return outlen <= COMPRESS_MAX_RECORD && outlen / COMPRESS_MAX_RATIO <= inlen;
+}
+
+EP_STAT
+gdpfs_decompressv(const struct iovec *iov, int iovcnt, size_t skip,
+        void *out, size_t outlen)
+{
+    z_stream zs;
+    int ret = Z_OK;
+    int i;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+        return GDPFS_STAT_OOMEM;
+    zs.next_out = out;
+    zs.avail_out = outlen;
+
+    // Feed the chains in as they are rather than joining them first.
+    for (i = 0; i < iovcnt && ret == Z_OK; i++)
+    {
+        if (iov[i].iov_len <= skip)
+        {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        zs.next_in = (Bytef *) iov[i].iov_base + skip;
+        zs.avail_in = iov[i].iov_len - skip;
+        skip = 0;
+        ret = inflate(&zs, Z_NO_FLUSH);
+    }
+    inflateEnd(&zs);
+
+    if (ret != Z_STREAM_END || zs.total_out != outlen)
+    {
+        ep_app_error("Corrupt compressed record");
+        return GDPFS_STAT_CORRUPT;
+    }
+    return GDPFS_STAT_OK;
+}
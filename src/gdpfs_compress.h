@@ -0,0 +1,80 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#ifndef _GDPFS_COMPRESS_H_
+#define _GDPFS_COMPRESS_H_
+
+#include <ep/ep.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+/*
+ * Optional zlib compression of record payloads. Compression is adaptive:
+ * each caller keeps a gdpfs_compress_state_t and payloads that don't shrink
+ * by enough make that caller skip compression for a while, backing off
+ * exponentially up to COMPRESS_MAX_BACKOFF records.
+ */
+
+#define COMPRESS_MIN_SIZE       128     // smaller payloads are never compressed
+#define COMPRESS_MAX_BACKOFF    64
+#define COMPRESS_LEVEL          1       // favor speed; we're in the write path
+#define COMPRESS_MAX_RECORD     (64 * 1024 * 1024)  // most we'll inflate a record to
+#define COMPRESS_MAX_RATIO      1032    // zlib can't do better than this
+
+// Updated atomically, so appends to different files never contend.
+typedef struct gdpfs_compress_state
+{
+    int skip;       // records left to send uncompressed
+    int backoff;    // skip to use after the next poor result
+} gdpfs_compress_state_t;
+
+EP_STAT
+init_gdpfs_compress(bool enabled);
+
+void
+gdpfs_compress_state_init(gdpfs_compress_state_t *state);
+
+// Compresses len bytes of data into a new buffer at *out (freed by the
+// caller) if compression is on and worth it. Returns false otherwise.
+bool
+gdpfs_compress(gdpfs_compress_state_t *state, const void *data, size_t len,
+        void **out, size_t *outlen);
+
+// Whether a payload of inlen compressed bytes can inflate to outlen bytes
+// without exceeding COMPRESS_MAX_RECORD. Check before allocating for it.
+bool
+gdpfs_decompress_size_ok(size_t inlen, size_t outlen);
+
+// Inflates a payload gathered from iov, ignoring its first skip bytes, into
+// exactly outlen bytes at out.
+EP_STAT
+gdpfs_decompressv(const struct iovec *iov, int iovcnt, size_t skip,
+        void *out, size_t outlen);
+
+#endif // _GDPFS_COMPRESS_H_
@@ -177,7 +177,7 @@ _open_parent_dir(uint64_t* fh, const char* filepath, char** file,
     {
         return GDPFS_STAT_OOMEM;
     }
-    strncpy(path_mem, filepath, strlen(filepath) + 1);
+    strcpy(path_mem, filepath);
     path = dirname(path_mem);
 
     *fh = gdpfs_dir_open_file_at_path(&estat, path, GDPFS_FILE_TYPE_DIR);
@@ -188,7 +188,7 @@ _open_parent_dir(uint64_t* fh, const char* filepath, char** file,
     }
     else
     {
-        strncpy(path_mem, filepath, strlen(filepath) + 1);
+        strcpy(path_mem, filepath);
         *file = basename(path_mem);
         *tofree = path_mem;
     }
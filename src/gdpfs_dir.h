@@ -37,7 +37,7 @@
 
 struct gdpfs_dir_entry
 {
-    char name[NAME_MAX_GDPFS];
+    char name[NAME_MAX_GDPFS + 1];
     off_t offset;
 };
 typedef struct gdpfs_dir_entry gdpfs_dir_entry_t;
@@ -30,6 +30,11 @@
 #define _GNU_SOURCE
 
 #include "gdpfs_file.h"
+#include "gdpfs_compress.h"
+#include "gdpfs_fmeta.h"
+#include "gdpfs_journal.h"
+#include "gdpfs_logcache.h"
+#include "gdpfs_reccache.h"
 #include "gdpfs_stat.h"
 #include "gdpfs.h"
 
@@ -39,16 +44,19 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
 #include "bitmap.h"
 #include "bitmap_file.h"
+#include "fh_table.h"
 #include "list.h"
 #include "figtree/figtree.h"
 #include "figtree/figtreenode.h"
 #include <assert.h>
 #include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include <ep/ep_thr.h>
 
@@ -62,17 +70,32 @@
        __typeof__ (b) _b = (b); \
      _a < _b ? _a : _b; })
 
-#define MAGIC_NUMBER 0xb531479b64f64e0d
 
 // Uncomment this if you want to use the bitmap for some reason
 //#define USE_BITMAP
 
+/* A run of buffered writes that haven't gone to the log yet. */
+typedef struct
+{
+    off_t offset;
+    size_t size;
+    size_t cap;     // bytes allocated at data
+    char *data;
+} wb_extent_t;
+
+/* A range of a file's cache that holds valid data. */
+typedef struct
+{
+    off_t lo;
+    off_t hi;       // exclusive
+} cache_range_t;
+
 // TODO: file should store a copy of the meta data. This makes writes easier.
 typedef struct
 {
     gdpfs_log_t *log_handle;
     char *hash_key;
-    uint32_t ref_count;
+    uint32_t ref_count;     // atomic
     int cache_fd;
 #ifdef USE_BITMAP
     int cache_bitmap_fd;
@@ -82,6 +105,31 @@ typedef struct
     bool info_cache_valid;
     gdpfs_file_info_t info_cache;
     gdpfs_recno_t last_recno;
+    gdpfs_recno_t last_chkpt_recno; // 0 if we don't know of one
+    int recs_since_chkpt;           // these three under figtree_lock
+    size_t bytes_since_chkpt;
+    EP_TIME_SPEC dirty_since;       // first write after the last checkpoint
+    uint64_t cache_gen;             // bumped under cache_lock as newer data is cached
+
+    // What of the cache file holds valid data: sorted, disjoint ranges.
+    // Changed under cache_lock and cache_map_lock, read under either.
+    cache_range_t *cache_map;
+    int cache_map_n;
+    int cache_map_cap;
+    EP_THR_RWLOCK cache_map_lock;
+
+    // Write-back buffer, sorted by offset, under wb_lock. A flush moves it to
+    // wb_flushing, where reads still see it until the figtree has the record.
+    wb_extent_t *wb;
+    int wb_n;
+    size_t wb_bytes;
+    gdpfs_file_info_t wb_info;      // as of the latest buffered write
+    int wb_journaled;               // buffered writes that went through the journal
+    EP_TIME_SPEC wb_since;          // when the oldest buffered write came in
+    wb_extent_t *wb_flushing;
+    int wb_nflushing;
+    EP_THR_MUTEX wb_lock;
+    EP_THR_MUTEX wb_flush_lock;     // one flush at a time, so records keep write order
 
     int outstanding_reqs;
     int index_flush_reqs; // true if the index has been flushed to the log
@@ -89,58 +137,219 @@ typedef struct
     EP_THR_MUTEX index_flush_lock;
     EP_THR_COND index_flush_cond;
 
+    // Our data appends still waiting on the log, oldest first, under
+    // ack_lock. Checkpoints aren't tracked; see gdpfs_file_sync.
+    struct list appends;
+    gdpfs_recno_t acked_recno;      // ours up to here are all in the log
+    bool append_failed;             // one failed since the last sync
+    EP_THR_MUTEX ack_lock;
+    EP_THR_COND ack_cond;
+
+    // Records go to the log outside figtree_lock, but in the order they took
+    // their recnos: a ticket is taken along with the recno and the append
+    // waits for its turn.
+    uint64_t append_ticket;         // under figtree_lock
+    uint64_t append_turn;           // under append_seq_lock
+    // A record that took a recno didn't make it to the log, so the figtree
+    // can't be trusted. Set under append_seq_lock; see _file_recover.
+    bool append_broken;
+    EP_THR_MUTEX append_seq_lock;
+    EP_THR_COND append_seq_cond;
+    gdpfs_compress_state_t data_zstate;
+    gdpfs_compress_state_t chkpt_zstate;
+
     figtree_t figtree;
     bool figtree_initialized;
-    EP_THR_MUTEX ref_count_lock;
+    bool subscribed; // remote appends are being applied as they arrive
+    // When both are held, figtree_lock is taken first.
     EP_THR_MUTEX cache_lock;
     EP_THR_RWLOCK figtree_lock;
 } gdpfs_file_t;
 
+/* One record a read needs, and how far into its data the read has got. */
 typedef struct
 {
-    off_t start;
-    size_t len;
-    int* numleft;
-    EP_THR_MUTEX* lock;
-    EP_THR_COND* condvar;
-    char* writebuf;
-} gdpfs_readstate_t;
-
-#define MAX_FHS 1024
+    gdpfs_recno_t recno;
+    size_t pos;
+    uint32_t n;
+    gdpfs_extent_t one;
+    gdpfs_extent_t *exts;   // &one unless the record has several extents
+} read_rec_t;
+
+#define FILE_SHARDS 64
+#define FILE_SHARD_HASH_SIZE 64
+#define FILL_IOV_MAX 16
 #define RC_CAP 256
-static bitmap_t *fhs;
-static gdpfs_file_t **files;
-static EP_HASH *file_hash;
+#define OPEN_SCAN_BATCH 16
+#define APPEND_WINDOW_DEFAULT 64
+#define APPEND_WINDOW_GLOBAL_DEFAULT 512
+#define CHKPT_RECORDS_DEFAULT 1024
+#define CHKPT_BYTES_DEFAULT (64 * 1024 * 1024)
+#define CHKPT_AGE_DEFAULT 30
+#define CHKPT_SCAN_INTERVAL 1   // seconds between looks for aged files
+#define WB_MAX_BYTES (1024 * 1024)
+#define WB_MAX_EXTENTS 64
+#define WB_GLOBAL_MAX (64 * 1024 * 1024)
+#define WB_AGE 1                // seconds a write may sit in the buffer
+#define READAHEAD_MIN (128 * 1024)
+#define READAHEAD_MAX (4 * 1024 * 1024)
+#define READAHEAD_THREADS 4
+static fh_table_t *fhs;
+
+/*
+ * Open files by gname, split into shards that each have their own lock.
+ * Gnames are hashes, so their first bytes spread files evenly and opens of
+ * different files rarely contend.
+ */
+typedef struct
+{
+    EP_THR_MUTEX lock;
+    EP_HASH *hash;
+} file_shard_t;
+
+static file_shard_t file_shards[FILE_SHARDS];
 static bool use_cache;
 
 
+/*
+ * In-flight append window. do_write blocks once a file has append_window
+ * appends outstanding or all files together have append_window_global.
+ * Completions are queued by the log callback and retired in batches by
+ * append_done_thread.
+ */
+typedef struct
+{
+    struct list_elem elem;
+    struct list_elem file_elem;     // on file->appends
+    gdpfs_file_t *file;
+    gdpfs_recno_t recno;
+    int journaled;          // journal records the append makes redundant
+    EP_STAT estat;
+} append_req_t;
+
+static int append_window;
+static int append_window_global;
+static int appends_inflight;
+static int append_failures;
+static struct list append_done;
+static EP_THR_MUTEX append_lock;
+static EP_THR_COND append_cond;         // window space freed
+static EP_THR_COND append_done_cond;    // completions queued
+static pthread_t append_done_thread;
+
+/*
+ * Background checkpointer. An open file is checkpointed once it has
+ * chkpt_records records, chkpt_bytes bytes or chkpt_age seconds worth of
+ * writes since its last checkpoint, so what the next open has to replay
+ * stays short. 0 turns a trigger off. The same scan flushes write-back
+ * buffers that have sat for WB_AGE seconds.
+ */
+static int chkpt_records;
+static size_t chkpt_bytes;
+static int chkpt_age;
+static bool chkpt_kick;                 // a file crossed a count threshold
+static EP_THR_MUTEX chkpt_lock;
+static EP_THR_COND chkpt_cond;
+static pthread_t chkpt_thread;
+
+/*
+ * Sequential read-ahead. Each handle remembers where its last read ended, and
+ * a read starting there continues a stream. Once a stream's reader is into
+ * the second half of what was read ahead, the next window is queued for the
+ * readahead threads, which fetch it from the log into the cache. The window
+ * doubles from READAHEAD_MIN up to READAHEAD_MAX as the stream goes on and
+ * any other read ends the stream, dropping whatever it still had queued.
+ */
+typedef struct
+{
+    off_t next;             // where the next read of the stream would start
+    off_t end;              // end of what has been read ahead
+    size_t window;          // 0 if the handle isn't streaming
+    uint32_t epoch;         // queued windows from older epochs are dropped
+} readahead_t;
+
+typedef struct
+{
+    struct list_elem elem;
+    gdpfs_file_t *file;
+    uint64_t fh;
+    uint32_t epoch;
+    off_t offset;
+    size_t size;
+} readahead_req_t;
+
+static struct list readahead_queue;
+static EP_THR_MUTEX readahead_lock;
+static EP_THR_COND readahead_cond;
+static pthread_t readahead_threads[READAHEAD_THREADS];
+
+/* What fhs keeps for each handle. */
+typedef struct
+{
+    gdpfs_file_t *file;
+    readahead_t ra;         // under readahead_lock
+} fh_slot_t;
+
+// writes go through the journal before they are acked
+static bool journal_on;
+
+// bytes sitting in all files' write-back buffers
+static size_t wb_total;
+static EP_THR_MUTEX wb_total_lock;
+
 static EP_THR_MUTEX rc_lock;
-static EP_THR_MUTEX open_lock;
 static struct list recently_closed;
 static int recently_closed_size;
 
+static file_shard_t *
+_file_shard(const uint8_t *gname)
+{
+    return &file_shards[(gname[0] | gname[1] << 8) % FILE_SHARDS];
+}
+
 // Private Functions
 static size_t do_write(uint64_t fh, const char *buf,
         size_t size, off_t offset, const gdpfs_file_info_t *info);
+static EP_STAT do_write_meta(uint64_t fh, const gdpfs_file_info_t *info);
 static gdpfs_file_t *lookup_fh(uint64_t fh);
 static EP_STAT gdpfs_file_fill_cache(gdpfs_file_t *file, const void *buffer, size_t size,
         off_t offset, bool overwrite);
+static EP_STAT gdpfs_file_fill_cache_ent(gdpfs_file_t *file, gdpfs_log_ent_t *ent,
+        size_t size, off_t offset);
+static void gdpfs_file_uncache(gdpfs_file_t *file, size_t size, off_t offset);
+static void _cache_map_add(gdpfs_file_t *file, off_t lo, off_t hi);
 static bool gdpfs_file_get_cache(gdpfs_file_t *file, void *buffer, size_t size,
         off_t offset);
+static bool gdpfs_file_cache_covers(gdpfs_file_t *file, size_t size, off_t offset);
 static EP_STAT _file_load_info_cache(gdpfs_file_t* file);
 static EP_STAT _file_get_info_raw(gdpfs_file_info_t** info, gdpfs_file_t* file);
 EP_STAT _file_dealloc(gdpfs_file_t* file);
 EP_STAT _file_unref(gdpfs_file_t* file);
 EP_STAT _file_ref(gdpfs_file_t* file);
-EP_STAT _recently_closed_insert(gdpfs_file_t* file);
-void _file_chkpt(gdpfs_file_t* file, bool do_callback);
+static gdpfs_file_t *_recently_closed_insert(gdpfs_file_t* file);
+EP_STAT _file_chkpt(gdpfs_file_t* file, bool do_callback, bool *appended);
+static EP_STAT _file_decode_record(gdpfs_log_ent_t *ent, void **out, size_t *outlen,
+        size_t *replace);
+static void *_append_done_thread(void *arg);
+static void *_chkpt_thread(void *arg);
+static void *_readahead_thread(void *arg);
+static EP_STAT _file_wb_flush(gdpfs_file_t *file);
+static EP_STAT _file_journal_recover(const char *journal_path);
+static bool _wb_due(gdpfs_file_t *file, const EP_TIME_SPEC *now);
+static int _wb_overlay_collect(gdpfs_file_t *file, off_t offset, size_t size,
+        wb_extent_t **ovp);
+static void _wb_overlay_apply(char *buf, off_t offset, wb_extent_t *ov, int nov);
 
 EP_STAT
-init_gdpfs_file(gdpfs_file_mode_t fs_mode, bool _use_cache, char *gdp_router_addr)
+init_gdpfs_file(gdpfs_file_mode_t fs_mode, bool _use_cache, bool mock_log,
+        size_t mem_cache_bytes, int _append_window, int _append_window_global,
+        bool compress, int _chkpt_records, int chkpt_mb, int _chkpt_age,
+        char *gdp_router_addr, char *journal_path)
 {
     EP_STAT estat;
     DIR *dirp;
     struct dirent *dp;
+    int i;
 
     use_cache = _use_cache;
 
@@ -151,22 +360,55 @@ init_gdpfs_file(gdpfs_file_mode_t fs_mode, bool _use_cache, char *gdp_router_add
     recently_closed_size = 0;
     if (ep_thr_mutex_init(&rc_lock, EP_THR_MUTEX_NORMAL) != 0)
         return GDPFS_STAT_SYNCH_FAIL;
-    if (ep_thr_mutex_init(&open_lock, EP_THR_MUTEX_NORMAL) != 0)
+
+    append_window = _append_window > 0 ? _append_window : APPEND_WINDOW_DEFAULT;
+    append_window_global = _append_window_global > 0 ?
+            _append_window_global : APPEND_WINDOW_GLOBAL_DEFAULT;
+    appends_inflight = 0;
+    append_failures = 0;
+    list_init(&append_done);
+    if (ep_thr_mutex_init(&append_lock, EP_THR_MUTEX_NORMAL) != 0 ||
+        ep_thr_cond_init(&append_cond) != 0 ||
+        ep_thr_cond_init(&append_done_cond) != 0)
+        return GDPFS_STAT_SYNCH_FAIL;
+    if (pthread_create(&append_done_thread, NULL, _append_done_thread, NULL) != 0)
         return GDPFS_STAT_SYNCH_FAIL;
 
-    files = ep_mem_zalloc(sizeof(gdpfs_file_t *) * MAX_FHS);
-    if (files == NULL)
-        goto fail2;
-    fhs = bitmap_create(MAX_FHS);
+    chkpt_records = _chkpt_records >= 0 ? _chkpt_records : CHKPT_RECORDS_DEFAULT;
+    chkpt_bytes = chkpt_mb >= 0 ? (size_t) chkpt_mb * 1024 * 1024 : CHKPT_BYTES_DEFAULT;
+    chkpt_age = _chkpt_age >= 0 ? _chkpt_age : CHKPT_AGE_DEFAULT;
+    chkpt_kick = false;
+    if (ep_thr_mutex_init(&chkpt_lock, EP_THR_MUTEX_NORMAL) != 0 ||
+        ep_thr_cond_init(&chkpt_cond) != 0)
+        return GDPFS_STAT_SYNCH_FAIL;
+    wb_total = 0;
+    if (ep_thr_mutex_init(&wb_total_lock, EP_THR_MUTEX_NORMAL) != 0)
+        return GDPFS_STAT_SYNCH_FAIL;
+
+    fhs = fh_table_create(sizeof(fh_slot_t));
     if (fhs == NULL)
-        goto fail1;
-    file_hash = ep_hash_new("file_hash", NULL, MAX_FHS);
-    if (file_hash == NULL)
-        goto fail0;
+        return estat;
+    for (i = 0; i < FILE_SHARDS; i++)
+    {
+        if (ep_thr_mutex_init(&file_shards[i].lock, EP_THR_MUTEX_NORMAL) != 0)
+        {
+            estat = GDPFS_STAT_SYNCH_FAIL;
+            goto fail0;
+        }
+        file_shards[i].hash = ep_hash_new("file_hash", NULL, FILE_SHARD_HASH_SIZE);
+        if (file_shards[i].hash == NULL)
+            goto fail0;
+    }
 
-    estat = init_gdpfs_log(fs_mode, gdp_router_addr);
+    estat = init_gdpfs_log(fs_mode,
+            mock_log ? GDPFS_LOG_BACKEND_MEM : GDPFS_LOG_BACKEND_GDP,
+            gdp_router_addr);
+    if (!EP_STAT_ISOK(estat))
+        goto fail0;
+    estat = init_gdpfs_compress(compress);
     if (!EP_STAT_ISOK(estat))
         goto fail0;
+    gdpfs_log_set_decoder(_file_decode_record);
 
     if (use_cache)
     {
@@ -186,38 +428,175 @@ init_gdpfs_file(gdpfs_file_mode_t fs_mode, bool _use_cache, char *gdp_router_add
                 ep_mem_free(unlink_path);
             }
         } while (dp != NULL);
+        closedir(dirp);
+
+        estat = init_gdpfs_logcache(CACHE_DIR, LOGCACHE_MAX_BYTES);
+        if (!EP_STAT_ISOK(estat))
+            goto fail0;
+        estat = init_gdpfs_reccache(mem_cache_bytes);
+        if (!EP_STAT_ISOK(estat))
+            goto fail0;
+    }
+
+    // Runs even with checkpointing off, since it also flushes aged buffers.
+    if (pthread_create(&chkpt_thread, NULL, _chkpt_thread, NULL) != 0)
+    {
+        estat = GDPFS_STAT_SYNCH_FAIL;
+        goto fail0;
+    }
+
+    // Read-ahead lands in the cache, so there's nothing to do without one.
+    if (use_cache)
+    {
+        list_init(&readahead_queue);
+        if (ep_thr_mutex_init(&readahead_lock, EP_THR_MUTEX_NORMAL) != 0 ||
+            ep_thr_cond_init(&readahead_cond) != 0)
+        {
+            estat = GDPFS_STAT_SYNCH_FAIL;
+            goto fail0;
+        }
+        for (i = 0; i < READAHEAD_THREADS; i++)
+        {
+            if (pthread_create(&readahead_threads[i], NULL, _readahead_thread, NULL) != 0)
+            {
+                estat = GDPFS_STAT_SYNCH_FAIL;
+                goto fail0;
+            }
+        }
+    }
+
+    if (journal_path != NULL)
+    {
+        estat = _file_journal_recover(journal_path);
+        if (!EP_STAT_ISOK(estat))
+            goto fail0;
     }
     return GDPFS_STAT_OK;
 
 fail0:
-    ep_hash_free(file_hash);
-fail1:
-    bitmap_free(fhs);
-fail2:
-    ep_mem_free(files);
+    for (i = 0; i < FILE_SHARDS; i++)
+    {
+        if (file_shards[i].hash != NULL)
+            ep_hash_free(file_shards[i].hash);
+        file_shards[i].hash = NULL;
+    }
+    fh_table_free(fhs);
+    return estat;
+}
+
+/* Rewrites one record left in the journal by an earlier run. */
+static void
+_file_journal_replay(gdpfs_file_gname_t gname, const gdpfs_file_info_t *info,
+        const void *buf, size_t size, off_t offset, void *udata)
+{
+    EP_STAT estat;
+    uint64_t fh;
+    int *failed = udata;
+
+    fh = gdpfs_file_open(&estat, gname);
+    if (!EP_STAT_ISOK(estat))
+    {
+        (*failed)++;
+        return;
+    }
+    if (do_write(fh, buf, size, offset, info) != size)
+        (*failed)++;
+    if (!EP_STAT_ISOK(gdpfs_file_close(fh)))
+        (*failed)++;
+}
+
+/*
+ * Brings the log up to date with whatever the journal at journal_path still
+ * holds, then starts journaling. The journal is only emptied once every
+ * replayed write has been acked, so a crash during recovery just means
+ * replaying again.
+ */
+static EP_STAT
+_file_journal_recover(const char *journal_path)
+{
+    EP_STAT estat;
+    int failed = 0;
+    int failures;
+
+    estat = init_gdpfs_journal(journal_path);
+    if (!EP_STAT_ISOK(estat))
+        return estat;
+
+    ep_thr_mutex_lock(&append_lock);
+    failures = append_failures;
+    ep_thr_mutex_unlock(&append_lock);
+
+    estat = gdpfs_journal_replay(_file_journal_replay, &failed);
+    if (!EP_STAT_ISOK(estat))
+        goto fail0;
+
+    ep_thr_mutex_lock(&append_lock);
+    while (appends_inflight > 0) {
+        ep_thr_cond_wait(&append_cond, &append_lock, NULL);
+    }
+    failed += append_failures - failures;
+    ep_thr_mutex_unlock(&append_lock);
+    if (failed > 0)
+    {
+        ep_app_error("Could not replay %d journaled writes; "
+                "leaving the journal alone", failed);
+        estat = GDPFS_STAT_RW_FAILED;
+        goto fail0;
+    }
+
+    estat = gdpfs_journal_reset();
+    if (!EP_STAT_ISOK(estat))
+        goto fail0;
+    journal_on = true;
+    return GDPFS_STAT_OK;
+
+fail0:
+    stop_gdpfs_journal();
     return estat;
 }
 
 void
 checkpoint_file_on_stop(size_t keylen, const void* key, void* val, va_list av)
 {
-    if (val != NULL)
-        _file_chkpt((gdpfs_file_t*) val, false);
+    gdpfs_file_t *file = val;
+    bool appended;
+
+    // A file whose open failed has no figtree to checkpoint.
+    if (file != NULL && file->figtree_initialized)
+    {
+        _file_wb_flush(file);
+        if (!EP_STAT_ISOK(_file_chkpt(file, false, &appended)))
+            ep_app_warn("Could not checkpoint file on stop; its next open replays the log");
+    }
 }
 
 void
 stop_gdpfs_file()
 {
-	ep_hash_forall(file_hash, checkpoint_file_on_stop);
-	sleep(10);
-    ep_hash_free(file_hash);
-    bitmap_free(fhs);
+    int i;
+
+    for (i = 0; i < FILE_SHARDS; i++)
+        ep_hash_forall(file_shards[i].hash, checkpoint_file_on_stop);
+    sleep(10);
+    for (i = 0; i < FILE_SHARDS; i++)
+        ep_hash_free(file_shards[i].hash);
+    fh_table_free(fhs);
+    if (journal_on)
+        stop_gdpfs_journal();
+    stop_gdpfs_reccache();
+    stop_gdpfs_logcache();
+    stop_gdpfs_log();
 }
 
-EP_STAT
+/*
+ * Puts file on the recently closed list. Returns the file that pushes off
+ * the end, if any, for the caller to _file_dealloc once it has dropped the
+ * shard lock, which must be held for file.
+ */
+static gdpfs_file_t *
 _recently_closed_insert(gdpfs_file_t* file)
 {
-    EP_STAT estat;
+    gdpfs_file_t *oldfile = NULL;
     EP_ASSERT(!file->recently_closed);
 
     EP_ASSERT(ep_thr_mutex_lock(&rc_lock) == 0);
@@ -226,19 +605,14 @@ _recently_closed_insert(gdpfs_file_t* file)
     EP_ASSERT(recently_closed_size <= RC_CAP && recently_closed_size >= 0);
     if (recently_closed_size == RC_CAP)
     {
-        gdpfs_file_t *oldfile = list_entry(list_pop_back(&recently_closed), gdpfs_file_t, rc_elem);
+        oldfile = list_entry(list_pop_back(&recently_closed), gdpfs_file_t, rc_elem);
         oldfile->recently_closed = false; // not in list anymore!
-        EP_ASSERT(ep_thr_mutex_unlock(&rc_lock) == 0);
-        estat = _file_dealloc(oldfile);
     }
     else
-    {
         recently_closed_size++;
-        EP_ASSERT(ep_thr_mutex_unlock(&rc_lock) == 0);
-        estat = GDPFS_STAT_OK;
-    }
+    EP_ASSERT(ep_thr_mutex_unlock(&rc_lock) == 0);
 
-    return estat;
+    return oldfile;
 }
 
 void
@@ -278,111 +652,612 @@ gdpfs_file_create(uint64_t* fhp, gdpfs_file_gname_t log_iname,
     return GDPFS_STAT_OK;
 }
 
-static EP_STAT
-open_file(uint64_t *fhp, gdpfs_file_gname_t log_name, gdpfs_file_type_t type,
-        gdpfs_file_mode_t perm, bool init, bool strict_init)
+/*
+ * Reads the extent table of a data record whose header, entry, has just been
+ * read from ent, leaving ent at the start of the data. A record with a single
+ * extent gets a table of one. exts must hold GDPFS_FMETA_MAX_EXTENTS entries.
+ * Returns the number of extents, or 0 if the table doesn't fit the record.
+ */
+static uint32_t
+_file_read_extents(gdpfs_log_ent_t *ent, const gdpfs_fmeta_t *entry,
+        gdpfs_extent_t *exts)
 {
-    EP_STAT estat;
-    uint64_t fh;
-    gdpfs_file_t *file = NULL;
-    char *cache_name = NULL;
-    char *cache_bitmap_name = NULL;
-    gdp_pname_t printable;
+    size_t tsize;
 
-    *fhp = -1;
-
-    fh = bitmap_reserve(fhs);
-    if (fh == -1)
+    if (entry->ent_count == 0)
     {
-        estat = GDPFS_STAT_OOMEM;
-        goto fail1;
+        exts[0].offset = entry->ent_offset;
+        exts[0].size = entry->ent_size;
+        return 1;
     }
+    if (entry->ent_count > GDPFS_FMETA_MAX_EXTENTS)
+        return 0;
+    tsize = entry->ent_count * sizeof(gdpfs_extent_t);
+    if (tsize > entry->ent_size || gdpfs_log_ent_read(ent, exts, tsize) != tsize)
+        return 0;
+    return entry->ent_count;
+}
 
-    ep_thr_mutex_lock(&open_lock);
-    // check if the file is already open and in the hash
-    file = ep_hash_search(file_hash, sizeof(gdpfs_file_gname_t), log_name);
+/*
+ * Subscription callback: applies records appended to the log after we loaded
+ * the figtree, so the index, info cache and data cache stay current without
+ * re-reading the tail. Recnos are handed out locally, so anything at or
+ * below last_recno is either one of our own appends or already applied.
+ */
+static void
+_file_remote_append(gdpfs_log_event_t *ev)
+{
+    EP_STAT estat;
+    gdpfs_file_t *file = gdpfs_log_event_getudata(ev);
+    gdpfs_log_ent_t *ent;
+    gdpfs_fmeta_t entry;
+    gdpfs_extent_t exts[GDPFS_FMETA_MAX_EXTENTS];
+    gdpfs_recno_t recno;
+    size_t data_size;
+    uint32_t n;
+    uint32_t i;
 
-    // if there file isn't currently open, create and open it
-    if (!file)
+    if (gdpfs_log_event_gettype(ev) != GDPFS_LOG_EVENT_DATA)
     {
-        file = ep_mem_zalloc(sizeof(gdpfs_file_t));
-        if (!file)
+        if (gdpfs_log_event_gettype(ev) == GDPFS_LOG_EVENT_FAILURE)
+            ep_app_error("Subscription to file log failed");
+        return;
+    }
+    ent = gdpfs_log_event_getent(ev);
+    recno = gdpfs_log_ent_recno(ent);
+    data_size = gdpfs_log_ent_length(ent);
+    if (gdpfs_log_ent_read(ent, &entry, sizeof(gdpfs_fmeta_t)) != sizeof(gdpfs_fmeta_t)
+        || data_size != sizeof(gdpfs_fmeta_t) + entry.ent_size
+        || (n = _file_read_extents(ent, &entry, exts)) == 0)
+    {
+        ep_app_error("Corrupt log entry %ld from subscription", recno);
+        return;
+    }
+
+    ep_thr_rwlock_wrlock(&file->figtree_lock);
+    if (recno <= file->last_recno)
+    {
+        ep_thr_rwlock_unlock(&file->figtree_lock);
+        return;
+    }
+    file->last_recno = recno;
+    if (entry.logent_type == GDPFS_LOGENT_TYPE_CHKPT)
+        file->last_chkpt_recno = recno;
+    if (entry.logent_type == GDPFS_LOGENT_TYPE_DATA)
+    {
+        for (i = 0; i < n; i++)
         {
-            estat = GDPFS_STAT_OOMEM;
-            goto fail0;
+            if (exts[i].size > 0)
+                ft_write(&file->figtree, exts[i].offset,
+                        exts[i].offset + exts[i].size - 1, recno, file->log_handle);
         }
-        estat = gdpfs_log_open(&file->log_handle, log_name);
-        if (!EP_STAT_ISOK(estat))
-            goto fail0;
-        file->hash_key = ep_mem_zalloc(sizeof(gdpfs_file_gname_t));
-        if (!file->hash_key)
+        if (file->info_cache_valid)
         {
-            estat = GDPFS_STAT_OOMEM;
-            goto fail0;
+            file->info_cache.file_size = entry.file_size;
+            file->info_cache.file_type = entry.file_type;
+            file->info_cache.file_perm = entry.file_perm;
         }
-        memcpy(file->hash_key, log_name, sizeof(gdpfs_file_gname_t));
+    }
+    ep_thr_rwlock_unlock(&file->figtree_lock);
 
-        if (use_cache)
+    // Filling the cache writes to disk, so do it after readers are let back in.
+    if (use_cache && entry.logent_type == GDPFS_LOGENT_TYPE_DATA && entry.ent_size > 0)
+    {
+        estat = GDPFS_STAT_OK;
+        ep_thr_mutex_lock(&file->cache_lock);
+        for (i = 0; i < n && EP_STAT_ISOK(estat); i++)
         {
-            // Initialize cache_name and cache_bitmap names
-            gdp_printable_name(log_name, printable);
-            if ((cache_name = ep_mem_zalloc(strlen(CACHE_DIR) + strlen("/")
-                    + strlen(printable) + 1)) == 0)
-            {
-                estat = GDPFS_STAT_OOMEM;
-                goto fail0;
-            }
-            sprintf(cache_name, "%s%s%s", CACHE_DIR, "/", printable);
-            if ((cache_bitmap_name = ep_mem_zalloc(strlen(CACHE_DIR) + strlen("/")
-                    + strlen(printable) + strlen(BITMAP_EXTENSION) + 1)) == 0)
-            {
-                estat = GDPFS_STAT_OOMEM;
-                goto fail0;
-            }
-            sprintf(cache_bitmap_name, "%s%s%s%s", CACHE_DIR, "/",
-                    printable, BITMAP_EXTENSION);
-
-            // Open the cache files and put them in the file struct
-            if ((file->cache_fd = open(cache_name, O_RDWR | O_CREAT, 0744)) == -1)
-            {
-                estat = GDPFS_STAT_LOCAL_FS_FAIL;
-                goto fail0;
-            }
-#ifdef USE_BITMAP
-            if ((file->cache_bitmap_fd = open(cache_bitmap_name, O_RDWR | O_CREAT, 0744)) == -1)
-            {
-                estat = GDPFS_STAT_LOCAL_FS_FAIL;
-                close(file->cache_fd);
-                goto fail0;
-            }
-#endif
-            ep_mem_free(cache_name);
-            ep_mem_free(cache_bitmap_name);
+            if (exts[i].size > 0)
+                estat = gdpfs_file_fill_cache_ent(file, ent, exts[i].size, exts[i].offset);
         }
+        file->cache_gen++;
+        ep_thr_mutex_unlock(&file->cache_lock);
+        if (!EP_STAT_ISOK(estat))
+            ep_app_error("Failed to cache record %ld from subscription", recno);
+    }
+}
 
-        if (ep_thr_mutex_init(&file->ref_count_lock, EP_THR_MUTEX_NORMAL) != 0 ||
-            ep_thr_mutex_init(&file->cache_lock, EP_THR_MUTEX_NORMAL) != 0 ||
-            ep_thr_rwlock_init(&file->figtree_lock) != 0 ||
-            ep_thr_mutex_init(&file->index_flush_lock, EP_THR_MUTEX_NORMAL) != 0 ||
-            ep_thr_cond_init(&file->index_flush_cond) != 0)
-        {
-            estat = GDPFS_STAT_SYNCH_FAIL;
-            goto fail0;
-        }
+/*
+ * Initializes file's figtree from a checkpoint record. ent must have
+ * remaining bytes left, the last of which are the root node.
+ */
+static void
+_file_init_from_chkpt(gdpfs_file_t *file, gdpfs_log_ent_t *ent, size_t remaining)
+{
+    figtree_node_t* root = ep_mem_zalloc(sizeof(figtree_node_t));
 
-        file->outstanding_reqs = 0;
+    gdpfs_log_ent_drain(ent, remaining - sizeof(figtree_node_t));
+    gdpfs_log_ent_read(ent, root, sizeof(figtree_node_t));
+    ft_init_with_root(&file->figtree, root);
+}
 
-        // add to hash table at very end to make handling failure cases easier
-        ep_hash_insert(file_hash, sizeof(gdpfs_file_gname_t), log_name, file);
-    }
-    else if (file->recently_closed)
+/*
+ * Initializes file's figtree from the checkpoint at recno. Returns false, and
+ * leaves the figtree alone, if there is no checkpoint there.
+ */
+static bool
+_file_load_chkpt(gdpfs_file_t *file, gdpfs_recno_t recno)
+{
+    gdpfs_log_ent_t ent;
+    gdpfs_fmeta_t entry;
+    size_t data_size;
+    bool ok;
+
+    if (!EP_STAT_ISOK(gdpfs_log_ent_open(file->log_handle, &ent, recno, false)))
+        return false;
+    data_size = gdpfs_log_ent_length(&ent);
+    ok = gdpfs_log_ent_read(&ent, &entry, sizeof(gdpfs_fmeta_t)) == sizeof(gdpfs_fmeta_t)
+        && data_size == sizeof(gdpfs_fmeta_t) + entry.ent_size
+        && entry.logent_type == GDPFS_LOGENT_TYPE_CHKPT
+        && entry.ent_size > 0
+        && entry.ent_size % sizeof(figtree_node_t) == 0;
+    if (ok)
+        _file_init_from_chkpt(file, &ent, entry.ent_size);
+    else
+        ep_app_warn("Record %ld is not a checkpoint; scanning for one", recno);
+    gdpfs_log_ent_close(&ent);
+    return ok;
+}
+
+/* Header of one record of the suffix replayed on open. */
+typedef struct
+{
+    gdpfs_logent_type_t type;
+    uint32_t n;
+    gdpfs_extent_t one;
+    gdpfs_extent_t *exts;   // &one unless the record has several extents
+} replay_hdr_t;
+
+/* Collects the suffix's headers as the multiread delivers them. */
+typedef struct
+{
+    replay_hdr_t *hdrs;
+    gdpfs_recno_t first;
+    int n;
+    int got;
+    bool done;
+    EP_STAT estat;
+    EP_THR_MUTEX lock;
+    EP_THR_COND cond;
+} replay_t;
+
+static void
+_file_replay_cb(gdpfs_log_event_t *ev)
+{
+    replay_t *rs = gdpfs_log_event_getudata(ev);
+    gdpfs_log_ent_t *ent;
+    gdpfs_fmeta_t entry;
+    gdpfs_extent_t exts[GDPFS_FMETA_MAX_EXTENTS];
+    replay_hdr_t *hdr;
+    gdpfs_recno_t i;
+    size_t len;
+    uint32_t n = 0;
+
+    ep_thr_mutex_lock(&rs->lock);
+    switch (gdpfs_log_event_gettype(ev))
+    {
+    case GDPFS_LOG_EVENT_DATA:
+        ent = gdpfs_log_event_getent(ev);
+        i = gdpfs_log_ent_recno(ent) - rs->first;
+        len = gdpfs_log_ent_length(ent);
+        if (i < 0 || i >= rs->n
+            || gdpfs_log_ent_read(ent, &entry, sizeof(gdpfs_fmeta_t)) != sizeof(gdpfs_fmeta_t)
+            || len != sizeof(gdpfs_fmeta_t) + entry.ent_size
+            || (n = _file_read_extents(ent, &entry, exts)) == 0)
+        {
+            if (EP_STAT_ISOK(rs->estat))
+                rs->estat = GDPFS_STAT_CORRUPT;
+            break;
+        }
+        // Only the header matters here; the data is read when it's wanted.
+        hdr = &rs->hdrs[i];
+        hdr->type = entry.logent_type;
+        hdr->n = n;
+        hdr->one = exts[0];
+        hdr->exts = &hdr->one;
+        if (n > 1)
+        {
+            hdr->exts = ep_mem_malloc(n * sizeof(gdpfs_extent_t));
+            memcpy(hdr->exts, exts, n * sizeof(gdpfs_extent_t));
+        }
+        rs->got++;
+        break;
+    case GDPFS_LOG_EVENT_FAILURE:
+        if (EP_STAT_ISOK(rs->estat))
+            rs->estat = gdpfs_log_event_getstat(ev);
+        break;
+    case GDPFS_LOG_EVENT_EOS:
+        rs->done = true;
+        ep_thr_cond_signal(&rs->cond);
+        break;
+    default:
+        break;
+    }
+    ep_thr_mutex_unlock(&rs->lock);
+}
+
+/*
+ * Applies one replayed record to file's figtree. Whatever the data cache
+ * holds for its range may predate it, so that range is dropped and refilled
+ * by the first read. Caller holds figtree_lock for writing.
+ */
+static void
+_file_replay_apply(gdpfs_file_t *file, gdpfs_logent_type_t type,
+        const gdpfs_extent_t *exts, uint32_t n, gdpfs_recno_t recno)
+{
+    uint32_t i;
+
+    if (type != GDPFS_LOGENT_TYPE_DATA)
+        return;
+    for (i = 0; i < n; i++)
+    {
+        if (exts[i].size == 0)
+            continue;
+        ft_write(&file->figtree, exts[i].offset, exts[i].offset + exts[i].size - 1,
+                recno, file->log_handle);
+        if (use_cache)
+        {
+            ep_thr_mutex_lock(&file->cache_lock);
+            gdpfs_file_uncache(file, exts[i].size, exts[i].offset);
+            ep_thr_mutex_unlock(&file->cache_lock);
+        }
+    }
+}
+
+/*
+ * Replays the n records starting at first into file's figtree, in one
+ * multiread. Only their headers are kept, so this costs one round trip
+ * and a few bytes per record no matter how much data they carry. Caller
+ * holds figtree_lock for writing.
+ */
+static EP_STAT
+_file_replay_suffix(gdpfs_file_t *file, gdpfs_recno_t first, int n)
+{
+    EP_STAT estat;
+    replay_t rs;
+    int i;
+
+    memset(&rs, 0, sizeof(rs));
+    rs.hdrs = ep_mem_zalloc(n * sizeof(replay_hdr_t));
+    if (rs.hdrs == NULL)
+        return GDPFS_STAT_OOMEM;
+    rs.first = first;
+    rs.n = n;
+    rs.estat = GDPFS_STAT_OK;
+    if (ep_thr_mutex_init(&rs.lock, EP_THR_MUTEX_DEFAULT) != 0 ||
+        ep_thr_cond_init(&rs.cond) != 0)
+    {
+        estat = GDPFS_STAT_SYNCH_FAIL;
+        goto fail0;
+    }
+
+    estat = gdpfs_log_multiread(file->log_handle, first, n, _file_replay_cb, &rs);
+    if (EP_STAT_ISOK(estat))
+    {
+        ep_thr_mutex_lock(&rs.lock);
+        while (!rs.done)
+            ep_thr_cond_wait(&rs.cond, &rs.lock, NULL);
+        ep_thr_mutex_unlock(&rs.lock);
+        estat = rs.estat;
+        if (EP_STAT_ISOK(estat) && rs.got != n)
+            estat = GDPFS_STAT_NOTFOUND;
+    }
+    ep_thr_mutex_destroy(&rs.lock);
+    ep_thr_cond_destroy(&rs.cond);
+    if (!EP_STAT_ISOK(estat))
+        goto fail0;
+
+    for (i = 0; i < n; i++)
+        _file_replay_apply(file, rs.hdrs[i].type, rs.hdrs[i].exts,
+                rs.hdrs[i].n, first + i);
+
+fail0:
+    for (i = 0; i < n; i++)
+    {
+        if (rs.hdrs[i].n > 1)
+            ep_mem_free(rs.hdrs[i].exts);
+    }
+    ep_mem_free(rs.hdrs);
+    return estat;
+}
+
+/*
+ * Builds file's figtree from its log: from the checkpoint the tail names if
+ * there is one, otherwise by scanning back for the latest checkpoint and
+ * replaying what follows it. Caller holds figtree_lock for writing. On
+ * failure the figtree is left uninitialized.
+ */
+static EP_STAT
+_file_load_figtree(gdpfs_file_t *file)
+{
+    EP_STAT estat;
+    gdpfs_log_ent_t* ents;
+    gdpfs_log_ent_t* more;
+    gdpfs_recno_t recno;
+    gdpfs_recno_t chkpt_recno = 0;
+    gdpfs_recno_t recnos[OPEN_SCAN_BATCH];
+    gdpfs_extent_t exts[GDPFS_FMETA_MAX_EXTENTS];
+    uint32_t nexts;
+    gdpfs_fmeta_t entry;
+    size_t data_size;
+    int entslen = 16;
+    int enti = 0;
+    int batch;
+    int j, k;
+    bool found = false;
+
+    ents = ep_mem_zalloc(entslen * sizeof(gdpfs_log_ent_t));
+    if (ents == NULL)
+        return GDPFS_STAT_OOMEM;
+    estat = gdpfs_log_ent_open(file->log_handle, &ents[0], -1, true);
+    recno = gdpfs_log_ent_recno(&ents[0]);
+    file->last_recno = recno;
+    if (EP_STAT_ISOK(estat) &&
+        gdpfs_log_ent_peek(&ents[0], &entry, sizeof(gdpfs_fmeta_t)) == sizeof(gdpfs_fmeta_t))
+    {
+        chkpt_recno = entry.logent_type == GDPFS_LOGENT_TYPE_CHKPT ?
+                recno : entry.chkpt_recno;
+    }
+    gdpfs_log_ent_close(&ents[0]);
+    if (!EP_STAT_ISOK(estat) && !EP_STAT_IS_SAME(estat, GDPFS_STAT_NOTFOUND))
+    {
+        ep_mem_free(ents);
+        ep_app_error("Cannot read the tail of the file log");
+        return estat;
+    }
+    if (EP_STAT_IS_SAME(estat, GDPFS_STAT_NOTFOUND))
+    {
+        // Empty log, just initialize the fig tree
+        recno = 0;
+    }
+    /* The tail names the latest checkpoint, so normally we can go
+     * straight to it and fetch only the records after it. Older logs
+     * without the pointer still get the scan below. */
+    else if (chkpt_recno > 0 && chkpt_recno <= recno &&
+            _file_load_chkpt(file, chkpt_recno))
+    {
+        file->last_chkpt_recno = chkpt_recno;
+        if (recno > chkpt_recno)
+        {
+            estat = _file_replay_suffix(file, chkpt_recno + 1, recno - chkpt_recno);
+            if (!EP_STAT_ISOK(estat))
+            {
+                // Leave the figtree for the next open to build again.
+                ft_dealloc(&file->figtree);
+                ep_mem_free(ents);
+                ep_app_error("Cannot replay file log after its checkpoint");
+                return estat;
+            }
+            // A long suffix to replay is as good a reason to checkpoint as writes.
+            file->recs_since_chkpt = recno - chkpt_recno;
+            ep_time_now(&file->dirty_since);
+        }
+        found = true;
+    }
+    /* Walk back from the tail looking for the checkpoint, fetching
+     * OPEN_SCAN_BATCH records per round trip. ents ends up newest first. */
+    for (; recno > 0 && !found; recno -= batch)
+    {
+        batch = min(recno, (gdpfs_recno_t) OPEN_SCAN_BATCH);
+        while (enti + batch > entslen) {
+            more = ep_mem_realloc(ents, (entslen << 1) * sizeof(gdpfs_log_ent_t));
+            if (more == NULL)
+            {
+                estat = GDPFS_STAT_OOMEM;
+                break;
+            }
+            ents = more;
+            entslen <<= 1;
+        }
+        if (EP_STAT_ISOK(estat))
+        {
+            for (k = 0; k < batch; k++)
+                recnos[k] = recno - k;
+            estat = gdpfs_log_ent_open_vec(file->log_handle, &ents[enti],
+                    recnos, batch, true, NULL, NULL);
+        }
+        if (!EP_STAT_ISOK(estat))
+        {
+            // Nothing has been applied yet; the next open scans again.
+            for (k = 0; k < enti; k++)
+                gdpfs_log_ent_close(&ents[k]);
+            ep_mem_free(ents);
+            ep_app_error("Cannot scan file log for its checkpoint");
+            return estat;
+        }
+        for (k = 0; k < batch; k++)
+        {
+            gdpfs_log_ent_t* ent = &ents[enti + k];
+
+            data_size = gdpfs_log_ent_length(ent);
+            if (gdpfs_log_ent_peek(ent, &entry, sizeof(gdpfs_fmeta_t)) != sizeof(gdpfs_fmeta_t)
+                || data_size != sizeof(gdpfs_fmeta_t) + entry.ent_size)
+            {
+                ep_app_fatal("Corrupt log entry in file (#1).");
+            }
+
+            /* Check if this is the index. */
+            if (entry.logent_type == GDPFS_LOGENT_TYPE_CHKPT)
+            {
+                file->last_chkpt_recno = recno - k;
+                EP_ASSERT_REQUIRE((entry.ent_size % sizeof(figtree_node_t)) == 0);
+
+                //printf("Found the checkpoint!\n");
+
+                EP_ASSERT(entry.ent_size > 0);
+
+                _file_init_from_chkpt(file, ent, data_size);
+                found = true;
+
+                // Drop the checkpoint and anything older we fetched with it
+                for (j = k; j < batch; j++)
+                    gdpfs_log_ent_close(&ents[enti + j]);
+                break;
+            }
+        }
+        enti += k;
+    }
+
+    if (!found) {
+        /* No index for this file... */
+        //printf("No index for this file\n");
+        ft_init(&file->figtree);
+    }
+
+    enti--;
+
+    // A long suffix to replay is as good a reason to checkpoint as writes.
+    if (enti >= 0)
+    {
+        file->recs_since_chkpt = enti + 1;
+        ep_time_now(&file->dirty_since);
+    }
+
+    for (; enti >= 0; enti--) {
+        data_size = gdpfs_log_ent_length(&ents[enti]);
+        if (gdpfs_log_ent_read(&ents[enti], &entry, sizeof(gdpfs_fmeta_t)) != sizeof(gdpfs_fmeta_t)
+            || data_size != sizeof(gdpfs_fmeta_t) + entry.ent_size
+            || (nexts = _file_read_extents(&ents[enti], &entry, exts)) == 0)
+        {
+            ep_app_fatal("Corrupt log entry in file (#2).");
+        }
+        _file_replay_apply(file, entry.logent_type, exts, nexts,
+                gdpfs_log_ent_recno(&ents[enti]));
+        gdpfs_log_ent_close(&ents[enti]);
+    }
+
+    ep_mem_free(ents);
+    file->figtree_initialized = true;
+    return GDPFS_STAT_OK;
+}
+
+static EP_STAT
+open_file(uint64_t *fhp, gdpfs_file_gname_t log_name, gdpfs_file_type_t type,
+        gdpfs_file_mode_t perm, bool init, bool strict_init)
+{
+    EP_STAT estat;
+    uint64_t fh;
+    gdpfs_file_t *file = NULL;
+    file_shard_t *shard;
+    char *cache_name = NULL;
+    char *cache_bitmap_name = NULL;
+    gdpfs_recno_t sub_recno;
+    bool subscribe;
+    gdp_pname_t printable;
+
+    *fhp = -1;
+
+    fh = fh_table_reserve(fhs);
+    if (fh == -1)
+    {
+        estat = GDPFS_STAT_OOMEM;
+        goto fail1;
+    }
+
+    shard = _file_shard(log_name);
+    ep_thr_mutex_lock(&shard->lock);
+    // check if the file is already open and in the hash
+    file = ep_hash_search(shard->hash, sizeof(gdpfs_file_gname_t), log_name);
+
+    // if there file isn't currently open, create and open it
+    if (!file)
+    {
+        file = ep_mem_zalloc(sizeof(gdpfs_file_t));
+        if (!file)
+        {
+            estat = GDPFS_STAT_OOMEM;
+            goto fail0;
+        }
+        estat = gdpfs_log_open(&file->log_handle, log_name);
+        if (!EP_STAT_ISOK(estat))
+            goto fail0;
+        file->hash_key = ep_mem_zalloc(sizeof(gdpfs_file_gname_t));
+        if (!file->hash_key)
+        {
+            estat = GDPFS_STAT_OOMEM;
+            goto fail0;
+        }
+        memcpy(file->hash_key, log_name, sizeof(gdpfs_file_gname_t));
+
+        if (use_cache)
+        {
+            // Initialize cache_name and cache_bitmap names
+            gdp_printable_name(log_name, printable);
+            if ((cache_name = ep_mem_zalloc(strlen(CACHE_DIR) + strlen("/")
+                    + strlen(printable) + 1)) == 0)
+            {
+                estat = GDPFS_STAT_OOMEM;
+                goto fail0;
+            }
+            sprintf(cache_name, "%s%s%s", CACHE_DIR, "/", printable);
+            if ((cache_bitmap_name = ep_mem_zalloc(strlen(CACHE_DIR) + strlen("/")
+                    + strlen(printable) + strlen(BITMAP_EXTENSION) + 1)) == 0)
+            {
+                estat = GDPFS_STAT_OOMEM;
+                goto fail0;
+            }
+            sprintf(cache_bitmap_name, "%s%s%s%s", CACHE_DIR, "/",
+                    printable, BITMAP_EXTENSION);
+
+            // Open the cache files and put them in the file struct
+            // The cache map starts out empty, so whatever an earlier open
+            // left in the file is dead weight.
+            if ((file->cache_fd = open(cache_name, O_RDWR | O_CREAT | O_TRUNC, 0744)) == -1)
+            {
+                estat = GDPFS_STAT_LOCAL_FS_FAIL;
+                goto fail0;
+            }
+#ifdef USE_BITMAP
+            if ((file->cache_bitmap_fd = open(cache_bitmap_name, O_RDWR | O_CREAT, 0744)) == -1)
+            {
+                estat = GDPFS_STAT_LOCAL_FS_FAIL;
+                close(file->cache_fd);
+                goto fail0;
+            }
+#endif
+            ep_mem_free(cache_name);
+            ep_mem_free(cache_bitmap_name);
+        }
+
+        if (ep_thr_mutex_init(&file->cache_lock, EP_THR_MUTEX_NORMAL) != 0 ||
+            ep_thr_rwlock_init(&file->cache_map_lock) != 0 ||
+            ep_thr_rwlock_init(&file->figtree_lock) != 0 ||
+            ep_thr_mutex_init(&file->index_flush_lock, EP_THR_MUTEX_NORMAL) != 0 ||
+            ep_thr_cond_init(&file->index_flush_cond) != 0 ||
+            ep_thr_mutex_init(&file->ack_lock, EP_THR_MUTEX_NORMAL) != 0 ||
+            ep_thr_cond_init(&file->ack_cond) != 0 ||
+            ep_thr_mutex_init(&file->append_seq_lock, EP_THR_MUTEX_NORMAL) != 0 ||
+            ep_thr_cond_init(&file->append_seq_cond) != 0 ||
+            ep_thr_mutex_init(&file->wb_lock, EP_THR_MUTEX_NORMAL) != 0 ||
+            ep_thr_mutex_init(&file->wb_flush_lock, EP_THR_MUTEX_NORMAL) != 0)
+        {
+            estat = GDPFS_STAT_SYNCH_FAIL;
+            goto fail0;
+        }
+        file->wb = ep_mem_zalloc(WB_MAX_EXTENTS * sizeof(wb_extent_t));
+        file->wb_flushing = ep_mem_zalloc(WB_MAX_EXTENTS * sizeof(wb_extent_t));
+        if (file->wb == NULL || file->wb_flushing == NULL)
+        {
+            estat = GDPFS_STAT_OOMEM;
+            goto fail0;
+        }
+
+        file->outstanding_reqs = 0;
+        list_init(&file->appends);
+        gdpfs_compress_state_init(&file->data_zstate);
+        gdpfs_compress_state_init(&file->chkpt_zstate);
+
+        // add to hash table at very end to make handling failure cases easier
+        ep_hash_insert(shard->hash, sizeof(gdpfs_file_gname_t), log_name, file);
+    }
+    else if (file->recently_closed)
     {
         // Revive it from the recently closed cache if necessary
         _recently_closed_revive(file);
     }
     estat = _file_ref(file);
-    files[fh] = file;
-    ep_thr_mutex_unlock(&open_lock);
+    ((fh_slot_t *) fh_table_slot(fhs, fh))->file = file;
+    ep_thr_mutex_unlock(&shard->lock);
     if (!EP_STAT_ISOK(estat))
         goto fail2;
 
@@ -409,7 +1284,9 @@ open_file(uint64_t *fhp, gdpfs_file_gname_t log_name, gdpfs_file_type_t type,
                 current_info->file_size = 0;
                 current_info->file_type = type;
                 current_info->file_perm = perm;
-                do_write(fh, NULL, 0, 0, current_info);
+                estat = do_write_meta(fh, current_info);
+                if (!EP_STAT_ISOK(estat))
+                    goto fail2;
             }
             else if (current_info->file_type == GDPFS_FILE_TYPE_UNKNOWN || strict_init)
             {
@@ -437,112 +1314,40 @@ open_file(uint64_t *fhp, gdpfs_file_gname_t log_name, gdpfs_file_type_t type,
     }
     else if (!file->figtree_initialized)
     {
-        gdpfs_log_ent_t* ents;
-        gdpfs_recno_t recno;
-        gdpfs_fmeta_t entry;
-        size_t data_size;
-        int entslen = 16;
-        int enti = 0;
-        char bounce[1024];
-        size_t read;
-        size_t toread;
-
-        ents = ep_mem_zalloc(entslen * sizeof(gdpfs_log_ent_t));
-        estat = gdpfs_log_ent_open(file->log_handle, &ents[0], -1, true);
-        recno = gdpfs_log_ent_recno(&ents[0]);
-        file->last_recno = recno;
-        gdpfs_log_ent_close(&ents[0]);
-        if (EP_STAT_IS_SAME(estat, GDPFS_STAT_NOTFOUND))
+        estat = _file_load_figtree(file);
+        if (!EP_STAT_ISOK(estat))
         {
-            // Empty log, just initialize the fig tree
-            recno = 0;
+            ep_thr_rwlock_unlock(&file->figtree_lock);
+            goto fail2;
         }
-        for (; recno > 0; recno--)
-        {
-            if (enti >= entslen) {
-                entslen <<= 1;
-                ents = ep_mem_realloc(ents, entslen * sizeof(gdpfs_log_ent_t));
-            }
-
-            // Check estat
-            estat = gdpfs_log_ent_open(file->log_handle, &ents[enti], recno, true);
-            EP_ASSERT_INSIST(EP_STAT_ISOK(estat));
-            data_size = gdpfs_log_ent_length(&ents[enti]);
-            if (gdpfs_log_ent_peek(&ents[enti], &entry, sizeof(gdpfs_fmeta_t)) != sizeof(gdpfs_fmeta_t)
-                || data_size != sizeof(gdpfs_fmeta_t) + entry.ent_size)
-            {
-                ep_app_fatal("Corrupt log entry in file (#1).");
-            }
+    }
+    subscribe = !file->subscribed;
+    file->subscribed = true;
+    sub_recno = file->last_recno + 1;
+    ep_thr_rwlock_unlock(&file->figtree_lock);
 
-            /* Check if this is the index. */
-            if (entry.logent_type == GDPFS_LOGENT_TYPE_CHKPT)
-            {
-                EP_ASSERT_REQUIRE((entry.ent_size % sizeof(figtree_node_t)) == 0);
+    // Anything we append meanwhile is at or below last_recno and is skipped.
+    if (subscribe)
+    {
+        estat = gdpfs_log_subscribe(file->log_handle, sub_recno,
+                _file_remote_append, file);
+        if (!EP_STAT_ISOK(estat))
+        {
+            ep_app_warn("Not subscribed to file log; remote changes won't be seen");
+            ep_thr_rwlock_wrlock(&file->figtree_lock);
+            file->subscribed = false;
+            ep_thr_rwlock_unlock(&file->figtree_lock);
+        }
+    }
 
-                //printf("Found the checkpoint!\n");
+    // success
 
-                EP_ASSERT(entry.ent_size > 0);
-
-                /* Get the last node in the log; that is the root. */
-                figtree_node_t* root = ep_mem_zalloc(sizeof(figtree_node_t));
-                gdpfs_log_ent_drain(&ents[enti], data_size - sizeof(figtree_node_t));
-                gdpfs_log_ent_read(&ents[enti], root, sizeof(figtree_node_t));
-                ft_init_with_root(&file->figtree, root);
-                break;
-            }
-
-            enti++;
-        }
-
-        if (recno == 0) {
-            /* No index for this file... */
-            //printf("No index for this file\n");
-            ft_init(&file->figtree);
-        }
-
-        enti--;
-
-        ep_thr_mutex_lock(&file->cache_lock);
-        for (; enti >= 0; enti--) {
-            data_size = gdpfs_log_ent_length(&ents[enti]);
-            if (gdpfs_log_ent_read(&ents[enti], &entry, sizeof(gdpfs_fmeta_t)) != sizeof(gdpfs_fmeta_t)
-                || data_size != sizeof(gdpfs_fmeta_t) + entry.ent_size)
-            {
-                ep_app_fatal("Corrupt log entry in file (#2).");
-            }
-            if (entry.ent_size > 0) {
-                //printf("Writing [%lu, %lu]: %lu\n", entry.ent_offset, entry.ent_offset + entry.ent_size - 1, gdpfs_log_ent_recno(&ents[enti]));
-                ft_write(&file->figtree, entry.ent_offset, entry.ent_offset + entry.ent_size - 1, gdpfs_log_ent_recno(&ents[enti]), file->log_handle);
-                read = 0;
-                // while we're at it, populate the cache
-                while (read < entry.ent_size) {
-                    toread = entry.ent_size - read;
-                    if (toread > 1024) {
-                        toread = 1024;
-                    }
-                    EP_ASSERT_INSIST(toread == gdpfs_log_ent_read(&ents[enti], bounce, toread));
-                    estat = gdpfs_file_fill_cache(file, bounce, toread, entry.ent_offset + read, true);
-                    EP_ASSERT_INSIST(EP_STAT_ISOK(estat));
-                    read += toread;
-                }
-            }
-            gdpfs_log_ent_close(&ents[enti]);
-        }
-        ep_thr_mutex_unlock(&file->cache_lock);
-
-        ep_mem_free(ents);
-        file->figtree_initialized = true;
-    }
-    ep_thr_rwlock_unlock(&file->figtree_lock);
-
-    // success
-
-    *fhp = fh;
-    return GDPFS_STAT_OK;
+    *fhp = fh;
+    return GDPFS_STAT_OK;
 
 fail0:
-    ep_thr_mutex_unlock(&open_lock);
-    bitmap_release(fhs, fh);
+    ep_thr_mutex_unlock(&shard->lock);
+    fh_table_release(fhs, fh);
     if (use_cache)
     {
         ep_mem_free(cache_name);
@@ -550,7 +1355,13 @@ fail0:
     }
     if (file)
     {
+        if (file->log_handle)
+            gdpfs_log_close(file->log_handle);
         ep_mem_free(file->hash_key);
+        if (file->wb != NULL)
+            ep_mem_free(file->wb);
+        if (file->wb_flushing != NULL)
+            ep_mem_free(file->wb_flushing);
         ep_mem_free(file);
     }
 fail1:
@@ -590,26 +1401,53 @@ EP_STAT
 gdpfs_file_close(uint64_t fh)
 {
     gdpfs_file_t *file;
+    fh_slot_t *slot;
     EP_STAT estat;
+    EP_STAT flush_stat;
 
     file = lookup_fh(fh);
     if (file == NULL)
         return GDPFS_STAT_BADFH;
-    bitmap_release(fhs, fh);
+    slot = fh_table_slot(fhs, fh);
+    // Whoever opens the file next, here or elsewhere, sees what we wrote.
+    flush_stat = _file_wb_flush(file);
+    if (use_cache)
+    {
+        // End the handle's stream before the fh can be handed out again.
+        ep_thr_mutex_lock(&readahead_lock);
+        slot->ra.next = 0;
+        slot->ra.end = 0;
+        slot->ra.window = 0;
+        slot->ra.epoch++;
+        ep_thr_mutex_unlock(&readahead_lock);
+    }
+    slot->file = NULL;
+    fh_table_release(fhs, fh);
 
     estat = _file_unref(file);
+    if (EP_STAT_ISOK(estat))
+        estat = flush_stat;
     return estat;
 }
 
+static void _file_free(gdpfs_file_t* file);
+
 static void
-_file_chkpt_finish(gdp_event_t* ev)
+_file_chkpt_finish(gdpfs_log_event_t* ev)
 {
     bool dontfree = false;
 
-    gdpfs_file_t* file = gdp_event_getudata(ev);
+    gdpfs_file_t* file = gdpfs_log_event_getudata(ev);
     if (file == NULL)
         return;
 
+    if (!EP_STAT_ISOK(gdpfs_log_event_getstat(ev)))
+    {
+        ep_thr_mutex_lock(&file->append_seq_lock);
+        __atomic_store_n(&file->append_broken, true, __ATOMIC_RELEASE);
+        ep_thr_mutex_unlock(&file->append_seq_lock);
+    }
+
     ep_thr_mutex_lock(&file->index_flush_lock);
     if ((--file->index_flush_reqs) != 0)
     {
@@ -620,22 +1458,45 @@ _file_chkpt_finish(gdp_event_t* ev)
     if (dontfree)
         return;
 
-    EP_ASSERT(ep_thr_mutex_lock(&open_lock) == 0);
+    _file_free(file);
+}
+
+/*
+ * Deallocates file unless it has been reopened or is on the recently closed
+ * list. Its checkpoints must all have landed.
+ */
+static void
+_file_free(gdpfs_file_t* file)
+{
+    file_shard_t *shard = _file_shard((uint8_t *) file->hash_key);
+    bool dontfree = false;
+
+    // New references only come from opens, which hold the shard lock, or
+    // from holders of one.
+    EP_ASSERT(ep_thr_mutex_lock(&shard->lock) == 0);
     EP_ASSERT(ep_thr_mutex_lock(&rc_lock) == 0);
-    EP_ASSERT(ep_thr_mutex_lock(&file->ref_count_lock) == 0);
-    if (file->ref_count != 0 || file->recently_closed)
+    if (__atomic_load_n(&file->ref_count, __ATOMIC_ACQUIRE) != 0 ||
+        file->recently_closed)
     {
         // Drop locks and don't deallocate!
         dontfree = true;
     }
-    EP_ASSERT(ep_thr_mutex_unlock(&file->ref_count_lock) == 0);
+    else
+    {
+        // Once out of the hash, nothing else can find file.
+        ep_hash_delete(shard->hash, sizeof(gdpfs_file_gname_t), file->hash_key);
+    }
     EP_ASSERT(ep_thr_mutex_unlock(&rc_lock) == 0);
-    EP_ASSERT(ep_thr_mutex_unlock(&open_lock) == 0);
+    EP_ASSERT(ep_thr_mutex_unlock(&shard->lock) == 0);
 
     if (dontfree)
         return;
 
-    ep_hash_delete(file_hash, sizeof(gdpfs_file_gname_t), file->hash_key);
+    // No subscription callbacks may touch file past this point. The handle
+    // itself goes back to the log layer's pool for the next open.
+    gdpfs_log_unsubscribe(file->log_handle);
+    gdpfs_log_close(file->log_handle);
+
     if (use_cache)
     {
         close(file->cache_fd);
@@ -645,34 +1506,165 @@ _file_chkpt_finish(gdp_event_t* ev)
     }
     ep_mem_free(file->hash_key);
 
-    ft_dealloc(&file->figtree);
+    if (file->figtree_initialized)
+        ft_dealloc(&file->figtree);
 
-    EP_ASSERT (ep_thr_mutex_destroy(&file->ref_count_lock) == 0);
     EP_ASSERT (ep_thr_mutex_destroy(&file->cache_lock) == 0);
+    EP_ASSERT (ep_thr_rwlock_destroy(&file->cache_map_lock) == 0);
+    if (file->cache_map != NULL)
+        ep_mem_free(file->cache_map);
     EP_ASSERT (ep_thr_rwlock_destroy(&file->figtree_lock) == 0);
     EP_ASSERT (ep_thr_mutex_destroy(&file->index_flush_lock) == 0);
     EP_ASSERT (ep_thr_cond_destroy(&file->index_flush_cond) == 0);
+    EP_ASSERT (ep_thr_mutex_destroy(&file->ack_lock) == 0);
+    EP_ASSERT (ep_thr_cond_destroy(&file->ack_cond) == 0);
+    EP_ASSERT (ep_thr_mutex_destroy(&file->append_seq_lock) == 0);
+    EP_ASSERT (ep_thr_cond_destroy(&file->append_seq_cond) == 0);
+    EP_ASSERT (ep_thr_mutex_destroy(&file->wb_lock) == 0);
+    EP_ASSERT (ep_thr_mutex_destroy(&file->wb_flush_lock) == 0);
+    EP_ASSERT(file->wb_n == 0);
+    ep_mem_free(file->wb);
+    ep_mem_free(file->wb_flushing);
     ep_mem_free(file);
 }
 
 
 
-/* The index_flush_lock must be held when entering this function. */
-void
-_file_chkpt(gdpfs_file_t* file, bool do_callback)
+/*
+ * Appends ent to file's log once every record whose ticket comes before
+ * ticket has been handed to the log, which lands it at recno. If an earlier
+ * one failed, recno would be wrong, so this fails without appending; a
+ * failure here marks the file broken the same way. A NULL ent just gives up
+ * the turn, which is a failure too since recno goes unused.
+ */
+static EP_STAT
+_file_append_in_turn(gdpfs_file_t *file, uint64_t ticket, gdpfs_recno_t recno,
+        gdpfs_log_ent_t *ent, gdpfs_callback_t cb, void *udata)
+{
+    EP_STAT estat = GDPFS_STAT_RW_FAILED;
+    bool broken;
+
+    ep_thr_mutex_lock(&file->append_seq_lock);
+    while (file->append_turn != ticket) {
+        ep_thr_cond_wait(&file->append_seq_cond, &file->append_seq_lock, NULL);
+    }
+    broken = file->append_broken;
+    ep_thr_mutex_unlock(&file->append_seq_lock);
+
+    if (!broken && ent != NULL)
+    {
+        gdpfs_log_note_append(file->log_handle, recno);
+        estat = gdpfs_log_append(file->log_handle, ent, cb, udata);
+    }
+
+    ep_thr_mutex_lock(&file->append_seq_lock);
+    if (!EP_STAT_ISOK(estat))
+        __atomic_store_n(&file->append_broken, true, __ATOMIC_RELEASE);
+    file->append_turn++;
+    ep_thr_cond_broadcast(&file->append_seq_cond);
+    ep_thr_mutex_unlock(&file->append_seq_lock);
+    return estat;
+}
+
+/*
+ * Once an append has failed, rebuilds file's figtree from what actually
+ * made it to the log and drops the data cache, which may hold the failed
+ * writes. A no-op otherwise. Must not be called with index_flush_lock held.
+ */
+static EP_STAT
+_file_recover(gdpfs_file_t *file)
+{
+    EP_STAT estat = GDPFS_STAT_OK;
+    bool broken;
+
+    if (!__atomic_load_n(&file->append_broken, __ATOMIC_ACQUIRE))
+        return GDPFS_STAT_OK;
+
+    // Nothing new reaches the log while the file is broken, so once what
+    // is out has been acked the tail is final. Waited for outside
+    // figtree_lock, which log callbacks may need.
+    ep_thr_mutex_lock(&file->ack_lock);
+    while (!list_empty(&file->appends))
+        ep_thr_cond_wait(&file->ack_cond, &file->ack_lock, NULL);
+    ep_thr_mutex_unlock(&file->ack_lock);
+
+    // Holding figtree_lock stops new recnos being taken. Those already
+    // taken fail in turn without going to the log.
+    ep_thr_rwlock_wrlock(&file->figtree_lock);
+    ep_thr_mutex_lock(&file->append_seq_lock);
+    while (file->append_turn != file->append_ticket)
+        ep_thr_cond_wait(&file->append_seq_cond, &file->append_seq_lock, NULL);
+    broken = file->append_broken;
+    ep_thr_mutex_unlock(&file->append_seq_lock);
+    ep_thr_mutex_lock(&file->ack_lock);
+    while (!list_empty(&file->appends))
+        ep_thr_cond_wait(&file->ack_cond, &file->ack_lock, NULL);
+    ep_thr_mutex_unlock(&file->ack_lock);
+
+    // Someone else may have got here first.
+    if (broken)
+    {
+        ep_app_warn("An append to the file log failed; rebuilding its index");
+        if (file->figtree_initialized)
+            ft_dealloc(&file->figtree);
+        file->figtree_initialized = false;
+        file->last_chkpt_recno = 0;
+        estat = _file_load_figtree(file);
+        if (EP_STAT_ISOK(estat))
+        {
+            file->new_file = false;
+            file->info_cache_valid = false;
+            if (use_cache)
+            {
+                ep_thr_mutex_lock(&file->cache_lock);
+                ep_thr_rwlock_wrlock(&file->cache_map_lock);
+                file->cache_map_n = 0;
+                ep_thr_rwlock_unlock(&file->cache_map_lock);
+                file->cache_gen++;
+                ep_thr_mutex_unlock(&file->cache_lock);
+            }
+            ep_thr_mutex_lock(&file->append_seq_lock);
+            __atomic_store_n(&file->append_broken, false, __ATOMIC_RELEASE);
+            ep_thr_mutex_unlock(&file->append_seq_lock);
+        }
+    }
+    ep_thr_rwlock_unlock(&file->figtree_lock);
+    return estat;
+}
+
+/*
+ * Appends a checkpoint of file's dirty figtree nodes, if there are any, and
+ * sets *appended to whether it did. On failure nothing counts as
+ * checkpointed, so the background thread tries again once the file has
+ * recovered. The index_flush_lock must be held when entering this function.
+ */
+EP_STAT
+_file_chkpt(gdpfs_file_t* file, bool do_callback, bool *appended)
 {
     EP_STAT estat;
     figtree_node_t* chkpt;
     int len;
     gdpfs_log_ent_t ent;
     gdpfs_file_info_t* info;
+    void *zbuf = NULL;
+    size_t zlen;
+    uint8_t hdr[GDPFS_FMETA_MAX_SIZE];
+    size_t hlen;
+    uint64_t ticket;
+    gdpfs_recno_t rc;
+    gdpfs_recno_t prev_chkpt_recno;
+    int prev_recs;
+    size_t prev_bytes;
+    bool built;
 
     EP_ASSERT_REQUIRE (file != NULL);
+    *appended = false;
 
     estat = _file_get_info_raw(&info, file);
     if (!EP_STAT_ISOK(estat))
     {
-        ep_app_fatal("Failed to read file size.");
+        ep_app_error("Failed to read file size.");
+        return estat;
     }
 
     gdpfs_fmeta_t entry = {
@@ -682,320 +1674,1299 @@ _file_chkpt(gdpfs_file_t* file, bool do_callback)
         .logent_type = GDPFS_LOGENT_TYPE_CHKPT,
         .ent_offset  = -1,
         .ent_size    = 0,
-        .magic       = MAGIC_NUMBER,
+        .magic       = GDPFS_FMETA_V1_MAGIC,
     };
 
+    // Before taking a recno, which has to be used once taken.
+    estat = gdpfs_log_ent_init(&ent);
+    if (!EP_STAT_ISOK(estat))
+        return estat;
+
     /* Now checkpoint the log. */
     //gdp_pname_t pn;
     //gdp_printable_name(file->_log_handle->gname, pn);
     //printf("%s: Checkpoint at record %ld\n", pn, file->last_recno + 1);
     ep_thr_rwlock_wrlock(&file->figtree_lock);
-    get_dirty(&chkpt, &len, &file->figtree, ++file->last_recno);
-    ep_thr_rwlock_unlock(&file->figtree_lock);
-    if (len > 0)
+    get_dirty(&chkpt, &len, &file->figtree, file->last_recno + 1);
+    if (len == 0)
     {
-        file->index_flush_reqs++;
-        entry.ent_size = len * sizeof(figtree_node_t);
-        gdpfs_log_ent_init(&ent);
-        gdpfs_log_ent_write(&ent, &entry, sizeof(gdpfs_fmeta_t));
-        gdpfs_log_ent_write(&ent, chkpt, entry.ent_size);
+        // Nothing to write, so don't use up a recno.
+        ep_thr_rwlock_unlock(&file->figtree_lock);
         ep_mem_free(chkpt);
+        gdpfs_log_ent_close(&ent);
+        return GDPFS_STAT_OK;
+    }
+    prev_chkpt_recno = file->last_chkpt_recno;
+    prev_recs = file->recs_since_chkpt;
+    prev_bytes = file->bytes_since_chkpt;
+    rc = file->last_chkpt_recno = ++file->last_recno;
+    file->recs_since_chkpt = 0;
+    file->bytes_since_chkpt = 0;
+    ticket = file->append_ticket++;
+    ep_thr_rwlock_unlock(&file->figtree_lock);
+
+    if (do_callback)
+        file->index_flush_reqs++;
+    entry.ent_size = len * sizeof(figtree_node_t);
+    if (gdpfs_compress(&file->chkpt_zstate, chkpt, entry.ent_size, &zbuf, &zlen))
+    {
+        hlen = gdpfs_fmeta_encode(&entry, GDPFS_FMETA_FLAG_COMPRESSED, hdr);
+        built = gdpfs_log_ent_write(&ent, hdr, hlen) == 0 &&
+                gdpfs_log_ent_write_ref(&ent, zbuf, zlen) == 0;
+    }
+    else
+    {
+        hlen = gdpfs_fmeta_encode(&entry, 0, hdr);
+        built = gdpfs_log_ent_write(&ent, hdr, hlen) == 0 &&
+                gdpfs_log_ent_write_ref(&ent, chkpt, entry.ent_size) == 0;
+    }
+
+    // Waiting our turn lands the checkpoint at the recno we just took.
+    estat = _file_append_in_turn(file, ticket, rc, built ? &ent : NULL,
+            _file_chkpt_finish, do_callback ? file : NULL);
+    if (!EP_STAT_ISOK(estat))
+    {
+        // The recno is lost and the file will be rebuilt from its log.
+        // Until then, don't point anyone at a checkpoint that isn't there.
+        ep_app_error("Could not append checkpoint: %d", EP_STAT_DETAIL(estat));
+        ep_thr_rwlock_wrlock(&file->figtree_lock);
+        if (file->last_chkpt_recno == rc)
+            file->last_chkpt_recno = prev_chkpt_recno;
+        file->recs_since_chkpt += prev_recs;
+        file->bytes_since_chkpt += prev_bytes;
+        ep_thr_rwlock_unlock(&file->figtree_lock);
+        if (do_callback)
+            file->index_flush_reqs--;
+    }
+    else
+        *appended = true;
+
+    gdpfs_log_ent_close(&ent);
+    ep_mem_free(chkpt);
+    if (zbuf != NULL)
+        ep_mem_free(zbuf);
+    return estat;
+}
+
+EP_STAT
+_file_dealloc(gdpfs_file_t* file)
+{
+    EP_STAT estat = GDPFS_STAT_OK;
+
+    bool pending;
+
+    ep_thr_mutex_lock(&file->index_flush_lock);
+    while (file->outstanding_reqs != 0) {
+        ep_thr_cond_wait(&file->index_flush_cond, &file->index_flush_lock, NULL);
+    }
+    // With nothing left to checkpoint there's no callback to free us, unless
+    // a background checkpoint is still in flight. Without a last checkpoint
+    // the next open just replays more of the log.
+    estat = _file_chkpt(file, true, &pending);
+    pending = pending || file->index_flush_reqs > 0;
+    ep_thr_mutex_unlock(&file->index_flush_lock);
+
+    if (!pending)
+        _file_free(file);
+    return estat;
+}
+
+EP_STAT
+_file_unref(gdpfs_file_t* file)
+{
+    file_shard_t *shard;
+    gdpfs_file_t *oldfile = NULL;
+    uint32_t refs;
+
+    refs = __atomic_load_n(&file->ref_count, __ATOMIC_ACQUIRE);
+    while (refs > 1)
+    {
+        if (__atomic_compare_exchange_n(&file->ref_count, &refs, refs - 1,
+                true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return GDPFS_STAT_OK;
+    }
+
+    // This may be the last reference. Opens take new ones under the shard
+    // lock, so dropping it there too keeps them from finding the file
+    // unreferenced but not yet on the recently closed list.
+    shard = _file_shard((uint8_t *) file->hash_key);
+    ep_thr_mutex_lock(&shard->lock);
+    if (__atomic_sub_fetch(&file->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+        oldfile = _recently_closed_insert(file);
+    ep_thr_mutex_unlock(&shard->lock);
+
+    if (oldfile != NULL)
+        return _file_dealloc(oldfile);
+    return GDPFS_STAT_OK;
+}
+
+EP_STAT
+_file_ref(gdpfs_file_t* file)
+{
+    __atomic_add_fetch(&file->ref_count, 1, __ATOMIC_ACQ_REL);
+    return EP_STAT_OK;
+}
+
+/*
+static size_t do_read_starting_at_rec_no(gdpfs_file_t *file, char *buf, size_t size,
+        off_t offset, gdpfs_recno_t rec_no)
+{
+    EP_STAT estat;
+    size_t data_size;
+    off_t read_start;
+    size_t read_size;
+    size_t left_read_size;
+    size_t read_so_far;
+    gdpfs_fmeta_t entry;
+    gdpfs_log_ent_t log_ent;
+
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    estat = gdpfs_log_ent_open(file->log_handle, &log_ent, rec_no);
+    if (!EP_STAT_ISOK(estat))
+    {
+        if (!EP_STAT_IS_SAME(estat, GDPFS_STAT_NOTFOUND))
+        {
+            char sbuf[100];
+            ep_app_error("Issue while reading GCL:\n    %s",
+                ep_stat_tostr(estat, sbuf, sizeof sbuf));
+        }
+        goto fail0;
+    }
+
+    data_size = gdpfs_log_ent_length(&log_ent);
+    if (gdpfs_log_ent_read(&log_ent, &entry, sizeof(gdpfs_fmeta_t)) != sizeof(gdpfs_fmeta_t)
+        || data_size != sizeof(gdpfs_fmeta_t) + entry.ent_size)
+    {
+        ep_app_error("Corrupt log entry in file.");
+        goto fail0;
+    }
+
+    // limit read size to file size. Even though we may encounter a larger file
+    // size deeper down, we don't want to read its data since that means that
+    // the log was truncated at some point and everything beyond the truncation
+    // point should be 0s.
+    size = max(min((int64_t)entry.file_size - (int64_t)offset, (int64_t)size), 0);
+    read_start = max(offset, entry.ent_offset);
+    read_size = max(min((int64_t)offset + (int64_t)size - (int64_t)read_start,
+                        (int64_t)entry.ent_offset + (int64_t)entry.ent_size - (int64_t)read_start), 0);
+    if (read_size > 0)
+    {
+
+        left_read_size = read_start - offset;
+
+        // this log entry has data we want
+        // TODO: error checking
+        gdpfs_log_ent_read(&log_ent, NULL, read_start - entry.ent_offset);
+        gdpfs_log_ent_read(&log_ent, buf + left_read_size, read_size);
+        gdpfs_log_ent_close(&log_ent);
+
+        // do left read
+        do_read_starting_at_rec_no(file, buf, left_read_size, offset, rec_no - 1);
+        // assume read of size size succeeds (if not then they're just filled
+        // with zeros) and do right read.
+        read_so_far = left_read_size + read_size;
+        do_read_starting_at_rec_no(file, buf + read_so_far, size - read_so_far,
+                                   offset + read_so_far, rec_no - 1);
+    }
+    else
+    {
+        gdpfs_log_ent_close(&log_ent);
+        do_read_starting_at_rec_no(file, buf, size, offset, rec_no - 1);
+    }
+    return size;
+
+fail0:
+    gdpfs_log_ent_close(&log_ent);
+    return 0;
+}
+*/
+
+static int
+_read_rec_cmp(const void *a, const void *b)
+{
+    const read_rec_t *ra = a;
+    const read_rec_t *rb = b;
+
+    if (ra->recno < rb->recno)
+        return -1;
+    return ra->recno > rb->recno;
+}
+
+/*
+ * Waits until none of our appends at or below recno is still out. The
+ * figtree points at a record as soon as it is queued, but the log only has
+ * it once the append is acked.
+ */
+static void
+_file_wait_appended(gdpfs_file_t *file, gdpfs_recno_t recno)
+{
+    ep_thr_mutex_lock(&file->ack_lock);
+    while (!list_empty(&file->appends) && list_entry(list_front(&file->appends),
+            append_req_t, file_elem)->recno <= recno)
+        ep_thr_cond_wait(&file->ack_cond, &file->ack_lock, NULL);
+    ep_thr_mutex_unlock(&file->ack_lock);
+}
+
+/*
+ * Read size bytes at offset from the log into buf, following the figtree,
+ * with any writes still in the write-back buffer on top. Bytes nothing
+ * covers are left alone, so buf should start out zeroed.
+ * Every record the range touches is fetched at once, each only once however
+ * many figs it backs, so this costs about one round trip.
+ */
+static EP_STAT
+_file_read_log(gdpfs_file_t *file, char *buf, size_t size, off_t offset)
+{
+    EP_STAT estat = GDPFS_STAT_OK;
+    fig_t indexgroup;
+    figiter_t* figterator;
+    fig_t *figs;
+    read_rec_t *recs = NULL;
+    read_rec_t *rec;
+    read_rec_t key;
+    gdpfs_recno_t *recnos = NULL;
+    gdpfs_log_ent_t *ents = NULL;
+    gdpfs_fmeta_t entry;
+    gdpfs_extent_t exts[GDPFS_FMETA_MAX_EXTENTS];
+    wb_extent_t *ov;
+    size_t len;
+    size_t pos;
+    int nov;
+    int nfigs = 0;
+    int figslen = 16;
+    int nrecs = 0;
+    int i;
+    uint32_t j;
+
+    figs = ep_mem_zalloc(figslen * sizeof(fig_t));
+    if (figs == NULL)
+        return GDPFS_STAT_OOMEM;
+
+    // Note what we need; the records themselves never change, so the
+    // fetching can happen after the lock is dropped. Nodes load lazily
+    // even under the read lock, so readers don't hold each other up.
+    ep_thr_rwlock_rdlock(&file->figtree_lock);
+    figterator = ft_read(&file->figtree, offset, offset + size - 1, file->log_handle);
+    while (fti_next(figterator, &indexgroup, file->log_handle)) {
+        if (indexgroup.value == 0) {
+            // We have to read from the cache here
+            EP_ASSERT(gdpfs_file_get_cache(file, buf + indexgroup.irange.left - offset, indexgroup.irange.right - indexgroup.irange.left + 1,
+                                           indexgroup.irange.left));
+            continue;
+        }
+        if (indexgroup.value < 0)
+            continue;
+        if (nfigs == figslen)
+        {
+            figslen <<= 1;
+            figs = ep_mem_realloc(figs, figslen * sizeof(fig_t));
+        }
+        figs[nfigs++] = indexgroup;
+    }
+    nov = _wb_overlay_collect(file, offset, size, &ov);
+    ep_thr_rwlock_unlock(&file->figtree_lock);
+    fti_free(figterator);
+    if (nfigs == 0)
+        goto done;
+
+    recs = ep_mem_zalloc(nfigs * sizeof(read_rec_t));
+    recnos = ep_mem_zalloc(nfigs * sizeof(gdpfs_recno_t));
+    ents = ep_mem_zalloc(nfigs * sizeof(gdpfs_log_ent_t));
+    if (recs == NULL || recnos == NULL || ents == NULL)
+    {
+        estat = GDPFS_STAT_OOMEM;
+        goto done;
+    }
+    for (i = 0; i < nfigs; i++)
+        recs[i].recno = figs[i].value;
+    qsort(recs, nfigs, sizeof(read_rec_t), _read_rec_cmp);
+    for (i = 0; i < nfigs; i++)
+    {
+        if (nrecs == 0 || recs[i].recno != recs[nrecs - 1].recno)
+            recs[nrecs++] = recs[i];
+    }
+    for (i = 0; i < nrecs; i++)
+        recnos[i] = recs[i].recno;
+
+    // Our own recent writes may not have reached the log yet.
+    _file_wait_appended(file, recnos[nrecs - 1]);
+    estat = gdpfs_log_ent_open_vec(file->log_handle, ents, recnos, nrecs, true, NULL, NULL);
+    if (!EP_STAT_ISOK(estat))
+        goto done;
+
+    for (i = 0; i < nrecs; i++)
+    {
+        len = gdpfs_log_ent_length(&ents[i]);
+        if (gdpfs_log_ent_read(&ents[i], &entry, sizeof(gdpfs_fmeta_t)) != sizeof(gdpfs_fmeta_t)
+            || len != sizeof(gdpfs_fmeta_t) + entry.ent_size
+            || (recs[i].n = _file_read_extents(&ents[i], &entry, exts)) == 0)
+        {
+            ep_app_fatal("Corrupt log entry in file (#4).");
+        }
+        recs[i].pos = 0;
+        recs[i].one = exts[0];
+        recs[i].exts = &recs[i].one;
+        if (recs[i].n > 1)
+        {
+            recs[i].exts = ep_mem_malloc(recs[i].n * sizeof(gdpfs_extent_t));
+            memcpy(recs[i].exts, exts, recs[i].n * sizeof(gdpfs_extent_t));
+        }
+    }
+
+    // The iterator hands out figs in offset order and a record's extents are
+    // stored in offset order, so each record is only ever read forward.
+    for (i = 0; i < nfigs; i++)
+    {
+        key.recno = figs[i].value;
+        rec = bsearch(&key, recs, nrecs, sizeof(read_rec_t), _read_rec_cmp);
+        EP_ASSERT_INSIST(rec != NULL);
+        len = figs[i].irange.right - figs[i].irange.left + 1;
+        pos = 0;
+        for (j = 0; j < rec->n; j++)
+        {
+            if (figs[i].irange.left >= rec->exts[j].offset &&
+                figs[i].irange.right < rec->exts[j].offset + (off_t) rec->exts[j].size)
+                break;
+            pos += rec->exts[j].size;
+        }
+        EP_ASSERT_INSIST(j < rec->n);
+        pos += figs[i].irange.left - rec->exts[j].offset;
+        EP_ASSERT_INSIST(pos >= rec->pos);
+        gdpfs_log_ent_drain(&ents[rec - recs], pos - rec->pos);
+        EP_ASSERT_REQUIRE(gdpfs_log_ent_read(&ents[rec - recs],
+                buf + (figs[i].irange.left - offset), len) == len);
+        rec->pos = pos + len;
+    }
+
+    for (i = 0; i < nrecs; i++)
+    {
+        gdpfs_log_ent_close(&ents[i]);
+        if (recs[i].n > 1)
+            ep_mem_free(recs[i].exts);
+    }
+
+done:
+    // Writes still in the buffer are newer than anything in the log.
+    _wb_overlay_apply(buf, offset, ov, nov);
+    ep_mem_free(figs);
+    if (recs != NULL)
+        ep_mem_free(recs);
+    if (recnos != NULL)
+        ep_mem_free(recnos);
+    if (ents != NULL)
+        ep_mem_free(ents);
+    return estat;
+}
+
+/*
+ * Note a read of size bytes at offset on fh and, if it continues a stream,
+ * queue the stream's next window. file_size bounds the window.
+ */
+static void
+_readahead(uint64_t fh, gdpfs_file_t *file, off_t offset, size_t size,
+        size_t file_size)
+{
+    readahead_t *ra = &((fh_slot_t *) fh_table_slot(fhs, fh))->ra;
+    readahead_req_t *req = NULL;
+    off_t end = offset + size;
+    off_t start;
+    off_t stop;
+
+    ep_thr_mutex_lock(&readahead_lock);
+    if (offset != ra->next)
+    {
+        // Random access: drop the stream and anything it has queued.
+        ra->window = 0;
+        ra->end = 0;
+        ra->epoch++;
+    }
+    else if (end + (off_t) ra->window / 2 >= ra->end)
+    {
+        ra->window = ra->window == 0 ? READAHEAD_MIN :
+                min(ra->window * 2, (size_t) READAHEAD_MAX);
+        start = max(ra->end, end);
+        stop = min(start + (off_t) ra->window, (off_t) file_size);
+        if (stop > start && EP_STAT_ISOK(_file_ref(file)))
+        {
+            req = ep_mem_zalloc(sizeof(readahead_req_t));
+            if (req == NULL)
+            {
+                // Read-ahead is only a hint; the caller still holds a
+                // reference, so this one isn't the last.
+                _file_unref(file);
+                goto done;
+            }
+            req->file = file;
+            req->fh = fh;
+            req->epoch = ra->epoch;
+            req->offset = start;
+            req->size = stop - start;
+            list_push_back(&readahead_queue, &req->elem);
+            ep_thr_cond_signal(&readahead_cond);
+            ra->end = stop;
+        }
+    }
+done:
+    ra->next = end;
+    ep_thr_mutex_unlock(&readahead_lock);
+}
+
+/*
+ * Fetch one queued window into the cache. Whatever is already cached is left
+ * alone, and the fetch is thrown away if a write got to the cache first.
+ */
+static void
+_readahead_fill(readahead_req_t *req)
+{
+    gdpfs_file_t *file = req->file;
+    uint64_t gen;
+    EP_STAT estat;
+    char *buf;
+
+    ep_thr_mutex_lock(&file->cache_lock);
+    if (gdpfs_file_cache_covers(file, req->size, req->offset))
+    {
+        ep_thr_mutex_unlock(&file->cache_lock);
+        return;
+    }
+    gen = file->cache_gen;
+    ep_thr_mutex_unlock(&file->cache_lock);
+
+    buf = ep_mem_zalloc(req->size);
+    if (buf == NULL)
+        return;
+    estat = _file_read_log(file, buf, req->size, req->offset);
+    if (EP_STAT_ISOK(estat))
+    {
+        ep_thr_mutex_lock(&file->cache_lock);
+        if (file->cache_gen == gen)
+            gdpfs_file_fill_cache(file, buf, req->size, req->offset, true);
+        ep_thr_mutex_unlock(&file->cache_lock);
+    }
+    ep_mem_free(buf);
+}
+
+static void *
+_readahead_thread(void *arg)
+{
+    readahead_req_t *req;
+    fh_slot_t *slot;
+    bool live;
+
+    for (;;)
+    {
+        ep_thr_mutex_lock(&readahead_lock);
+        while (list_empty(&readahead_queue)) {
+            ep_thr_cond_wait(&readahead_cond, &readahead_lock, NULL);
+        }
+        req = list_entry(list_pop_front(&readahead_queue), readahead_req_t, elem);
+        // A closed handle's slot has moved on to a later epoch, or is free.
+        slot = fh_table_slot(fhs, req->fh);
+        live = slot != NULL && req->epoch == slot->ra.epoch;
+        ep_thr_mutex_unlock(&readahead_lock);
+
+        if (live)
+            _readahead_fill(req);
+        _file_unref(req->file);
+        ep_mem_free(req);
+    }
+    return NULL;
+}
+
+static size_t
+do_read(uint64_t fh, char *buf, size_t size, off_t offset)
+{
+    gdpfs_file_t *file;
+    gdpfs_file_info_t *info;
+    EP_STAT estat;
+    uint64_t gen = 0;
+    file = lookup_fh(fh);
+    if (file == NULL)
+        return 0;
+
+    estat = _file_recover(file);
+    if (!EP_STAT_ISOK(estat))
+    {
+        ep_app_error("Could not rebuild file index during read: %d", EP_STAT_DETAIL(estat));
+        return 0;
+    }
+
+    estat = _file_get_info_raw(&info, file);
+    if (!EP_STAT_ISOK(estat))
+    {
+        ep_app_error("Could not get file info during read: %d", EP_STAT_DETAIL(estat));
+        return 0;
+    }
+
+    if (size + offset > info->file_size)
+    {
+        if (offset > info->file_size)
+            return 0;
+        size = info->file_size - offset;
+    }
+
+    // check cache
+    if (use_cache) {
+        bool hit;
+        if (!file->new_file)
+            _readahead(fh, file, offset, size, info->file_size);
+        // Hits don't take cache_lock, so they run side by side.
+        hit = gdpfs_file_get_cache(file, buf, size, offset);
+        if (hit)
+            return size;
+        ep_thr_mutex_lock(&file->cache_lock);
+        gen = file->cache_gen;
+        ep_thr_mutex_unlock(&file->cache_lock);
+    }
+
+    memset(buf, 0, size);
+
+    /* On a miss, traverse the fig tree. */
+    if (size > 0)
+    {
+        estat = _file_read_log(file, buf, size, offset);
+        if (!EP_STAT_ISOK(estat))
+        {
+            ep_app_error("Could not read file data from log: %d", EP_STAT_DETAIL(estat));
+            return 0;
+        }
+
+        // A write that got to the cache meanwhile has newer data.
+        if (use_cache)
+        {
+            ep_thr_mutex_lock(&file->cache_lock);
+            if (file->cache_gen == gen)
+                estat = gdpfs_file_fill_cache(file, buf, size, offset, true);
+            ep_thr_mutex_unlock(&file->cache_lock);
+        }
+
+        return size;
+    }
+
+    return 0;
+}
+
+size_t
+gdpfs_file_read(uint64_t fh, void *buf, size_t size, off_t offset)
+{
+    return do_read(fh, buf, size, offset);
+}
+
+/*
+ * Wait for room in file's append window and the global one, then claim a
+ * slot in each.
+ */
+static void
+_append_window_enter(gdpfs_file_t *file)
+{
+    ep_thr_mutex_lock(&file->index_flush_lock);
+    while (file->outstanding_reqs >= append_window) {
+        ep_thr_cond_wait(&file->index_flush_cond, &file->index_flush_lock, NULL);
+    }
+    file->outstanding_reqs++;
+    ep_thr_mutex_unlock(&file->index_flush_lock);
+
+    ep_thr_mutex_lock(&append_lock);
+    while (appends_inflight >= append_window_global) {
+        ep_thr_cond_wait(&append_cond, &append_lock, NULL);
+    }
+    appends_inflight++;
+    ep_thr_mutex_unlock(&append_lock);
+}
+
+/* Queue a finished append for _append_done_thread. */
+static void
+_append_done_queue(append_req_t *req, EP_STAT estat)
+{
+    req->estat = estat;
+    ep_thr_mutex_lock(&append_lock);
+    list_push_back(&append_done, &req->elem);
+    ep_thr_cond_signal(&append_done_cond);
+    ep_thr_mutex_unlock(&append_lock);
+}
+
+static void
+free_fileref(gdpfs_log_event_t* ev)
+{
+    _append_done_queue(gdpfs_log_event_getudata(ev), gdpfs_log_event_getstat(ev));
+}
+
+/*
+ * Retire the n finished appends of file in run: note how far the log has
+ * acked, then give back their window slots and the references that came
+ * with them.
+ */
+static void
+_append_done_file(gdpfs_file_t *file, struct list *run, int n)
+{
+    EP_STAT estat;
+    append_req_t *req;
+    gdpfs_recno_t highest = 0;
 
-        estat = gdpfs_log_append(file->log_handle, &ent, _file_chkpt_finish, do_callback ? file : NULL);
-        EP_ASSERT (EP_STAT_ISOK(estat));
-        gdpfs_log_ent_close(&ent);
+    ep_thr_mutex_lock(&file->ack_lock);
+    while (!list_empty(run))
+    {
+        req = list_entry(list_pop_front(run), append_req_t, elem);
+        list_remove(&req->file_elem);
+        if (!EP_STAT_ISOK(req->estat))
+        {
+            file->append_failed = true;
+            // It may or may not have taken its recno; only the log knows.
+            ep_thr_mutex_lock(&file->append_seq_lock);
+            __atomic_store_n(&file->append_broken, true, __ATOMIC_RELEASE);
+            ep_thr_mutex_unlock(&file->append_seq_lock);
+        }
+        highest = max(highest, req->recno);
+        ep_mem_free(req);
     }
+    // Completions can come back out of order; only count up to the oldest
+    // append still out.
+    if (list_empty(&file->appends))
+        file->acked_recno = max(file->acked_recno, highest);
     else
+        file->acked_recno = list_entry(list_front(&file->appends),
+                append_req_t, file_elem)->recno - 1;
+    ep_thr_cond_broadcast(&file->ack_cond);
+    ep_thr_mutex_unlock(&file->ack_lock);
+
+    ep_thr_mutex_lock(&file->index_flush_lock);
+    file->outstanding_reqs -= n;
+    ep_thr_cond_broadcast(&file->index_flush_cond);
+    ep_thr_mutex_unlock(&file->index_flush_lock);
+    while (n-- > 0)
     {
-        ep_mem_free(chkpt);
+        estat = _file_unref(file);
+        if (!EP_STAT_ISOK(estat))
+            ep_app_error("Could not unreference file at %p", file);
     }
 }
 
-EP_STAT
-_file_dealloc(gdpfs_file_t* file)
+/*
+ * Retire completed appends. Everything queued since the last pass is taken
+ * at once, so each file's lock and the global window are touched once per
+ * run of completions rather than once per append.
+ */
+static void *
+_append_done_thread(void *arg)
 {
-    EP_STAT estat = GDPFS_STAT_OK;
-
-    ep_thr_mutex_lock(&file->index_flush_lock);
-    while (file->outstanding_reqs != 0) {
-        ep_thr_cond_wait(&file->index_flush_cond, &file->index_flush_lock, NULL);
+    struct list batch;
+    struct list run;
+    append_req_t *req;
+    gdpfs_file_t *file;
+    int total;
+    int journaled;
+    int failed;
+    int n;
+
+    list_init(&batch);
+    list_init(&run);
+    while (true)
+    {
+        ep_thr_mutex_lock(&append_lock);
+        while (list_empty(&append_done)) {
+            ep_thr_cond_wait(&append_done_cond, &append_lock, NULL);
+        }
+        while (!list_empty(&append_done))
+            list_push_back(&batch, list_pop_front(&append_done));
+        ep_thr_mutex_unlock(&append_lock);
+
+        file = NULL;
+        total = 0;
+        journaled = 0;
+        failed = 0;
+        n = 0;
+        while (!list_empty(&batch))
+        {
+            req = list_entry(list_pop_front(&batch), append_req_t, elem);
+            // A failed append keeps its journal records for the next start.
+            if (!EP_STAT_ISOK(req->estat))
+            {
+                ep_app_error("Could not properly append: %d", EP_STAT_DETAIL(req->estat));
+                failed++;
+            }
+            else
+                journaled += req->journaled;
+            if (req->file != file)
+            {
+                if (n > 0)
+                    _append_done_file(file, &run, n);
+                file = req->file;
+                n = 0;
+            }
+            list_push_back(&run, &req->elem);
+            n++;
+            total++;
+        }
+        if (n > 0)
+            _append_done_file(file, &run, n);
+        if (journaled > 0)
+            gdpfs_journal_release(journaled);
+
+        ep_thr_mutex_lock(&append_lock);
+        appends_inflight -= total;
+        append_failures += failed;
+        ep_thr_cond_broadcast(&append_cond);
+        ep_thr_mutex_unlock(&append_lock);
     }
-    _file_chkpt(file, true);
-    ep_thr_mutex_unlock(&file->index_flush_lock);
+    // NOT REACHED
+    return NULL;
+}
 
-    return estat;
+/*
+ * Counts a record of size bytes towards file's next checkpoint. Returns true
+ * if that just crossed the record or byte threshold. figtree_lock must be
+ * write locked.
+ */
+static bool
+_chkpt_account(gdpfs_file_t *file, size_t size)
+{
+    size_t before = file->bytes_since_chkpt;
+
+    if (file->recs_since_chkpt++ == 0)
+        ep_time_now(&file->dirty_since);
+    file->bytes_since_chkpt += size;
+    return (chkpt_records > 0 && file->recs_since_chkpt == chkpt_records) ||
+           (chkpt_bytes > 0 && before < chkpt_bytes &&
+            file->bytes_since_chkpt >= chkpt_bytes);
 }
 
-EP_STAT
-_file_unref(gdpfs_file_t* file)
+/* figtree_lock must be held. */
+static bool
+_chkpt_due(gdpfs_file_t *file, const EP_TIME_SPEC *now)
 {
-    EP_STAT estat;
-    uint32_t new_ref_count;
+    if (file->recs_since_chkpt == 0)
+        return false;
+    return (chkpt_records > 0 && file->recs_since_chkpt >= chkpt_records) ||
+           (chkpt_bytes > 0 && file->bytes_since_chkpt >= chkpt_bytes) ||
+           (chkpt_age > 0 && now->tv_sec - file->dirty_since.tv_sec >= chkpt_age);
+}
 
-    if (ep_thr_mutex_lock(&file->ref_count_lock) != 0)
-        return GDPFS_STAT_SYNCH_FAIL;
-    new_ref_count = --file->ref_count;
-    if (ep_thr_mutex_unlock(&file->ref_count_lock) != 0)
-        return GDPFS_STAT_SYNCH_FAIL;
+typedef struct
+{
+    gdpfs_file_t **files;
+    int n;
+    int cap;
+    EP_TIME_SPEC now;
+} chkpt_scan_t;
+
+/*
+ * ep_hash_forall callback: takes a reference on each open file that is due
+ * for a checkpoint or has an aged write-back buffer. Files nobody has open
+ * are left for eviction to checkpoint. The file's shard lock must be held.
+ */
+static void
+_chkpt_collect(size_t keylen, const void *key, void *val, va_list av)
+{
+    chkpt_scan_t *scan = va_arg(av, chkpt_scan_t *);
+    gdpfs_file_t *file = val;
+    uint32_t refs;
+    bool due;
+
+    if (file == NULL || !file->figtree_initialized)
+        return;
+    ep_thr_rwlock_rdlock(&file->figtree_lock);
+    due = _chkpt_due(file, &scan->now);
+    ep_thr_rwlock_unlock(&file->figtree_lock);
+    if (!due && !_wb_due(file, &scan->now))
+        return;
+
+    refs = __atomic_load_n(&file->ref_count, __ATOMIC_ACQUIRE);
+    do
+    {
+        if (refs == 0)
+            return;
+    } while (!__atomic_compare_exchange_n(&file->ref_count, &refs, refs + 1,
+                true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 
-    if (new_ref_count == 0)
+    if (scan->n == scan->cap)
     {
-        estat = _recently_closed_insert(file);
+        scan->cap = scan->cap == 0 ? 16 : scan->cap << 1;
+        scan->files = ep_mem_realloc(scan->files, scan->cap * sizeof(gdpfs_file_t *));
     }
-    else
-        estat = GDPFS_STAT_OK;
-    return estat;
+    scan->files[scan->n++] = file;
 }
 
-EP_STAT
-_file_ref(gdpfs_file_t* file)
+static void *
+_chkpt_thread(void *arg)
 {
-    if (ep_thr_mutex_lock(&file->ref_count_lock) != 0)
-        return GDPFS_STAT_SYNCH_FAIL;
-    ++file->ref_count;
-    if (ep_thr_mutex_unlock(&file->ref_count_lock) != 0)
-        return GDPFS_STAT_SYNCH_FAIL;
-    return EP_STAT_OK;
+    chkpt_scan_t scan;
+    EP_TIME_SPEC deadline;
+    bool due;
+    bool appended;
+    int i;
+
+    memset(&scan, 0, sizeof(scan));
+    while (1)
+    {
+        ep_thr_mutex_lock(&chkpt_lock);
+        if (!chkpt_kick)
+        {
+            ep_time_now(&deadline);
+            deadline.tv_sec += CHKPT_SCAN_INTERVAL;
+            ep_thr_cond_wait(&chkpt_cond, &chkpt_lock, &deadline);
+        }
+        chkpt_kick = false;
+        ep_thr_mutex_unlock(&chkpt_lock);
+
+        scan.n = 0;
+        ep_time_now(&scan.now);
+        for (i = 0; i < FILE_SHARDS; i++)
+        {
+            ep_thr_mutex_lock(&file_shards[i].lock);
+            ep_hash_forall(file_shards[i].hash, _chkpt_collect, &scan);
+            ep_thr_mutex_unlock(&file_shards[i].lock);
+        }
+
+        // Writers only wait on figtree_lock while the recno is taken.
+        for (i = 0; i < scan.n; i++)
+        {
+            // Flushing first puts the buffered writes in the checkpoint.
+            // A failed checkpoint is still due and gets retried next scan,
+            // once the file has recovered.
+            _file_wb_flush(scan.files[i]);
+            due = EP_STAT_ISOK(_file_recover(scan.files[i]));
+            ep_thr_rwlock_rdlock(&scan.files[i]->figtree_lock);
+            due = due && _chkpt_due(scan.files[i], &scan.now);
+            ep_thr_rwlock_unlock(&scan.files[i]->figtree_lock);
+            if (due)
+            {
+                ep_thr_mutex_lock(&scan.files[i]->index_flush_lock);
+                _file_chkpt(scan.files[i], true, &appended);
+                ep_thr_mutex_unlock(&scan.files[i]->index_flush_lock);
+            }
+            _file_unref(scan.files[i]);
+        }
+    }
+    // NOT REACHED
+    return NULL;
 }
 
 /*
-static size_t do_read_starting_at_rec_no(gdpfs_file_t *file, char *buf, size_t size,
-        off_t offset, gdpfs_recno_t rec_no)
+ * Appends one data record holding the n extents in exts, stamped with info.
+ * If sealed, exts is file->wb_flushing, and reads stop looking at it as soon
+ * as the figtree has the record. The record covers journaled journal records,
+ * which are released once the log acks it. If this fails, they are left to
+ * the caller.
+ */
+static EP_STAT
+_file_append(gdpfs_file_t *file, const wb_extent_t *exts, int n,
+        const gdpfs_file_info_t *info, bool sealed, int journaled)
 {
     EP_STAT estat;
-    size_t data_size;
-    off_t read_start;
-    size_t read_size;
-    size_t left_read_size;
-    size_t read_so_far;
-    gdpfs_fmeta_t entry;
     gdpfs_log_ent_t log_ent;
+    gdpfs_recno_t rc;
+    uint64_t ticket;
+    append_req_t *req;
+    gdpfs_extent_t table[WB_MAX_EXTENTS];
+    uint8_t tbuf[GDPFS_FMETA_EXTENTS_MAX_SIZE];
+    const void *payload = exts[0].data;
+    size_t payload_size = exts[0].size;
+    size_t data_size = 0;
+    size_t tlen;
+    char *multi = NULL;
+    char *p;
+    void *zbuf = NULL;
+    uint8_t flags = 0;
+    uint8_t hdr[GDPFS_FMETA_MAX_SIZE];
+    size_t hlen;
+    bool kick;
+    int i;
+    gdpfs_fmeta_t entry = {
+        .file_size   = info->file_size,
+        .file_type   = info->file_type,
+        .file_perm   = info->file_perm,
+        .logent_type = GDPFS_LOGENT_TYPE_DATA,
+        .ent_offset  = exts[0].offset,
+        .ent_size    = exts[0].size,
+        .magic       = GDPFS_FMETA_V1_MAGIC,
+    };
 
-    if (size == 0)
+    estat = _file_recover(file);
+    if (!EP_STAT_ISOK(estat))
+        return estat;
+
+    // Lets open find the index without scanning. Being a checkpoint behind
+    // only costs a longer replay, so the lock needn't be held to the append.
+    ep_thr_rwlock_rdlock(&file->figtree_lock);
+    entry.chkpt_recno = file->last_chkpt_recno;
+    ep_thr_rwlock_unlock(&file->figtree_lock);
+
+    for (i = 0; i < n; i++)
+        data_size += exts[i].size;
+    if (n > 1)
     {
-        return 0;
+        // The extent table goes in front of the data, all in one payload.
+        for (i = 0; i < n; i++)
+        {
+            table[i].offset = exts[i].offset;
+            table[i].size = exts[i].size;
+        }
+        tlen = gdpfs_fmeta_encode_extents(table, n, tbuf);
+        multi = ep_mem_malloc(tlen + data_size);
+        if (multi == NULL)
+            return GDPFS_STAT_OOMEM;
+        memcpy(multi, tbuf, tlen);
+        p = multi + tlen;
+        for (i = 0; i < n; i++)
+        {
+            memcpy(p, exts[i].data, exts[i].size);
+            p += exts[i].size;
+        }
+        flags |= GDPFS_FMETA_FLAG_MULTI_EXTENT;
+        payload = multi;
+        payload_size = entry.ent_size = tlen + data_size;
     }
 
-    estat = gdpfs_log_ent_open(file->log_handle, &log_ent, rec_no);
+    if (gdpfs_compress(&file->data_zstate, payload, payload_size, &zbuf, &payload_size))
+    {
+        flags |= GDPFS_FMETA_FLAG_COMPRESSED;
+        payload = zbuf;
+    }
+
+    estat = gdpfs_log_ent_init(&log_ent);
     if (!EP_STAT_ISOK(estat))
+        goto fail1;
+    hlen = gdpfs_fmeta_encode(&entry, flags, hdr);
+    if (gdpfs_log_ent_write(&log_ent, hdr, hlen) != 0)
     {
-        if (!EP_STAT_IS_SAME(estat, GDPFS_STAT_NOTFOUND))
-        {
-            char sbuf[100];
-            ep_app_error("Issue while reading GCL:\n    %s",
-                ep_stat_tostr(estat, sbuf, sizeof sbuf));
-        }
+        ep_app_error("Failed on metadata write to log entry");
+        estat = GDPFS_STAT_OOMEM;
+        goto fail0;
+    }
+    // The payload outlives log_ent, so don't copy it.
+    if (gdpfs_log_ent_write_ref(&log_ent, payload, payload_size) != 0)
+    {
+        ep_app_error("Failed on data write to log entry");
+        estat = GDPFS_STAT_OOMEM;
         goto fail0;
     }
 
-    data_size = gdpfs_log_ent_length(&log_ent);
-    if (gdpfs_log_ent_read(&log_ent, &entry, sizeof(gdpfs_fmeta_t)) != sizeof(gdpfs_fmeta_t)
-        || data_size != sizeof(gdpfs_fmeta_t) + entry.ent_size)
+    req = ep_mem_zalloc(sizeof(append_req_t));
+    if (req == NULL)
     {
-        ep_app_error("Corrupt log entry in file.");
+        estat = GDPFS_STAT_OOMEM;
         goto fail0;
     }
+    req->file = file;
+    req->journaled = journaled;
 
-    // limit read size to file size. Even though we may encounter a larger file
-    // size deeper down, we don't want to read its data since that means that
-    // the log was truncated at some point and everything beyond the truncation
-    // point should be 0s.
-    size = max(min((int64_t)entry.file_size - (int64_t)offset, (int64_t)size), 0);
-    read_start = max(offset, entry.ent_offset);
-    read_size = max(min((int64_t)offset + (int64_t)size - (int64_t)read_start,
-                        (int64_t)entry.ent_offset + (int64_t)entry.ent_size - (int64_t)read_start), 0);
-    if (read_size > 0)
+    estat = _file_ref(file);
+    if (!EP_STAT_ISOK(estat))
     {
+        ep_mem_free(req);
+        goto fail0;
+    }
 
-        left_read_size = read_start - offset;
+    // Blocks while too many appends are already waiting on the log server.
+    _append_window_enter(file);
 
-        // this log entry has data we want
-        // TODO: error checking
-        gdpfs_log_ent_read(&log_ent, NULL, read_start - entry.ent_offset);
-        gdpfs_log_ent_read(&log_ent, buf + left_read_size, read_size);
-        gdpfs_log_ent_close(&log_ent);
+    ep_thr_rwlock_wrlock(&file->figtree_lock);
 
-        // do left read
-        do_read_starting_at_rec_no(file, buf, left_read_size, offset, rec_no - 1);
-        // assume read of size size succeeds (if not then they're just filled
-        // with zeros) and do right read.
-        read_so_far = left_read_size + read_size;
-        do_read_starting_at_rec_no(file, buf + read_so_far, size - read_so_far,
-                                   offset + read_so_far, rec_no - 1);
+    rc = ++file->last_recno;
+    req->recno = rc;
+    ep_thr_mutex_lock(&file->ack_lock);
+    list_push_back(&file->appends, &req->file_elem);
+    ep_thr_mutex_unlock(&file->ack_lock);
+
+    for (i = 0; i < n; i++)
+    {
+        if (exts[i].size > 0)
+            ft_write(&file->figtree, exts[i].offset,
+                    exts[i].offset + exts[i].size - 1, rc, file->log_handle);
     }
-    else
+    if (sealed)
     {
-        gdpfs_log_ent_close(&log_ent);
-        do_read_starting_at_rec_no(file, buf, size, offset, rec_no - 1);
+        ep_thr_mutex_lock(&file->wb_lock);
+        file->wb_nflushing = 0;
+        ep_thr_mutex_unlock(&file->wb_lock);
+    }
+    ticket = file->append_ticket++;
+
+    kick = _chkpt_account(file, data_size);
+    ep_thr_rwlock_unlock(&file->figtree_lock);
+
+    // Readers and other writers can go on while this is handed to the log.
+    estat = _file_append_in_turn(file, ticket, rc, &log_ent, free_fileref, req);
+
+    if (kick)
+    {
+        ep_thr_mutex_lock(&chkpt_lock);
+        chkpt_kick = true;
+        ep_thr_cond_signal(&chkpt_cond);
+        ep_thr_mutex_unlock(&chkpt_lock);
     }
-    return size;
+
+    // No callback is coming, so give the slot back ourselves.
+    if (!EP_STAT_ISOK(estat))
+        _append_done_queue(req, estat);
 
 fail0:
+    // remember to free our resources
     gdpfs_log_ent_close(&log_ent);
-    return 0;
+fail1:
+    if (zbuf != NULL)
+        ep_mem_free(zbuf);
+    if (multi != NULL)
+        ep_mem_free(multi);
+    return estat;
 }
-*/
 
-void handle_read(gdp_event_t* ev)
+/*
+ * Appends whatever file has buffered as one record. Returns once the append
+ * is on its way, not once it is durable.
+ */
+static EP_STAT
+_file_wb_flush(gdpfs_file_t *file)
 {
-    gdpfs_fmeta_t entry;
-    gdpfs_log_ent_t log_ent;
-    size_t data_size;
-    gdpfs_readstate_t* rs = gdp_event_getudata(ev);
-    log_ent.datum = gdp_event_getdatum(ev);
-
-    data_size = gdpfs_log_ent_length(&log_ent);
-    if (gdpfs_log_ent_read(&log_ent, &entry, sizeof(gdpfs_fmeta_t)) != sizeof(gdpfs_fmeta_t)
-        || data_size != sizeof(gdpfs_fmeta_t) + entry.ent_size)
+    EP_STAT estat = GDPFS_STAT_OK;
+    gdpfs_file_info_t info;
+    wb_extent_t *sealed;
+    size_t bytes;
+    int journaled;
+    int n;
+    int i;
+
+    ep_thr_mutex_lock(&file->wb_flush_lock);
+    ep_thr_mutex_lock(&file->wb_lock);
+    n = file->wb_n;
+    bytes = file->wb_bytes;
+    info = file->wb_info;
+    journaled = file->wb_journaled;
+    if (n > 0)
     {
-        ep_app_fatal("Corrupt log entry in file (#3).");
+        sealed = file->wb;
+        file->wb = file->wb_flushing;
+        file->wb_flushing = sealed;
+        file->wb_nflushing = n;
+        file->wb_n = 0;
+        file->wb_bytes = 0;
+        file->wb_journaled = 0;
     }
+    ep_thr_mutex_unlock(&file->wb_lock);
+
+    if (n > 0)
+    {
+        sealed = file->wb_flushing;
+        estat = _file_append(file, sealed, n, &info, true, journaled);
+        if (!EP_STAT_ISOK(estat))
+        {
+            char sbuf[100];
 
-    gdpfs_log_ent_drain(&log_ent, rs->start - entry.ent_offset);
-    gdpfs_log_ent_read(&log_ent, rs->writebuf, rs->len);
+            ep_app_error("Lost buffered writes to file:\n    %s",
+                    ep_stat_tostr(estat, sbuf, sizeof sbuf));
+            ep_thr_mutex_lock(&file->wb_lock);
+            file->wb_nflushing = 0;
+            ep_thr_mutex_unlock(&file->wb_lock);
+        }
+        for (i = 0; i < n; i++)
+        {
+            ep_mem_free(sealed[i].data);
+            sealed[i].data = NULL;
+        }
 
-    ep_thr_mutex_lock(rs->lock);
-    if (--*rs->numleft == 0) {
-        ep_thr_cond_signal(rs->condvar);
+        ep_thr_mutex_lock(&wb_total_lock);
+        wb_total -= bytes;
+        ep_thr_mutex_unlock(&wb_total_lock);
     }
-    ep_thr_mutex_unlock(rs->lock);
-    ep_mem_free(rs);
+    ep_thr_mutex_unlock(&file->wb_flush_lock);
+    return estat;
 }
 
-static size_t
-do_read(uint64_t fh, char *buf, size_t size, off_t offset)
+/*
+ * Puts size bytes at offset into file's write-back buffer, merging them with
+ * any extents they overlap or touch. Returns false if that would take a new
+ * extent and the buffer has no room for one. *added is how much the buffer
+ * grew. wb_lock must be held.
+ */
+static bool
+_wb_insert(gdpfs_file_t *file, const char *buf, size_t size, off_t offset,
+        size_t *added)
 {
-    gdpfs_file_t *file;
-    gdpfs_file_info_t *info;
-    EP_STAT estat;
-    file = lookup_fh(fh);
-    if (file == NULL)
-        return 0;
-
-    estat = _file_get_info_raw(&info, file);
-    if (!EP_STAT_ISOK(estat))
+    wb_extent_t *wb = file->wb;
+    wb_extent_t *e;
+    off_t lo = offset;
+    off_t hi = offset + size;
+    off_t nlo;
+    off_t nhi;
+    size_t old = 0;
+    char *data;
+    int i, j, k;
+
+    for (i = 0; i < file->wb_n && wb[i].offset + (off_t) wb[i].size < lo; i++)
+        continue;
+    for (j = i; j < file->wb_n && wb[j].offset <= hi; j++)
+        old += wb[j].size;
+
+    if (i == j)
     {
-        ep_app_error("Could not get file info during read: %d", EP_STAT_DETAIL(estat));
-        return 0;
+        if (file->wb_n == WB_MAX_EXTENTS)
+            return false;
+        data = ep_mem_malloc(size);
+        if (data == NULL)
+            return false;
+        memcpy(data, buf, size);
+        memmove(&wb[i + 1], &wb[i], (file->wb_n - i) * sizeof(wb_extent_t));
+        wb[i].offset = offset;
+        wb[i].size = size;
+        wb[i].cap = size;
+        wb[i].data = data;
+        file->wb_n++;
+        *added = size;
+        return true;
     }
 
-    if (size + offset > info->file_size)
+    nlo = min(lo, wb[i].offset);
+    nhi = max(hi, wb[j - 1].offset + (off_t) wb[j - 1].size);
+    e = &wb[i];
+    if (j == i + 1 && nlo == e->offset)
     {
-        if (offset > info->file_size)
-            return 0;
-        size = info->file_size - offset;
-    }
-
-    // check cache
-    if (use_cache) {
-        bool hit;
-        ep_thr_mutex_lock(&file->cache_lock);
-        hit = gdpfs_file_get_cache(file, buf, size, offset);
-        ep_thr_mutex_unlock(&file->cache_lock);
-        if (hit)
-            return size;
+        // Extending one extent in place, the usual case for streaming writes.
+        if ((size_t) (nhi - nlo) > e->cap)
+        {
+            data = ep_mem_realloc(e->data, max((size_t) (nhi - nlo), e->cap * 2));
+            if (data == NULL)
+                return false;
+            e->data = data;
+            e->cap = max((size_t) (nhi - nlo), e->cap * 2);
+        }
     }
-
-    memset(buf, 0, size);
-
-    /* On a miss, traverse the fig tree. */
-    if (size > 0)
+    else
     {
-        fig_t indexgroup;
-        figiter_t* figterator;
-        int numleft = 0;
-        EP_THR_MUTEX lock;
-        EP_THR_COND condvar;
-        gdpfs_readstate_t* rs;
-        ep_thr_mutex_init(&lock, EP_THR_MUTEX_NORMAL);
-        ep_thr_cond_init(&condvar);
-        ep_thr_rwlock_wrlock(&file->figtree_lock);
-        figterator = ft_read(&file->figtree, offset, offset + size - 1, file->log_handle);
-        while (fti_next(figterator, &indexgroup, file->log_handle)) {
-            if (indexgroup.value == 0) {
-                // We have to read from the cache here
-                EP_ASSERT(gdpfs_file_get_cache(file, buf + indexgroup.irange.left - offset, indexgroup.irange.right - indexgroup.irange.left + 1,
-                                               indexgroup.irange.left));
-                continue;
-            }
-            /* This if statement is really just a workaround for until we can get multiread working... */
-            if (indexgroup.value > 0) {
-                gdpfs_log_ent_t log_ent;
-                size_t data_size, read;
-                gdpfs_fmeta_t entry;
-                gdpfs_log_ent_open(file->log_handle, &log_ent, indexgroup.value, true);
-                data_size = gdpfs_log_ent_length(&log_ent);
-                read = gdpfs_log_ent_read(&log_ent, &entry, sizeof(gdpfs_fmeta_t));
-                if (read != sizeof(gdpfs_fmeta_t)
-                    || data_size != sizeof(gdpfs_fmeta_t) + entry.ent_size)
-                {
-                    ep_app_fatal("Corrupt log entry in file (#4).");
-                }
-
-                gdpfs_log_ent_drain(&log_ent, indexgroup.irange.left - entry.ent_offset);
-                EP_ASSERT_REQUIRE(gdpfs_log_ent_read(&log_ent, buf + (indexgroup.irange.left - offset), indexgroup.irange.right - indexgroup.irange.left + 1) ==
-                    indexgroup.irange.right - indexgroup.irange.left + 1);
-                gdpfs_log_ent_close(&log_ent);
-                continue;
-            }
-            rs = ep_mem_zalloc(sizeof(gdpfs_readstate_t)); // freed by the callback
-            rs->lock = &lock;
-            rs->condvar = &condvar;
-            rs->numleft = &numleft;
-            rs->start = indexgroup.irange.left;
-            rs->len = indexgroup.irange.right - indexgroup.irange.left + 1;
-            rs->writebuf = buf + (indexgroup.irange.left - offset);
-            ep_thr_mutex_lock(&lock);
-            numleft++;
-            ep_thr_mutex_unlock(&lock);
-            estat = gdp_gcl_multiread(file->log_handle->gcl_handle, indexgroup.value, 1, NULL, rs);
-            EP_ASSERT(EP_STAT_ISOK(estat));
+        data = ep_mem_malloc(nhi - nlo);
+        if (data == NULL)
+            return false;
+        for (k = i; k < j; k++)
+        {
+            memcpy(data + (wb[k].offset - nlo), wb[k].data, wb[k].size);
+            ep_mem_free(wb[k].data);
         }
-        ep_thr_rwlock_unlock(&file->figtree_lock);
-        fti_free(figterator);
+        memmove(&wb[i + 1], &wb[j], (file->wb_n - j) * sizeof(wb_extent_t));
+        file->wb_n -= j - i - 1;
+        e->data = data;
+        e->cap = nhi - nlo;
+    }
+    memcpy(e->data + (lo - nlo), buf, size);
+    e->offset = nlo;
+    e->size = nhi - nlo;
+    *added = e->size - old;
+    return true;
+}
 
-        ep_thr_mutex_lock(&lock);
-        // Technically we could make this an "if", but "while" is more idiomatic
-        while (numleft > 0) {
-            ep_thr_cond_wait(&condvar, &lock, NULL);
+/*
+ * Copies whatever file has buffered within [offset, offset + size) into a
+ * list for _wb_overlay_apply, sealed extents first so newer writes land on
+ * top. Call with figtree_lock held, so the copy matches the figtree the read
+ * went by.
+ */
+static int
+_wb_overlay_collect(gdpfs_file_t *file, off_t offset, size_t size,
+        wb_extent_t **ovp)
+{
+    wb_extent_t *ov;
+    wb_extent_t *src;
+    off_t lo;
+    off_t hi;
+    int nov = 0;
+    int n;
+    int i;
+    int pass;
+
+    *ovp = NULL;
+    ep_thr_mutex_lock(&file->wb_lock);
+    if (file->wb_n + file->wb_nflushing == 0)
+    {
+        ep_thr_mutex_unlock(&file->wb_lock);
+        return 0;
+    }
+    ov = ep_mem_zalloc((file->wb_n + file->wb_nflushing) * sizeof(wb_extent_t));
+    for (pass = 0; pass < 2 && ov != NULL; pass++)
+    {
+        src = pass == 0 ? file->wb_flushing : file->wb;
+        n = pass == 0 ? file->wb_nflushing : file->wb_n;
+        for (i = 0; i < n; i++)
+        {
+            lo = max(offset, src[i].offset);
+            hi = min(offset + (off_t) size, src[i].offset + (off_t) src[i].size);
+            if (lo >= hi)
+                continue;
+            ov[nov].offset = lo;
+            ov[nov].size = hi - lo;
+            ov[nov].data = ep_mem_malloc(hi - lo);
+            memcpy(ov[nov].data, src[i].data + (lo - src[i].offset), hi - lo);
+            nov++;
         }
-        ep_thr_mutex_unlock(&lock);
-
-        ep_thr_mutex_destroy(&lock);
-        ep_thr_cond_destroy(&condvar);
+    }
+    ep_thr_mutex_unlock(&file->wb_lock);
+    *ovp = ov;
+    return nov;
+}
 
-        ep_thr_mutex_lock(&file->cache_lock);
-        estat = gdpfs_file_fill_cache(files[fh], buf, size, offset, true);
-        ep_thr_mutex_unlock(&file->cache_lock);
+static void
+_wb_overlay_apply(char *buf, off_t offset, wb_extent_t *ov, int nov)
+{
+    int i;
 
-        return size;
+    for (i = 0; i < nov; i++)
+    {
+        memcpy(buf + (ov[i].offset - offset), ov[i].data, ov[i].size);
+        ep_mem_free(ov[i].data);
     }
-
-    return 0;
+    if (ov != NULL)
+        ep_mem_free(ov);
 }
 
-size_t
-gdpfs_file_read(uint64_t fh, void *buf, size_t size, off_t offset)
+/* Whether file's write-back buffer has been sitting long enough to flush. */
+static bool
+_wb_due(gdpfs_file_t *file, const EP_TIME_SPEC *now)
 {
-    return do_read(fh, buf, size, offset);
+    bool due;
+
+    ep_thr_mutex_lock(&file->wb_lock);
+    due = file->wb_n > 0 && now->tv_sec - file->wb_since.tv_sec >= WB_AGE;
+    ep_thr_mutex_unlock(&file->wb_lock);
+    return due;
 }
 
-static void
-free_fileref(gdp_event_t* ev)
+/*
+ * Appends a record that only carries info, behind whatever fh's file has
+ * buffered. Unlike data, it goes out before this returns, so a failure can
+ * be reported to the caller and its journal record given up.
+ */
+static EP_STAT
+do_write_meta(uint64_t fh, const gdpfs_file_info_t *info)
 {
     EP_STAT estat;
-    gdpfs_file_t* file = gdp_event_getudata(ev);
-    ep_thr_mutex_lock(&file->index_flush_lock);
-    if ((--file->outstanding_reqs) == 0) {
-        ep_thr_cond_signal(&file->index_flush_cond);
+    gdpfs_file_t *file;
+    wb_extent_t meta;
+
+    file = lookup_fh(fh);
+    if (file == NULL)
+        return GDPFS_STAT_BADFH;
+
+    if (journal_on)
+    {
+        estat = gdpfs_journal_write((uint8_t *) file->hash_key, info,
+                NULL, 0, 0);
+        if (!EP_STAT_ISOK(estat))
+            return estat;
     }
-    ep_thr_mutex_unlock(&file->index_flush_lock);
-    estat = gdp_event_getstat(ev);
-    if (!EP_STAT_ISOK(estat))
-        ep_app_error("Could not properly append: %d", EP_STAT_DETAIL(estat));
-    estat = _file_unref(file);
-    if (!EP_STAT_ISOK(estat))
-        ep_app_error("Could not unreference file at %p", file);
+
+    estat = _file_wb_flush(file);
+    if (EP_STAT_ISOK(estat))
+    {
+        meta.offset = 0;
+        meta.size = 0;
+        meta.data = NULL;
+        estat = _file_append(file, &meta, 1, info, false, journal_on ? 1 : 0);
+    }
+    // The caller hears about it, so there's nothing to replay.
+    if (!EP_STAT_ISOK(estat) && journal_on)
+        gdpfs_journal_release(1);
+    return estat;
 }
 
 // TODO: do_write should probably return an EP_STAT so we can error check
@@ -1003,20 +2974,11 @@ static size_t
 do_write(uint64_t fh, const char *buf, size_t size, off_t offset,
     const gdpfs_file_info_t *info)
 {
-    EP_STAT estat;
     gdpfs_file_t *file;
-    size_t written = 0;
-    gdpfs_log_ent_t log_ent;
-    gdpfs_recno_t rc;
-    gdpfs_fmeta_t entry = {
-        .file_size   = info->file_size,
-        .file_type   = info->file_type,
-        .file_perm   = info->file_perm,
-        .logent_type = GDPFS_LOGENT_TYPE_DATA,
-        .ent_offset  = offset,
-        .ent_size    = size,
-        .magic       = MAGIC_NUMBER,
-    };
+    size_t added = 0;
+    bool stored;
+    bool full;
+    bool pressure;
 
     // TODO: where are perms checked?
 
@@ -1024,58 +2986,62 @@ do_write(uint64_t fh, const char *buf, size_t size, off_t offset,
     if (file == NULL)
         return 0;
 
-    estat = gdpfs_log_ent_init(&log_ent);
-    if (!EP_STAT_ISOK(estat))
-        goto fail1;
-    if (gdpfs_log_ent_write(&log_ent, &entry, sizeof(gdpfs_fmeta_t)) != 0)
-    {
-        ep_app_error("Failed on metadata write to log entry");
-        goto fail0;
-    }
-    if (gdpfs_log_ent_write(&log_ent, buf, size) != 0)
+    if (size == 0)
     {
-        ep_app_error("Failed on data write to log entry");
-        goto fail0;
+        do_write_meta(fh, info);
+        return 0;
     }
 
-    estat = _file_ref(file);
-    if (!EP_STAT_ISOK(estat))
-        goto fail0;
-
-    ep_thr_mutex_lock(&file->index_flush_lock);
-    file->outstanding_reqs++;
-    ep_thr_mutex_unlock(&file->index_flush_lock);
+    // Once it's in the journal the write survives a crash, so it can be acked.
+    if (journal_on && !EP_STAT_ISOK(gdpfs_journal_write(
+            (uint8_t *) file->hash_key, info, buf, size, offset)))
+        return 0;
 
-    // Write to cache. true is for overwriting cache
-    if (use_cache)
+    /* The cache and the buffer are updated together, so concurrent writes to
+     * the same bytes land in the same order in both. */
+    do
     {
-        ep_thr_mutex_lock(&file->cache_lock);
-        gdpfs_file_fill_cache(file, buf, size, offset, true);
-        ep_thr_rwlock_wrlock(&file->figtree_lock);
-        ep_thr_mutex_unlock(&file->cache_lock);
-    }
-    else
-        ep_thr_rwlock_wrlock(&file->figtree_lock);
-
-    rc = ++file->last_recno;
-
-    if (size > 0)
-        ft_write(&file->figtree, offset, offset + size - 1, rc, file->log_handle);
-
-    estat = gdpfs_log_append(file->log_handle, &log_ent, free_fileref, file);
-
-    ep_thr_rwlock_unlock(&file->figtree_lock);
+        if (use_cache)
+            ep_thr_mutex_lock(&file->cache_lock);
+        ep_thr_mutex_lock(&file->wb_lock);
+        if (file->wb_n == 0)
+            ep_time_now(&file->wb_since);
+        stored = _wb_insert(file, buf, size, offset, &added);
+        if (stored)
+        {
+            file->wb_info = *info;
+            file->wb_bytes += added;
+            if (journal_on)
+                file->wb_journaled++;
+        }
+        full = file->wb_bytes >= WB_MAX_BYTES || file->wb_n == WB_MAX_EXTENTS;
+        ep_thr_mutex_unlock(&file->wb_lock);
+        if (use_cache)
+        {
+            if (stored)
+            {
+                gdpfs_file_fill_cache(file, buf, size, offset, true);
+                file->cache_gen++;
+            }
+            ep_thr_mutex_unlock(&file->cache_lock);
+        }
+        if (!stored && !EP_STAT_ISOK(_file_wb_flush(file)))
+        {
+            // The caller hears about it, so there's nothing to replay.
+            if (journal_on)
+                gdpfs_journal_release(1);
+            return 0;
+        }
+    } while (!stored);
 
-    if (EP_STAT_ISOK(estat))
-    {
-        written = size;
-    }
+    ep_thr_mutex_lock(&wb_total_lock);
+    wb_total += added;
+    pressure = wb_total > WB_GLOBAL_MAX;
+    ep_thr_mutex_unlock(&wb_total_lock);
 
-fail0:
-    // remember to free our resources
-    gdpfs_log_ent_close(&log_ent);
-fail1:
-    return written;
+    if (full || pressure)
+        _file_wb_flush(file);
+    return size;
 }
 
 size_t
@@ -1097,6 +3063,61 @@ gdpfs_file_write(uint64_t fh, const void *buf, size_t size, off_t offset)
     return do_write(fh, buf, size, offset, info);
 }
 
+/* Sends what fh's file has buffered on its way to the log. */
+EP_STAT
+gdpfs_file_flush(uint64_t fh)
+{
+    gdpfs_file_t *file;
+
+    file = lookup_fh(fh);
+    if (file == NULL)
+        return GDPFS_STAT_BADFH;
+    return _file_wb_flush(file);
+}
+
+/*
+ * Flushes fh's file and waits until the log has acked every append of the
+ * file made up to then, without waiting on any made after. Fails if an
+ * append of the file failed since the last sync.
+ */
+EP_STAT
+gdpfs_file_sync(uint64_t fh)
+{
+    EP_STAT estat;
+    gdpfs_file_t *file;
+    gdpfs_recno_t target;
+    bool failed;
+
+    file = lookup_fh(fh);
+    if (file == NULL)
+        return GDPFS_STAT_BADFH;
+    // Every write was on disk in the journal before it was acked.
+    if (journal_on)
+        return GDPFS_STAT_OK;
+
+    estat = _file_wb_flush(file);
+    if (!EP_STAT_ISOK(estat))
+        return estat;
+
+    // Only data records are waited for. A checkpoint just saves the next
+    // open some replay: if the one a record's chkpt_recno names never makes
+    // it, _file_load_chkpt finds no checkpoint there and open scans back for
+    // an older one, so nothing written is lost without it.
+    ep_thr_mutex_lock(&file->ack_lock);
+    if (!list_empty(&file->appends))
+    {
+        target = list_entry(list_back(&file->appends),
+                append_req_t, file_elem)->recno;
+        while (file->acked_recno < target) {
+            ep_thr_cond_wait(&file->ack_cond, &file->ack_lock, NULL);
+        }
+    }
+    failed = file->append_failed;
+    file->append_failed = false;
+    ep_thr_mutex_unlock(&file->ack_lock);
+    return failed ? GDPFS_STAT_RW_FAILED : GDPFS_STAT_OK;
+}
+
 // TODO return an EP_STAT
 int
 gdpfs_file_ftruncate(uint64_t fh, size_t file_size)
@@ -1108,10 +3129,11 @@ gdpfs_file_ftruncate(uint64_t fh, size_t file_size)
     if (!EP_STAT_ISOK(estat))
     {
         ep_app_error("failed to get file info");
-        return 0;
+        return -EIO;
     }
     info->file_size = 0;
-    return do_write(fh, NULL, 0, 0, info);
+    estat = do_write_meta(fh, info);
+    return EP_STAT_ISOK(estat) ? 0 : -EIO;
 }
 
 EP_STAT
@@ -1127,15 +3149,13 @@ gdpfs_file_set_perm(uint64_t fh, gdpfs_file_perm_t perm)
         return estat;
     }
     info->file_perm = perm;
-    do_write(fh, NULL, 0, 0, info);
-    return GDPFS_STAT_OK;
+    return do_write_meta(fh, info);
 }
 
 EP_STAT
 gdpfs_file_set_info(uint64_t fh, gdpfs_file_info_t* info)
 {
-    do_write(fh, NULL, 0, 0, info);
-    return GDPFS_STAT_OK;
+    return do_write_meta(fh, info);
 }
 
 EP_STAT
@@ -1217,21 +3237,161 @@ fail0:
 static gdpfs_file_t *
 lookup_fh(uint64_t fh)
 {
-    int set;
+    fh_slot_t *slot;
 
-    set = bitmap_is_set(fhs, fh);
-    if (set < 0)
+    slot = fh_table_slot(fhs, fh);
+    if (slot == NULL)
     {
         ep_app_error("recieved bad file descriptor:%Lu", fh);
         return NULL;
     }
-    return files[fh];
+    return slot->file;
 }
 
 void
 gdpfs_file_gname(uint64_t fh, gdpfs_file_gname_t gname)
 {
-    memcpy(gname, files[fh]->hash_key, sizeof(gdpfs_file_gname_t));
+    memcpy(gname, lookup_fh(fh)->hash_key, sizeof(gdpfs_file_gname_t));
+}
+
+/*
+ * Log decoder: turns v1 and v2 headers into a plain gdpfs_fmeta_t, extent
+ * tables into gdpfs_extent_t arrays, and expands compressed payloads, so
+ * everything above the log layer sees records as a gdpfs_fmeta_t followed by
+ * ent_size bytes of table and data.
+ */
+static EP_STAT
+_file_decode_record(gdpfs_log_ent_t *ent, void **out, size_t *outlen, size_t *replace)
+{
+    EP_STAT estat;
+    gdpfs_fmeta_t entry;
+    uint8_t raw[sizeof(gdpfs_fmeta_t) + GDPFS_FMETA_MAX_SIZE];
+    gdpfs_extent_t exts[GDPFS_FMETA_MAX_EXTENTS];
+    uint8_t flags;
+    struct iovec *iov = NULL;
+    uint8_t *tbl = NULL;
+    size_t length;
+    size_t hlen;
+    size_t tlen = 0;
+    size_t datalen = 0;
+    size_t xlen;
+    uint32_t n = 0;
+    uint32_t i;
+    int iovcnt;
+    char *plain = NULL;
+    char *rec;
+
+    *out = NULL;
+    length = gdpfs_log_ent_length(ent);
+    hlen = gdpfs_log_ent_peek(ent, raw, sizeof raw);
+    hlen = gdpfs_fmeta_decode(raw, hlen, length, &entry, &flags);
+    if (hlen == 0)
+    {
+        // Not a header we know; readers will report it as corrupt.
+        return GDPFS_STAT_OK;
+    }
+
+    if (flags & GDPFS_FMETA_FLAG_COMPRESSED)
+    {
+        // ent_size comes straight off the log, so check it before trusting it.
+        if (!gdpfs_decompress_size_ok(length - hlen, entry.ent_size))
+        {
+            ep_app_error("Compressed record claims %zu bytes", entry.ent_size);
+            return GDPFS_STAT_CORRUPT;
+        }
+        iovcnt = gdpfs_log_ent_peekv(ent, length, NULL, 0);
+        if (iovcnt < 0)
+            return GDPFS_STAT_CORRUPT;
+        iov = ep_mem_malloc((iovcnt > 0 ? iovcnt : 1) * sizeof(struct iovec));
+        plain = ep_mem_malloc(sizeof(gdpfs_fmeta_t) + entry.ent_size);
+        if (iov == NULL || plain == NULL)
+        {
+            estat = GDPFS_STAT_OOMEM;
+            goto fail0;
+        }
+        gdpfs_log_ent_peekv(ent, length, iov, iovcnt);
+        estat = gdpfs_decompressv(iov, iovcnt, hlen,
+                plain + sizeof(gdpfs_fmeta_t), entry.ent_size);
+        if (!EP_STAT_ISOK(estat))
+            goto fail0;
+        ep_mem_free(iov);
+        iov = NULL;
+    }
+
+    if (flags & GDPFS_FMETA_FLAG_MULTI_EXTENT)
+    {
+        if (plain != NULL)
+        {
+            tbl = (uint8_t *) plain + sizeof(gdpfs_fmeta_t);
+            tlen = gdpfs_fmeta_decode_extents(tbl, entry.ent_size, exts, &n);
+        }
+        else
+        {
+            xlen = min(length, hlen + GDPFS_FMETA_EXTENTS_MAX_SIZE);
+            tbl = ep_mem_malloc(xlen);
+            if (tbl == NULL)
+            {
+                estat = GDPFS_STAT_OOMEM;
+                goto fail0;
+            }
+            xlen = gdpfs_log_ent_peek(ent, tbl, xlen);
+            tlen = xlen > hlen ?
+                    gdpfs_fmeta_decode_extents(tbl + hlen, xlen - hlen, exts, &n) : 0;
+            ep_mem_free(tbl);
+        }
+        for (i = 0; i < n; i++)
+            datalen += exts[i].size;
+        if (tlen == 0 || tlen + datalen != entry.ent_size)
+        {
+            estat = GDPFS_STAT_CORRUPT;
+            goto fail0;
+        }
+        entry.ent_count = n;
+        entry.ent_size = n * sizeof(gdpfs_extent_t) + datalen;
+    }
+
+    if (plain == NULL)
+    {
+        // Just widen the header and table in place.
+        rec = ep_mem_malloc(sizeof(gdpfs_fmeta_t) + n * sizeof(gdpfs_extent_t));
+        if (rec == NULL)
+            return GDPFS_STAT_OOMEM;
+        memcpy(rec, &entry, sizeof(gdpfs_fmeta_t));
+        memcpy(rec + sizeof(gdpfs_fmeta_t), exts, n * sizeof(gdpfs_extent_t));
+        *out = rec;
+        *outlen = sizeof(gdpfs_fmeta_t) + n * sizeof(gdpfs_extent_t);
+        *replace = hlen + tlen;
+        return GDPFS_STAT_OK;
+    }
+
+    if (n > 0)
+    {
+        // The decoded table isn't the size of the encoded one, so the data
+        // has to move.
+        rec = ep_mem_malloc(sizeof(gdpfs_fmeta_t) + entry.ent_size);
+        if (rec == NULL)
+        {
+            estat = GDPFS_STAT_OOMEM;
+            goto fail0;
+        }
+        memcpy(rec + sizeof(gdpfs_fmeta_t), exts, n * sizeof(gdpfs_extent_t));
+        memcpy(rec + sizeof(gdpfs_fmeta_t) + n * sizeof(gdpfs_extent_t),
+                plain + sizeof(gdpfs_fmeta_t) + tlen, datalen);
+        ep_mem_free(plain);
+        plain = rec;
+    }
+    memcpy(plain, &entry, sizeof(gdpfs_fmeta_t));
+    *out = plain;
+    *outlen = sizeof(gdpfs_fmeta_t) + entry.ent_size;
+    *replace = length;
+    return GDPFS_STAT_OK;
+
+fail0:
+    if (iov != NULL)
+        ep_mem_free(iov);
+    if (plain != NULL)
+        ep_mem_free(plain);
+    return estat;
 }
 
 /**
@@ -1252,10 +3412,9 @@ static EP_STAT gdpfs_file_fill_cache(gdpfs_file_t *file, const void *buffer, siz
 
     if (overwrite)
     {
-        if (lseek(file->cache_fd, offset, SEEK_SET) < 0)
-            goto fail0;
-        if (write(file->cache_fd, buffer, size) != size)
+        if (pwrite(file->cache_fd, buffer, size, offset) != size)
             goto fail0;
+        _cache_map_add(file, offset, offset + size);
 #ifdef USE_BITMAP
         if (size != 0)
             bitmap_file_set_range(file->cache_bitmap_fd, offset, offset + size);
@@ -1288,14 +3447,195 @@ fail0:
     return estat;
 }
 
+/*
+ * Fill cache with the next size bytes of ent starting at offset, writing
+ * straight out of the ent's buffers. Consumes those bytes of the ent.
+ */
+static EP_STAT gdpfs_file_fill_cache_ent(gdpfs_file_t *file, gdpfs_log_ent_t *ent,
+        size_t size, off_t offset)
+{
+    struct iovec iov[FILL_IOV_MAX];
+    int iovcnt;
+    int i;
+    size_t len;
+    off_t start = offset;
+
+    if (!use_cache)
+    {
+        ep_app_error("Illegal call to gdpfs_file_fill_cache_ent with cache disabled.");
+        return GDPFS_STAT_INVLDMODE;
+    }
+
+    while (size > 0)
+    {
+        iovcnt = gdpfs_log_ent_peekv(ent, size, iov, FILL_IOV_MAX);
+        if (iovcnt <= 0)
+            return GDPFS_STAT_CORRUPT;
+        if (iovcnt > FILL_IOV_MAX)
+            iovcnt = FILL_IOV_MAX;
+        len = 0;
+        for (i = 0; i < iovcnt; i++)
+            len += iov[i].iov_len;
+        if (pwritev(file->cache_fd, iov, iovcnt, offset) != len)
+            return GDPFS_STAT_LOCAL_FS_FAIL;
+#ifdef USE_BITMAP
+        bitmap_file_set_range(file->cache_bitmap_fd, offset, offset + len);
+#endif
+        gdpfs_log_ent_drain(ent, len);
+        offset += len;
+        size -= len;
+    }
+    _cache_map_add(file, start, offset);
+    return GDPFS_STAT_OK;
+}
+
+/* Index of the first range in file's cache map that ends at or after off. */
+static int _cache_map_search(gdpfs_file_t *file, off_t off)
+{
+    int lo = 0;
+    int hi = file->cache_map_n;
+    int mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (file->cache_map[mid].hi < off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Makes room for one more range in file's cache map. */
+static bool _cache_map_grow(gdpfs_file_t *file)
+{
+    cache_range_t *map;
+    int cap;
+
+    if (file->cache_map_n < file->cache_map_cap)
+        return true;
+    cap = file->cache_map_cap == 0 ? 16 : file->cache_map_cap << 1;
+    map = ep_mem_realloc(file->cache_map, cap * sizeof(cache_range_t));
+    if (map == NULL)
+        return false;
+    file->cache_map = map;
+    file->cache_map_cap = cap;
+    return true;
+}
+
+/*
+ * Marks [lo, hi) of file's cache valid, merging it with the ranges it
+ * overlaps or touches. The data must already be there. cache_lock must be
+ * held.
+ */
+static void _cache_map_add(gdpfs_file_t *file, off_t lo, off_t hi)
+{
+    cache_range_t *map;
+    int n;
+    int i, j;
+
+    if (lo >= hi)
+        return;
+    ep_thr_rwlock_wrlock(&file->cache_map_lock);
+    n = file->cache_map_n;
+    i = _cache_map_search(file, lo);
+    for (j = i; j < n && file->cache_map[j].lo <= hi; j++)
+        continue;
+    if (i == j)
+    {
+        // Without room it just isn't seen as cached.
+        if (_cache_map_grow(file))
+        {
+            map = file->cache_map;
+            memmove(&map[i + 1], &map[i], (n - i) * sizeof(cache_range_t));
+            map[i].lo = lo;
+            map[i].hi = hi;
+            file->cache_map_n++;
+        }
+    }
+    else
+    {
+        map = file->cache_map;
+        map[i].lo = min(lo, map[i].lo);
+        map[i].hi = max(hi, map[j - 1].hi);
+        memmove(&map[i + 1], &map[j], (n - j) * sizeof(cache_range_t));
+        file->cache_map_n -= j - i - 1;
+    }
+    ep_thr_rwlock_unlock(&file->cache_map_lock);
+}
+
+/*
+ * Drop size bytes starting at offset from the cache. Only the map changes:
+ * what is on disk there is never read again until it has been rewritten.
+ */
+static void gdpfs_file_uncache(gdpfs_file_t *file, size_t size, off_t offset)
+{
+    cache_range_t *map;
+    cache_range_t keep[2];
+    off_t hi = offset + size;
+    int nkeep = 0;
+    int n;
+    int i, j;
+
+    if (!use_cache)
+    {
+        ep_app_error("Illegal call to gdpfs_file_uncache with cache disabled.");
+        return;
+    }
+    if (size == 0)
+        return;
+
+    ep_thr_rwlock_wrlock(&file->cache_map_lock);
+    n = file->cache_map_n;
+    i = _cache_map_search(file, offset + 1);
+    for (j = i; j < n && file->cache_map[j].lo < hi; j++)
+        continue;
+    if (i < j)
+    {
+        map = file->cache_map;
+        if (map[i].lo < offset)
+        {
+            keep[nkeep].lo = map[i].lo;
+            keep[nkeep++].hi = offset;
+        }
+        // Splitting one range in two needs room; without it, the tail goes
+        // too, which is only a miss.
+        if (map[j - 1].hi > hi && (j - i > 1 || nkeep == 0 || _cache_map_grow(file)))
+        {
+            keep[nkeep].lo = hi;
+            keep[nkeep++].hi = file->cache_map[j - 1].hi;
+        }
+        map = file->cache_map;
+        memmove(&map[i + nkeep], &map[j], (n - j) * sizeof(cache_range_t));
+        memcpy(&map[i], keep, nkeep * sizeof(cache_range_t));
+        file->cache_map_n = n - (j - i) + nkeep;
+    }
+    ep_thr_rwlock_unlock(&file->cache_map_lock);
+}
+
+/*
+ * Whether all size bytes starting at offset are in the cache. Takes no
+ * syscalls, and readers only share cache_map_lock.
+ */
+static bool gdpfs_file_cache_covers(gdpfs_file_t *file, size_t size, off_t offset)
+{
+    bool covered;
+    int i;
+
+    ep_thr_rwlock_rdlock(&file->cache_map_lock);
+    i = _cache_map_search(file, offset);
+    covered = i < file->cache_map_n && file->cache_map[i].lo <= offset &&
+              file->cache_map[i].hi >= offset + (off_t) size;
+    ep_thr_rwlock_unlock(&file->cache_map_lock);
+    return covered;
+}
+
 static bool gdpfs_file_get_cache(gdpfs_file_t *file, void *buffer, size_t size,
         off_t offset)
 {
     ssize_t rv;
     bool hit;
-#ifndef USE_BITMAP
-    off_t lrv;
-#endif
 
     if (!use_cache)
     {
@@ -1322,23 +3662,13 @@ static bool gdpfs_file_get_cache(gdpfs_file_t *file, void *buffer, size_t size,
     if (size == 0)
         return true;
 
-#ifndef USE_BITMAP
-    lrv = lseek(file->cache_fd, offset, SEEK_HOLE);
-    if (lrv == (off_t) -1)
-        hit = false;
-    else
-        hit = (lrv >= offset + size);
-#else
-
-    hit = bitmap_file_isset(file->cache_bitmap_fd, offset, offset + size);
-
-#endif
+    hit = gdpfs_file_cache_covers(file, size, offset);
 
 check:
     if (hit)
     {
-        lseek(file->cache_fd, offset, SEEK_SET);
-        rv = read(file->cache_fd, buffer, size);
+        // Readers can get here concurrently, so no shared file offset.
+        rv = pread(file->cache_fd, buffer, size, offset);
         if (rv != size)
         {
             ep_app_error("Cache is corrupt!\n");
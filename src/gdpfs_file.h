@@ -74,14 +74,30 @@ typedef struct
     gdpfs_logent_type_t logent_type;
     off_t ent_offset;
     size_t ent_size;
+    gdpfs_recno_t chkpt_recno;  // latest checkpoint when written, 0 if unknown
+    uint32_t ent_count;         // extents in the table after the header, 0 if just one
     uint64_t magic;
 } gdpfs_fmeta_t;
 
+/*
+ * A multi-extent record (ent_count > 0) has ent_count of these right after
+ * its header, followed by each extent's data in table order. ent_size covers
+ * the table as well as the data.
+ */
+typedef struct
+{
+    off_t offset;
+    size_t size;
+} gdpfs_extent_t;
+
 /*
  * global file subsystem intiailization
  */
 EP_STAT
-init_gdpfs_file(gdpfs_file_mode_t fs_mode, bool use_cache, char *gdp_router_addr);
+init_gdpfs_file(gdpfs_file_mode_t fs_mode, bool use_cache, bool mock_log,
+        size_t mem_cache_bytes, int append_window, int append_window_global,
+        bool compress, int chkpt_records, int chkpt_mb, int chkpt_age,
+        char *gdp_router_addr, char *journal_path);
 
 void
 stop_gdpfs_file();
@@ -128,6 +144,14 @@ gdpfs_file_write(uint64_t fh, const void *buf, size_t size, off_t offset);
 int
 gdpfs_file_ftruncate(uint64_t fh, size_t file_size);
 
+// Starts what has been written to fh on its way to the log.
+EP_STAT
+gdpfs_file_flush(uint64_t fh);
+
+// Returns once what has been written to fh is in the log.
+EP_STAT
+gdpfs_file_sync(uint64_t fh);
+
 EP_STAT
 gdpfs_file_set_perm(uint64_t fh, gdpfs_file_perm_t perm);
 
@@ -0,0 +1,240 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "gdpfs_fmeta.h"
+
+#include <string.h>
+
+/* How gdpfs_fmeta_t used to be laid out, and v1 records still are. */
+typedef struct
+{
+    size_t file_size;
+    uint16_t file_perm;
+    gdpfs_file_type_t file_type;
+    gdpfs_logent_type_t logent_type;
+    off_t ent_offset;
+    size_t ent_size;
+    uint64_t magic;
+} gdpfs_fmeta_v1_t;
+
+static size_t
+_put_uvarint(uint8_t *buf, uint64_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80)
+    {
+        buf[n++] = (uint8_t) v | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t) v;
+    return n;
+}
+
+static size_t
+_put_svarint(uint8_t *buf, int64_t v)
+{
+    return _put_uvarint(buf, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+/* Returns the number of bytes consumed, or 0 if buf ends mid-varint. */
+static size_t
+_get_uvarint(const uint8_t *buf, size_t len, uint64_t *v)
+{
+    size_t n;
+    int shift = 0;
+
+    *v = 0;
+    for (n = 0; n < len && shift < 64; n++, shift += 7)
+    {
+        *v |= (uint64_t) (buf[n] & 0x7f) << shift;
+        if (!(buf[n] & 0x80))
+            return n + 1;
+    }
+    return 0;
+}
+
+static size_t
+_get_svarint(const uint8_t *buf, size_t len, int64_t *v)
+{
+    uint64_t u;
+    size_t n = _get_uvarint(buf, len, &u);
+
+    *v = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+    return n;
+}
+
+size_t
+gdpfs_fmeta_encode(const gdpfs_fmeta_t *meta, uint8_t flags, uint8_t *buf)
+{
+    size_t n = 0;
+
+    if (meta->chkpt_recno > 0)
+        flags |= GDPFS_FMETA_FLAG_CHKPT;
+    buf[n++] = GDPFS_FMETA_VERSION;
+    buf[n++] = (uint8_t) meta->logent_type;
+    buf[n++] = flags;
+    n += _put_uvarint(buf + n, meta->file_size);
+    n += _put_svarint(buf + n, meta->file_type);
+    n += _put_uvarint(buf + n, meta->file_perm);
+    n += _put_svarint(buf + n, meta->ent_offset);
+    n += _put_uvarint(buf + n, meta->ent_size);
+    if (flags & GDPFS_FMETA_FLAG_CHKPT)
+        n += _put_uvarint(buf + n, meta->chkpt_recno);
+    return n;
+}
+
+static size_t
+_decode_v1(const uint8_t *buf, size_t len, gdpfs_fmeta_t *meta, uint8_t *flags)
+{
+    gdpfs_fmeta_v1_t v1;
+
+    if (len < sizeof(gdpfs_fmeta_v1_t))
+        return 0;
+    memcpy(&v1, buf, sizeof(gdpfs_fmeta_v1_t));
+    if (v1.magic != GDPFS_FMETA_V1_MAGIC)
+        return 0;
+    memset(meta, 0, sizeof(gdpfs_fmeta_t));
+    meta->file_size = v1.file_size;
+    meta->file_perm = v1.file_perm;
+    meta->file_type = v1.file_type;
+    meta->logent_type = v1.logent_type;
+    meta->ent_offset = v1.ent_offset;
+    meta->ent_size = v1.ent_size;
+    meta->magic = v1.magic;
+    *flags = 0;
+    return sizeof(gdpfs_fmeta_v1_t);
+}
+
+static size_t
+_decode_v2(const uint8_t *buf, size_t len, gdpfs_fmeta_t *meta, uint8_t *flags)
+{
+    uint64_t u;
+    int64_t i;
+    size_t n = 3;
+    size_t k;
+
+    if (len < 3 || buf[0] != GDPFS_FMETA_VERSION)
+        return 0;
+    memset(meta, 0, sizeof(gdpfs_fmeta_t));
+    meta->logent_type = buf[1];
+    *flags = buf[2];
+
+    if ((k = _get_uvarint(buf + n, len - n, &u)) == 0)
+        return 0;
+    meta->file_size = u;
+    n += k;
+    if ((k = _get_svarint(buf + n, len - n, &i)) == 0)
+        return 0;
+    meta->file_type = i;
+    n += k;
+    if ((k = _get_uvarint(buf + n, len - n, &u)) == 0)
+        return 0;
+    meta->file_perm = u;
+    n += k;
+    if ((k = _get_svarint(buf + n, len - n, &i)) == 0)
+        return 0;
+    meta->ent_offset = i;
+    n += k;
+    if ((k = _get_uvarint(buf + n, len - n, &u)) == 0)
+        return 0;
+    meta->ent_size = u;
+    n += k;
+    if (*flags & GDPFS_FMETA_FLAG_CHKPT)
+    {
+        if ((k = _get_uvarint(buf + n, len - n, &u)) == 0)
+            return 0;
+        meta->chkpt_recno = u;
+        n += k;
+    }
+
+    meta->magic = GDPFS_FMETA_V1_MAGIC;
+    return n;
+}
+
+size_t
+gdpfs_fmeta_decode(const uint8_t *buf, size_t len, size_t record_len,
+        gdpfs_fmeta_t *meta, uint8_t *flags)
+{
+    size_t n;
+
+    if (len > record_len)
+        len = record_len;
+
+    // A v1 header is recognized by its trailing 64-bit magic, so a v2 header
+    // can't be mistaken for one in practice. Try it first.
+    if ((n = _decode_v1(buf, len, meta, flags)) != 0)
+        return n;
+    return _decode_v2(buf, len, meta, flags);
+}
+
+size_t
+gdpfs_fmeta_encode_extents(const gdpfs_extent_t *exts, uint32_t n, uint8_t *buf)
+{
+    size_t len = 0;
+    uint32_t i;
+
+    len += _put_uvarint(buf + len, n);
+    for (i = 0; i < n; i++)
+    {
+        len += _put_svarint(buf + len, exts[i].offset);
+        len += _put_uvarint(buf + len, exts[i].size);
+    }
+    return len;
+}
+
+size_t
+gdpfs_fmeta_decode_extents(const uint8_t *buf, size_t len, gdpfs_extent_t *exts,
+        uint32_t *n)
+{
+    uint64_t u;
+    int64_t i;
+    size_t off = 0;
+    size_t k;
+    uint32_t e;
+
+    if ((k = _get_uvarint(buf, len, &u)) == 0)
+        return 0;
+    if (u == 0 || u > GDPFS_FMETA_MAX_EXTENTS)
+        return 0;
+    *n = u;
+    off += k;
+    for (e = 0; e < *n; e++)
+    {
+        if ((k = _get_svarint(buf + off, len - off, &i)) == 0)
+            return 0;
+        exts[e].offset = i;
+        off += k;
+        if ((k = _get_uvarint(buf + off, len - off, &u)) == 0)
+            return 0;
+        exts[e].size = u;
+        off += k;
+    }
+    return off;
+}
@@ -0,0 +1,94 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#ifndef _GDPFS_FMETA_H_
+#define _GDPFS_FMETA_H_
+
+#include "gdpfs_file.h"
+
+#include <stdint.h>
+
+/*
+ * On-log encoding of the header in front of every record.
+ *
+ * Version 1 is a raw struct ending in GDPFS_FMETA_V1_MAGIC, the layout
+ * gdpfs_fmeta_t had before it grew chkpt_recno. Version 2 starts with a
+ * version byte, then the record type and a flags byte, then file_size,
+ * file_type, file_perm, ent_offset and ent_size as LEB128 varints (the two
+ * signed fields zigzag encoded), then chkpt_recno if GDPFS_FMETA_FLAG_CHKPT is
+ * set. A metadata-only record drops from 48 header bytes to about ten.
+ *
+ * Readers never see either encoding: the log decoder turns every header back
+ * into a plain gdpfs_fmeta_t.
+ *
+ * The payload of a GDPFS_FMETA_FLAG_MULTI_EXTENT record starts with its
+ * extent table: the number of extents, then each extent's offset and size,
+ * all varints like the header. The header's ent_size covers the encoded table
+ * and the data; the decoder swaps the table for a gdpfs_extent_t array.
+ */
+
+#define GDPFS_FMETA_V1_MAGIC        0xb531479b64f64e0d
+#define GDPFS_FMETA_VERSION         2
+#define GDPFS_FMETA_MAX_SIZE        64      // v2 never needs more than this
+
+#define GDPFS_FMETA_FLAG_COMPRESSED     0x01    // payload is zlib compressed
+#define GDPFS_FMETA_FLAG_HOLE           0x02    // extent reads as zeros, no payload
+#define GDPFS_FMETA_FLAG_MULTI_EXTENT   0x04    // payload holds several extents
+#define GDPFS_FMETA_FLAG_CHKPT          0x08    // header ends with chkpt_recno
+
+#define GDPFS_FMETA_MAX_EXTENTS         256
+// most an encoded extent table can take up
+#define GDPFS_FMETA_EXTENTS_MAX_SIZE    (5 + GDPFS_FMETA_MAX_EXTENTS * 20)
+
+// Encodes meta as a v2 header into buf, which must hold GDPFS_FMETA_MAX_SIZE
+// bytes. GDPFS_FMETA_FLAG_CHKPT is added to flags if meta->chkpt_recno is
+// set. Returns the encoded length.
+size_t
+gdpfs_fmeta_encode(const gdpfs_fmeta_t *meta, uint8_t flags, uint8_t *buf);
+
+// Decodes a v1 or v2 header from the first len bytes of a record that is
+// record_len bytes long. Returns the header's encoded length, or 0 if buf
+// doesn't start with a valid header.
+size_t
+gdpfs_fmeta_decode(const uint8_t *buf, size_t len, size_t record_len,
+        gdpfs_fmeta_t *meta, uint8_t *flags);
+
+// Encodes the n extents of a multi-extent record into buf, which must hold
+// GDPFS_FMETA_EXTENTS_MAX_SIZE bytes. Returns the encoded length.
+size_t
+gdpfs_fmeta_encode_extents(const gdpfs_extent_t *exts, uint32_t n, uint8_t *buf);
+
+// Decodes an extent table from the first len bytes of buf into exts, which
+// must hold GDPFS_FMETA_MAX_EXTENTS entries. Returns the table's encoded
+// length, or 0 if buf doesn't start with a valid one.
+size_t
+gdpfs_fmeta_decode_extents(const uint8_t *buf, size_t len, gdpfs_extent_t *exts,
+        uint32_t *n);
+
+#endif // _GDPFS_FMETA_H_
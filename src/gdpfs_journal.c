@@ -0,0 +1,255 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#define _GNU_SOURCE
+
+#include "gdpfs_journal.h"
+#include "gdpfs_stat.h"
+
+#include <ep/ep_app.h>
+#include <ep/ep_assert.h>
+#include <ep/ep_mem.h>
+#include <ep/ep_thr.h>
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#define JOURNAL_MAGIC   0x4c4e524a      // "JRNL"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t crc;               // over everything after it, data included
+    gdpfs_file_gname_t gname;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t file_size;
+    int32_t file_type;
+    uint16_t file_perm;
+    uint16_t pad;
+} journal_hdr_t;
+
+static int journal_fd = -1;
+static off_t journal_end;           // where the next record goes
+static off_t journal_synced;        // everything before this is on disk
+static bool journal_syncing;        // a writer is in fdatasync for everyone
+static int journal_unacked;         // journaled writes not yet acked by the log
+static EP_THR_MUTEX journal_lock;
+static EP_THR_COND journal_cond;
+
+static uint32_t
+_journal_crc(const journal_hdr_t *hdr, const void *buf, size_t size)
+{
+    uLong crc;
+
+    crc = crc32(0L, (const Bytef *) &hdr->gname,
+            sizeof(journal_hdr_t) - offsetof(journal_hdr_t, gname));
+    if (size > 0)
+        crc = crc32(crc, buf, size);
+    return crc;
+}
+
+EP_STAT
+init_gdpfs_journal(const char *path)
+{
+    if (ep_thr_mutex_init(&journal_lock, EP_THR_MUTEX_DEFAULT) != 0 ||
+        ep_thr_cond_init(&journal_cond) != 0)
+        return GDPFS_STAT_SYNCH_FAIL;
+
+    journal_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (journal_fd < 0)
+    {
+        ep_app_error("Cannot open journal %s: %s", path, strerror(errno));
+        return GDPFS_STAT_LOCAL_FS_FAIL;
+    }
+    journal_end = lseek(journal_fd, 0, SEEK_END);
+    journal_synced = journal_end;
+    journal_syncing = false;
+    journal_unacked = 0;
+    return GDPFS_STAT_OK;
+}
+
+void
+stop_gdpfs_journal()
+{
+    if (journal_fd < 0)
+        return;
+    fdatasync(journal_fd);
+    close(journal_fd);
+    journal_fd = -1;
+}
+
+EP_STAT
+gdpfs_journal_write(gdpfs_file_gname_t gname, const gdpfs_file_info_t *info,
+        const void *buf, size_t size, off_t offset)
+{
+    journal_hdr_t hdr;
+    struct iovec iov[2];
+    off_t target;
+    off_t mine;
+    int rc;
+    int err;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = JOURNAL_MAGIC;
+    memcpy(hdr.gname, gname, sizeof(gdpfs_file_gname_t));
+    hdr.offset = offset;
+    hdr.size = size;
+    hdr.file_size = info->file_size;
+    hdr.file_type = info->file_type;
+    hdr.file_perm = info->file_perm;
+    hdr.crc = _journal_crc(&hdr, buf, size);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *) buf;
+    iov[1].iov_len = size;
+
+    // Records go in under the lock so that a sync covers whole records only.
+    ep_thr_mutex_lock(&journal_lock);
+    if (pwritev(journal_fd, iov, size > 0 ? 2 : 1, journal_end) !=
+            sizeof(hdr) + size)
+    {
+        err = errno;
+        ep_thr_mutex_unlock(&journal_lock);
+        ep_app_error("Cannot write to journal: %s", strerror(err));
+        return GDPFS_STAT_LOCAL_FS_FAIL;
+    }
+    journal_end += sizeof(hdr) + size;
+    journal_unacked++;
+    mine = journal_end;
+
+    // Whoever finds no sync under way syncs for everyone written so far.
+    while (journal_synced < mine)
+    {
+        if (journal_syncing)
+        {
+            ep_thr_cond_wait(&journal_cond, &journal_lock, NULL);
+            continue;
+        }
+        journal_syncing = true;
+        target = journal_end;
+        ep_thr_mutex_unlock(&journal_lock);
+        rc = fdatasync(journal_fd);
+        err = errno;
+        ep_thr_mutex_lock(&journal_lock);
+        journal_syncing = false;
+        if (rc == 0 && target > journal_synced)
+            journal_synced = target;
+        ep_thr_cond_broadcast(&journal_cond);
+        if (rc != 0)
+        {
+            journal_unacked--;
+            ep_thr_mutex_unlock(&journal_lock);
+            ep_app_error("Cannot sync journal: %s", strerror(err));
+            return GDPFS_STAT_LOCAL_FS_FAIL;
+        }
+    }
+    ep_thr_mutex_unlock(&journal_lock);
+    return GDPFS_STAT_OK;
+}
+
+void
+gdpfs_journal_release(int n)
+{
+    ep_thr_mutex_lock(&journal_lock);
+    journal_unacked -= n;
+    EP_ASSERT(journal_unacked >= 0);
+    // With nothing unacked nobody is waiting on a sync, so it can all go.
+    if (journal_unacked == 0 && !journal_syncing && journal_end >= JOURNAL_RESET_BYTES)
+    {
+        if (ftruncate(journal_fd, 0) == 0)
+            journal_end = journal_synced = 0;
+        else
+            ep_app_warn("Cannot empty journal: %s", strerror(errno));
+    }
+    ep_thr_mutex_unlock(&journal_lock);
+}
+
+EP_STAT
+gdpfs_journal_replay(gdpfs_journal_cb_t cb, void *udata)
+{
+    journal_hdr_t hdr;
+    gdpfs_file_info_t info;
+    off_t at = 0;
+    char *buf;
+    int n = 0;
+
+    while (pread(journal_fd, &hdr, sizeof(hdr), at) == sizeof(hdr) &&
+           hdr.magic == JOURNAL_MAGIC &&
+           at + (off_t) (sizeof(hdr) + hdr.size) <= journal_end)
+    {
+        buf = ep_mem_malloc(hdr.size > 0 ? hdr.size : 1);
+        if (buf == NULL)
+            return GDPFS_STAT_OOMEM;
+        if (pread(journal_fd, buf, hdr.size, at + sizeof(hdr)) != hdr.size ||
+            _journal_crc(&hdr, buf, hdr.size) != hdr.crc)
+        {
+            ep_mem_free(buf);
+            break;
+        }
+        info.file_size = hdr.file_size;
+        info.file_type = hdr.file_type;
+        info.file_perm = hdr.file_perm;
+        cb(hdr.gname, &info, buf, hdr.size, hdr.offset, udata);
+        ep_mem_free(buf);
+        at += sizeof(hdr) + hdr.size;
+        n++;
+    }
+
+    // Anything past the last good record was torn by the crash.
+    if (at < journal_end)
+    {
+        ep_app_warn("Dropping %ld torn bytes at the end of the journal",
+                journal_end - at);
+        if (ftruncate(journal_fd, at) != 0)
+            return GDPFS_STAT_LOCAL_FS_FAIL;
+        journal_end = journal_synced = at;
+    }
+    if (n > 0)
+        ep_app_info("Replayed %d writes from the journal", n);
+    return GDPFS_STAT_OK;
+}
+
+EP_STAT
+gdpfs_journal_reset()
+{
+    ep_thr_mutex_lock(&journal_lock);
+    if (ftruncate(journal_fd, 0) != 0 || fdatasync(journal_fd) != 0)
+    {
+        ep_thr_mutex_unlock(&journal_lock);
+        return GDPFS_STAT_LOCAL_FS_FAIL;
+    }
+    journal_end = journal_synced = 0;
+    ep_thr_mutex_unlock(&journal_lock);
+    return GDPFS_STAT_OK;
+}
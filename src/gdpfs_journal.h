@@ -0,0 +1,80 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#ifndef _GDPFS_JOURNAL_H_
+#define _GDPFS_JOURNAL_H_
+
+#include "gdpfs_file.h"
+
+#include <ep/ep.h>
+#include <stdbool.h>
+
+/*
+ * Optional local write-ahead journal. Every write is appended to the journal
+ * and made durable before it is acknowledged, so it survives a crash that
+ * catches it still on its way to the log. Concurrent writers share one
+ * fdatasync (group commit). Once everything journaled has been acked by the
+ * log the journal is emptied. On startup, whatever a previous run left
+ * behind is replayed.
+ *
+ * A record is a journal_hdr_t followed by its data; a crc32 over both lets
+ * replay stop at a record torn by the crash.
+ */
+
+#define JOURNAL_RESET_BYTES     (16 * 1024 * 1024)  // empty it once it's this big and idle
+
+EP_STAT
+init_gdpfs_journal(const char *path);
+
+void
+stop_gdpfs_journal();
+
+// Journals a write of size bytes at offset to the file gname, after which the
+// file looks like info. Returns once the record is on disk.
+EP_STAT
+gdpfs_journal_write(gdpfs_file_gname_t gname, const gdpfs_file_info_t *info,
+        const void *buf, size_t size, off_t offset);
+
+// n journaled writes have been acked by the log.
+void
+gdpfs_journal_release(int n);
+
+typedef void (*gdpfs_journal_cb_t)(gdpfs_file_gname_t gname,
+        const gdpfs_file_info_t *info, const void *buf, size_t size,
+        off_t offset, void *udata);
+
+// Calls cb with every intact record left by a previous run, oldest first.
+EP_STAT
+gdpfs_journal_replay(gdpfs_journal_cb_t cb, void *udata);
+
+// Empties the journal. Only for once the replayed records are in the log.
+EP_STAT
+gdpfs_journal_reset();
+
+#endif // _GDPFS_JOURNAL_H_
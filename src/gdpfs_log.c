@@ -29,67 +29,171 @@
 
 #include "gdpfs.h"
 #include "gdpfs_log.h"
+#include "gdpfs_log_backend.h"
+#include "gdpfs_logcache.h"
+#include "gdpfs_reccache.h"
 #include "gdpfs_stat.h"
+#include "list.h"
 #include <ep/ep_app.h>
 #include <ep/ep_assert.h>
+#include <ep/ep_hash.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ep/ep_thr.h>
+#include <event2/buffer.h>
 #include <pthread.h>
-#define GDP_GCLMD_NONCE		0xA0A0A0A0	// CTM (creation time)
-#define PRECREATED_MAX          1024
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdio.h>
+
+#define PRECREATED_MAX          1024
+#define PRECREATE_PRODUCERS     4
+#define PRECREATE_MIN_DEPTH     16
+#define PRECREATE_HORIZON       2.0     // seconds of creates to keep on hand
+#define PRECREATE_EWMA_WEIGHT   0.125
+#define HANDLE_POOL_MAX         4096    // idle handles kept open
 
+/* The Log Daemon new logs are created on. */
 extern char* logd_xname;
-static gdp_iomode_t gcl_mode;
-static EP_THR_MUTEX creation_mutex;
+
+static gdpfs_log_mode_t gcl_mode;
+static gdpfs_log_backend_t *backend;
+static gdpfs_log_decode_t decoder;
+
+/*
+ * Pool of logs created ahead of time so file creation doesn't wait on the
+ * log daemon. Several producers keep it topped up to precreated_target,
+ * which follows the rate at which the pool is being drawn from.
+ */
 static gdp_name_t precreated_logs[PRECREATED_MAX];
 static size_t precreated_front;
-static size_t precreated_back;
+static size_t precreated_count;
+static size_t precreated_inflight;
+static size_t precreated_target;
+static double get_interval;             // EWMA of seconds between gets
+static EP_TIME_SPEC last_get;
+static bool precreated_stopping;
+static int producers_running;
 static EP_THR_MUTEX precreated_mutex;
-static EP_THR_COND precreated_cond;
-static pthread_t producer;
+static EP_THR_COND precreated_cond;     // pool grew or a producer exited
+static EP_THR_COND producer_cond;       // pool dropped below target
+static pthread_t producers[PRECREATE_PRODUCERS];
+
+/*
+ * Handles are pooled by gname so reopening a recently used log doesn't pay
+ * for another open handshake. Idle handles sit on an LRU list until there
+ * are more than HANDLE_POOL_MAX of them.
+ */
+static EP_HASH *handle_pool;
+static struct list handles_idle;        // front is least recently used
+static int handles_idle_count;
+static EP_THR_MUTEX handle_pool_lock;
+
+/*
+ * Reads from the log server in flight, so concurrent opens of one record
+ * wait for a single fetch. The fetcher hands the waiters a copy of the
+ * decoded record.
+ */
+typedef struct
+{
+    gdpfs_log_gname_t gname;
+    gdpfs_recno_t recno;
+} fetch_key_t;
+
+typedef struct
+{
+    fetch_key_t key;
+    int waiters;
+    bool done;
+    EP_STAT estat;
+    char *data;
+    size_t len;
+    EP_THR_COND cond;
+} fetch_t;
+
+#define FETCHES_MAX             256
+
+static EP_HASH *fetches;
+static EP_THR_MUTEX fetches_lock;
 
 static void *_producer_thread(void *arg);
-static EP_STAT _precreate_log(size_t index);
+static void _pool_load();
+static void _pool_save();
+static EP_STAT _handle_destroy(gdpfs_log_t *handle);
 
-EP_STAT init_gdpfs_log(gdpfs_log_mode_t log_mode, char *gdp_router_addr)
+EP_STAT init_gdpfs_log(gdpfs_log_mode_t log_mode, gdpfs_log_backend_type_t backend_type,
+        char *gdp_router_addr)
 {
     EP_STAT estat;
+    int i;
+
+    switch (backend_type)
+    {
+    case GDPFS_LOG_BACKEND_GDP:
+        backend = &gdpfs_log_backend_gdp;
+        break;
+    case GDPFS_LOG_BACKEND_MEM:
+        backend = &gdpfs_log_backend_mem;
+        break;
+    default:
+        ep_app_error("unknown log backend");
+        return GDPFS_STAT_INVLDPARAM;
+    }
 
-    estat = gdp_init(gdp_router_addr);
+    estat = backend->init(gdp_router_addr);
+    if (!EP_STAT_ISOK(estat))
+        return estat;
 
     precreated_front = 0;
-    precreated_back = 0;
+    precreated_count = 0;
+    precreated_inflight = 0;
+    precreated_target = PRECREATE_MIN_DEPTH;
+    get_interval = PRECREATE_HORIZON / PRECREATE_MIN_DEPTH;
+    precreated_stopping = false;
     if (ep_thr_mutex_init(&precreated_mutex, EP_THR_MUTEX_DEFAULT) != 0)
         ep_app_error("Could not instantiate mutex for precreated\n");
     if (ep_thr_cond_init(&precreated_cond) != 0)
         ep_app_error("Could not instantiate cond for precreated\n");
+    if (ep_thr_cond_init(&producer_cond) != 0)
+        ep_app_error("Could not instantiate cond for precreate producers\n");
 
-    // Create thread to do precreate threads. Currently our synchronization by design
-    // can only work for one of these producers.
-    pthread_create(&producer, NULL, _producer_thread, NULL);
+    list_init(&handles_idle);
+    handles_idle_count = 0;
+    handle_pool = ep_hash_new("handle_pool", NULL, HANDLE_POOL_MAX);
+    if (handle_pool == NULL)
+        return GDPFS_STAT_OOMEM;
+    if (ep_thr_mutex_init(&handle_pool_lock, EP_THR_MUTEX_DEFAULT) != 0)
+        return GDPFS_STAT_SYNCH_FAIL;
+    fetches = ep_hash_new("fetches", NULL, FETCHES_MAX);
+    if (fetches == NULL)
+        return GDPFS_STAT_OOMEM;
+    if (ep_thr_mutex_init(&fetches_lock, EP_THR_MUTEX_DEFAULT) != 0)
+        return GDPFS_STAT_SYNCH_FAIL;
 
-    ep_thr_mutex_init(&creation_mutex, EP_THR_MUTEX_DEFAULT);
-    if (!EP_STAT_ISOK(estat))
+    // Start from whatever the last clean shutdown left unused.
+    _pool_load();
+
+    producers_running = 0;
+    for (i = 0; i < PRECREATE_PRODUCERS; i++)
     {
-        ep_app_error("GDP initialization failed");
-        return estat;
+        if (pthread_create(&producers[i], NULL, _producer_thread, NULL) == 0)
+            producers_running++;
+    }
+    if (producers_running == 0)
+    {
+        ep_app_error("Could not start any precreate producers");
+        return GDPFS_STAT_SYNCH_FAIL;
     }
+
     switch (log_mode)
     {
     case GDPFS_LOG_MODE_RO:
-        gcl_mode = GDP_MODE_RO;
-        break;
     case GDPFS_LOG_MODE_RA:
-        gcl_mode = GDP_MODE_RA;
-        break;
     case GDPFS_LOG_MODE_AO:
-        gcl_mode = GDP_MODE_AO;
+        gcl_mode = log_mode;
         break;
     default:
         ep_app_error("unknown log mode");
@@ -98,90 +202,271 @@ EP_STAT init_gdpfs_log(gdpfs_log_mode_t log_mode, char *gdp_router_addr)
     return GDPFS_STAT_OK;
 }
 
+void stop_gdpfs_log()
+{
+    gdpfs_log_t *handle;
+
+    ep_thr_mutex_lock(&precreated_mutex);
+    precreated_stopping = true;
+    ep_thr_cond_broadcast(&producer_cond);
+    // Let creates already in flight land in the pool so they get saved too.
+    while (producers_running > 0)
+    {
+        ep_thr_cond_wait(&precreated_cond, &precreated_mutex, NULL);
+    }
+    _pool_save();
+    ep_thr_mutex_unlock(&precreated_mutex);
+
+    // Anything still open at this point belongs to the pool.
+    ep_thr_mutex_lock(&handle_pool_lock);
+    while (!list_empty(&handles_idle))
+    {
+        handle = list_entry(list_pop_front(&handles_idle), gdpfs_log_t, idle_elem);
+        ep_hash_delete(handle_pool, sizeof(gdpfs_log_gname_t), handle->gname);
+        handles_idle_count--;
+        ep_thr_mutex_unlock(&handle_pool_lock);
+        _handle_destroy(handle);
+        ep_thr_mutex_lock(&handle_pool_lock);
+    }
+    ep_thr_mutex_unlock(&handle_pool_lock);
+}
+
+/* precreated_mutex must be held. */
+static void _pool_push(gdp_name_t name)
+{
+    EP_ASSERT(precreated_count < PRECREATED_MAX);
+    memcpy(precreated_logs[(precreated_front + precreated_count) % PRECREATED_MAX],
+            name, sizeof(gdp_name_t));
+    precreated_count++;
+}
+
 static void * _producer_thread(void *arg)
 {
-    while (1)
+    gdp_name_t name;
+    EP_STAT estat;
+
+    ep_thr_mutex_lock(&precreated_mutex);
+    while (!precreated_stopping)
     {
-        ep_thr_mutex_lock(&precreated_mutex);
-        while (precreated_front == (precreated_back + 1) % PRECREATED_MAX)
+        if (precreated_count + precreated_inflight >= precreated_target)
         {
-            ep_thr_cond_wait(&precreated_cond, &precreated_mutex, NULL);
+            ep_thr_cond_wait(&producer_cond, &precreated_mutex, NULL);
+            continue;
         }
+        precreated_inflight++;
         ep_thr_mutex_unlock(&precreated_mutex);
 
-        _precreate_log(precreated_back);
+        estat = backend->create(name);
+        if (!EP_STAT_ISOK(estat))
+            sleep(1);   // don't hammer a log daemon that is refusing us
 
         ep_thr_mutex_lock(&precreated_mutex);
-        precreated_back = (precreated_back + 1) % PRECREATED_MAX;
-        if (precreated_back == (precreated_front + 1) % PRECREATED_MAX)
+        precreated_inflight--;
+        if (EP_STAT_ISOK(estat))
+        {
+            _pool_push(name);
             ep_thr_cond_broadcast(&precreated_cond);
-        ep_thr_mutex_unlock(&precreated_mutex);
+        }
     }
-    // NOT REACHED
+    producers_running--;
+    ep_thr_cond_broadcast(&precreated_cond);
+    ep_thr_mutex_unlock(&precreated_mutex);
     return NULL;
 }
 
+/*
+ * Move the target depth toward PRECREATE_HORIZON seconds' worth of gets at
+ * the current rate. It grows right away but only shrinks by one per get so a
+ * burst that just ended doesn't drain the pool. precreated_mutex must be held.
+ */
+static void _pool_retarget()
+{
+    EP_TIME_SPEC now;
+    double interval;
+    double want;
+
+    ep_time_now(&now);
+    if (last_get.tv_sec != 0)
+    {
+        interval = (now.tv_sec - last_get.tv_sec) +
+                (now.tv_nsec - last_get.tv_nsec) / 1e9;
+        get_interval += PRECREATE_EWMA_WEIGHT * (interval - get_interval);
+    }
+    last_get = now;
+
+    want = get_interval > 0 ? PRECREATE_HORIZON / get_interval : PRECREATED_MAX;
+    if (want < PRECREATE_MIN_DEPTH)
+        want = PRECREATE_MIN_DEPTH;
+    if (want > PRECREATED_MAX)
+        want = PRECREATED_MAX;
+
+    if ((size_t) want > precreated_target)
+        precreated_target = (size_t) want;
+    else if ((size_t) want < precreated_target)
+        precreated_target--;
+}
+
 /**
  * Will retrieve a log from the precreated queue.
  */
 EP_STAT gdpfs_log_get_precreated(gdp_name_t log_iname)
 {
     ep_thr_mutex_lock(&precreated_mutex);
-    while (precreated_front == precreated_back)
+    _pool_retarget();
+    if (precreated_count == 0)
+    {
+        // We ran dry, so the rate estimate is behind. Grow faster.
+        precreated_target *= 2;
+        if (precreated_target > PRECREATED_MAX)
+            precreated_target = PRECREATED_MAX;
+    }
+    ep_thr_cond_broadcast(&producer_cond);
+    while (precreated_count == 0)
     {
         ep_thr_cond_wait(&precreated_cond, &precreated_mutex, NULL);
     }
     memcpy(log_iname, precreated_logs[precreated_front], sizeof(gdp_name_t));
     precreated_front = (precreated_front + 1) % PRECREATED_MAX;
-    ep_thr_cond_signal(&precreated_cond);
+    precreated_count--;
     ep_thr_mutex_unlock(&precreated_mutex);
     return GDPFS_STAT_OK;
 }
 
 /*
- * Adds new gdpfs log to this index.
+ * The pool only survives a remount for real GDP logs on the same log daemon.
+ * The first line of PRECREATED_FILE records which one.
  */
-static EP_STAT _precreate_log(size_t index)
+static bool _pool_persistent(char *header, size_t len)
 {
-    EP_STAT estat;
-    // The internal name of the log server we're going to use
-    gdp_name_t logd_iname;
+    if (backend != &gdpfs_log_backend_gdp || logd_xname == NULL)
+        return false;
+    snprintf(header, len, "%s %s\n", backend->name, logd_xname);
+    return true;
+}
 
-    // The log that we're going to create, and its internal name
-    gdp_gcl_t* gcl;
-    const gdp_name_t* gcl_iname;
+static void _pool_load()
+{
+    char header[256];
+    char line[256];
+    gdp_name_t name;
+    FILE *fp;
 
-    gdp_parse_name(logd_xname, logd_iname);
+    if (!_pool_persistent(header, sizeof header))
+        return;
+    fp = fopen(PRECREATED_FILE, "r");
+    if (fp == NULL)
+        return;
+    if (fgets(line, sizeof line, fp) != NULL && strcmp(line, header) == 0)
+    {
+        while (precreated_count < PRECREATED_MAX && fgets(line, sizeof line, fp) != NULL)
+        {
+            line[strcspn(line, "\n")] = '\0';
+            if (EP_STAT_ISOK(gdp_parse_name(line, name)))
+                _pool_push(name);
+        }
+    }
+    fclose(fp);
 
-    // Metadata for the log (this allocation will succeed; the program exits otherwise)
-    gdp_gclmd_t* gmd = gdp_gclmd_new(0);
+    // A name must never be handed out twice, so the file goes away until the
+    // next clean stop writes out whatever is left.
+    unlink(PRECREATED_FILE);
+}
 
-    // Save creation time as metadata (to generate the log name)
-    EP_TIME_SPEC tv;
-    char timestring[40];
+/* precreated_mutex must be held. */
+static void _pool_save()
+{
+    char header[256];
+    gdp_pname_t pname;
+    FILE *fp;
+    size_t i;
 
-    ep_time_now(&tv);
-    ep_time_format(&tv, timestring, sizeof timestring, EP_TIME_FMT_DEFAULT);
-    gdp_gclmd_add(gmd, GDP_GCLMD_CTIME, strlen(timestring), timestring);
+    if (!_pool_persistent(header, sizeof header) || precreated_count == 0)
+        return;
+    fp = fopen(PRECREATED_FILE ".tmp", "w");
+    if (fp == NULL)
+    {
+        ep_app_error("Could not save precreated logs");
+        return;
+    }
+    fputs(header, fp);
+    for (i = 0; i < precreated_count; i++)
+    {
+        gdp_printable_name(precreated_logs[(precreated_front + i) % PRECREATED_MAX], pname);
+        fprintf(fp, "%s\n", pname);
+    }
+    if (fclose(fp) != 0 || rename(PRECREATED_FILE ".tmp", PRECREATED_FILE) != 0)
+    {
+        ep_app_error("Could not save precreated logs");
+        unlink(PRECREATED_FILE ".tmp");
+        return;
+    }
+    precreated_count = 0;
+}
 
+/*
+ * Subscription state. A subscription can outlive its subscriber while others
+ * still have the handle open, so events are gated here: with no subscriber
+ * they only warm the caches. Once the handle goes idle the backend
+ * subscription is cancelled, and the next subscriber starts a new one.
+ * deliver_lock keeps deliveries in recno order, including the catch-up a
+ * new subscriber on an old subscription gets. backend_lock serializes
+ * starting and cancelling the backend subscription.
+ */
+struct gdpfs_log_sub
+{
+    gdpfs_log_t *handle;
+    gdpfs_callback_t cb;
+    void *udata;
+    bool active;
+    bool cancelled;             // backend subscription is (being) cancelled
+    int delivering;
+    gdpfs_recno_t next;         // first recno the backend hasn't given us
+    gdpfs_recno_t delivered;    // last recno given to cb
+    EP_THR_MUTEX lock;
+    EP_THR_COND cond;
+    EP_THR_MUTEX deliver_lock;
+    EP_THR_MUTEX backend_lock;
+};
 
-    // TODO create a keypair and use it for this log
+static void _handle_free_sub(struct gdpfs_log_sub *sub)
+{
+    ep_thr_mutex_destroy(&sub->lock);
+    ep_thr_cond_destroy(&sub->cond);
+    ep_thr_mutex_destroy(&sub->deliver_lock);
+    ep_thr_mutex_destroy(&sub->backend_lock);
+    ep_mem_free(sub);
+}
 
-    ep_thr_mutex_lock(&creation_mutex);
-    estat = gdp_gcl_create(NULL, logd_iname, gmd, &gcl);
-    ep_thr_mutex_unlock(&creation_mutex);
-    if (!EP_STAT_ISOK(estat))
-    {
-        ep_app_error("Failed to create log.");
-        goto fail0;
-    }
+/*
+ * Cancels handle's backend subscription unless someone is subscribed. Events
+ * that still come in before the backend stops are dropped.
+ */
+static void _handle_cancel_sub(gdpfs_log_t *handle)
+{
+    struct gdpfs_log_sub *sub = handle->sub;
+    bool cancel;
+
+    if (sub == NULL)
+        return;
+    ep_thr_mutex_lock(&sub->backend_lock);
+    ep_thr_mutex_lock(&sub->lock);
+    cancel = !sub->active && !sub->cancelled;
+    if (cancel)
+        sub->cancelled = true;
+    ep_thr_mutex_unlock(&sub->lock);
+    if (cancel)
+        backend->unsubscribe(handle->backend_handle);
+    ep_thr_mutex_unlock(&sub->backend_lock);
+}
 
-    // TODO:Error checking here?
-    gdp_gclmd_free(gmd);
-    gcl_iname = gdp_gcl_getname(gcl);
-    memcpy(precreated_logs[index], *gcl_iname, sizeof(gdp_name_t));
+/* Really closes handle. It must not be in the pool. */
+static EP_STAT _handle_destroy(gdpfs_log_t *handle)
+{
+    EP_STAT estat;
 
-    estat = gdp_gcl_close(gcl);
+    gdpfs_log_unsubscribe(handle);
+    _handle_cancel_sub(handle);
+    estat = backend->close(handle->backend_handle);
     if (!EP_STAT_ISOK(estat))
     {
         char sbuf[100];
@@ -189,27 +474,41 @@ static EP_STAT _precreate_log(size_t index)
         ep_app_error("Cannot close GCL:\n    %s",
             ep_stat_tostr(estat, sbuf, sizeof sbuf));
     }
-
-
-    return GDPFS_STAT_OK;
-
-fail0:
-    gdp_gclmd_free(gmd);
-    ep_thr_mutex_unlock(&creation_mutex);
-    return GDPFS_STAT_CREATE_FAILED;
+    // The backend can't call us back any more.
+    if (handle->sub != NULL)
+        _handle_free_sub(handle->sub);
+    ep_mem_free(handle);
+    return estat;
 }
 
 EP_STAT gdpfs_log_open(gdpfs_log_t **handle, gdp_name_t gcl_name)
 {
     EP_STAT estat;
+    gdpfs_log_t *h;
+    gdpfs_log_t *raced;
+
+    ep_thr_mutex_lock(&handle_pool_lock);
+    h = ep_hash_search(handle_pool, sizeof(gdpfs_log_gname_t), gcl_name);
+    if (h != NULL)
+    {
+        if (h->refs++ == 0)
+        {
+            list_remove(&h->idle_elem);
+            handles_idle_count--;
+        }
+        ep_thr_mutex_unlock(&handle_pool_lock);
+        *handle = h;
+        return GDPFS_STAT_OK;
+    }
+    ep_thr_mutex_unlock(&handle_pool_lock);
 
     // open the GCL
-    *handle = ep_mem_zalloc(sizeof(gdpfs_log_t));
-    if (*handle == NULL)
+    h = ep_mem_zalloc(sizeof(gdpfs_log_t));
+    if (h == NULL)
     {
         return GDPFS_STAT_OOMEM;
     }
-    estat = gdp_gcl_open(gcl_name, gcl_mode, NULL, &(*handle)->gcl_handle);
+    estat = backend->open(&h->backend_handle, gcl_name, gcl_mode);
     if (!EP_STAT_ISOK(estat))
     {
         char sbuf[100];
@@ -220,46 +519,85 @@ EP_STAT gdpfs_log_open(gdpfs_log_t **handle, gdp_name_t gcl_name)
     }
 
     // TODO: better size protection?
-    memcpy((*handle)->gname, gcl_name, sizeof((*handle)->gname) * sizeof(*(*handle)->gname));
+    memcpy(h->gname, gcl_name, sizeof(h->gname) * sizeof(*h->gname));
+    h->refs = 1;
+
+    // Someone may have opened the same log while we weren't holding the lock.
+    ep_thr_mutex_lock(&handle_pool_lock);
+    raced = ep_hash_search(handle_pool, sizeof(gdpfs_log_gname_t), gcl_name);
+    if (raced != NULL)
+    {
+        if (raced->refs++ == 0)
+        {
+            list_remove(&raced->idle_elem);
+            handles_idle_count--;
+        }
+        ep_thr_mutex_unlock(&handle_pool_lock);
+        _handle_destroy(h);
+        *handle = raced;
+        return GDPFS_STAT_OK;
+    }
+    ep_hash_insert(handle_pool, sizeof(gdpfs_log_gname_t), h->gname, h);
+    ep_thr_mutex_unlock(&handle_pool_lock);
 
+    *handle = h;
     return estat;
 
 fail0:
-    ep_mem_free(*handle);
+    ep_mem_free(h);
     *handle = NULL;
     return estat;
 }
 
+/*
+ * Gives handle back to the pool, which closes the least recently used idle
+ * handle if it has grown too big. Unsubscribe first.
+ */
 EP_STAT gdpfs_log_close(gdpfs_log_t *handle)
 {
-    EP_STAT estat;
+    gdpfs_log_t *victim = NULL;
+    bool last;
 
-    estat = gdp_gcl_close(handle->gcl_handle);
-    if (!EP_STAT_ISOK(estat))
-    {
-        char sbuf[100];
+    // An idle handle's subscription would only fill the caches with records
+    // nobody has asked for. Cancel it while we still hold a reference; if
+    // someone opens the handle meanwhile, their subscribe starts a new one.
+    ep_thr_mutex_lock(&handle_pool_lock);
+    last = handle->refs == 1;
+    ep_thr_mutex_unlock(&handle_pool_lock);
+    if (last)
+        _handle_cancel_sub(handle);
 
-        ep_app_error("Cannot close GCL:\n    %s",
-            ep_stat_tostr(estat, sbuf, sizeof sbuf));
+    ep_thr_mutex_lock(&handle_pool_lock);
+    EP_ASSERT_REQUIRE(handle->refs > 0);
+    if (--handle->refs > 0)
+    {
+        ep_thr_mutex_unlock(&handle_pool_lock);
+        return GDPFS_STAT_OK;
     }
-    ep_mem_free(handle);
-    return estat;
+    list_push_back(&handles_idle, &handle->idle_elem);
+    if (++handles_idle_count > HANDLE_POOL_MAX)
+    {
+        victim = list_entry(list_pop_front(&handles_idle), gdpfs_log_t, idle_elem);
+        handles_idle_count--;
+        ep_hash_delete(handle_pool, sizeof(gdpfs_log_gname_t), victim->gname);
+    }
+    ep_thr_mutex_unlock(&handle_pool_lock);
+
+    if (victim != NULL)
+        return _handle_destroy(victim);
+    return GDPFS_STAT_OK;
 }
 
 EP_STAT gdpfs_log_append(gdpfs_log_t *handle, gdpfs_log_ent_t *ent, gdpfs_callback_t cb, void *udata)
 {
     EP_STAT estat;
 
-    if (gcl_mode == GDP_MODE_RO)
+    if (gcl_mode == GDPFS_LOG_MODE_RO)
     {
         ep_app_error("Cannot append to log in RO mode");
         return GDPFS_STAT_BADLOGMODE;
     }
-    if (cb != NULL) {
-        estat = gdp_gcl_append_async(handle->gcl_handle, ent->datum, cb, udata);
-    } else {
-        estat = gdp_gcl_append(handle->gcl_handle, ent->datum);
-    }
+    estat = backend->append(handle->backend_handle, ent->datum, cb, udata);
     if (!EP_STAT_ISOK(estat))
     {
         char sbuf[100];
@@ -269,180 +607,1204 @@ EP_STAT gdpfs_log_append(gdpfs_log_t *handle, gdpfs_log_ent_t *ent, gdpfs_callba
     return estat;
 }
 
-void gdpfs_log_gname(gdpfs_log_t *handle, gdpfs_log_gname_t gname)
+void gdpfs_log_note_append(gdpfs_log_t *handle, gdpfs_recno_t recno)
 {
-     memcpy(gname, handle->gname, sizeof(gdpfs_log_gname_t) * sizeof(gname[0]));
+    gdpfs_recno_t seen = __atomic_load_n(&handle->appended, __ATOMIC_RELAXED);
+
+    while (seen < recno && !__atomic_compare_exchange_n(&handle->appended,
+            &seen, recno, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
 }
 
-/* Initializes an UNCACHED log entry. */
-EP_STAT
-gdpfs_log_ent_init(gdpfs_log_ent_t *log_ent)
-{
-    log_ent->datum = gdp_datum_new();
-    log_ent->is_cached = false;
-    log_ent->cached_fd = -1;
-    log_ent->cached_recno = 0;
+static EP_STAT _ent_decode(gdpfs_log_ent_t *ent);
 
-    if (log_ent->datum == NULL)
-        return GDPFS_STAT_OOMEM;
-    else
-        return GDPFS_STAT_OK;
-}
+/* Carries the caller's callback through a multiread that decodes records. */
+typedef struct
+{
+    gdpfs_callback_t cb;
+    void *udata;
+} decode_cbstate_t;
 
-/*
- * Attempt to open the ent for reco. If it fails, free resources and set ent to
- * NULL.
- */
-EP_STAT
-gdpfs_log_ent_open(gdpfs_log_t *handle, gdpfs_log_ent_t *ent, gdpfs_recno_t recno, bool bypass_cache)
+static void _multiread_decode_cb(gdpfs_log_event_t *ev)
 {
+    decode_cbstate_t *cbs = ev->udata;
+    gdpfs_log_event_type_t type = ev->type;
     EP_STAT estat;
-    gdp_pname_t printable_name;
-    char cachename[GDP_GCL_PNAME_LEN + 100];
-    int fd;
-
-    if (gcl_mode == GDP_MODE_AO)
-    {
-        ep_app_error("Cannot read log ent in AO mode");
-        return GDPFS_STAT_BADLOGMODE;
-    }
 
-    /* only cache if recno is not negative */
-    if (recno >= 0 && !bypass_cache)
+    ev->udata = cbs->udata;
+    if (type == GDPFS_LOG_EVENT_DATA)
     {
-        gdp_printable_name(handle->gname, printable_name);
-        snprintf(cachename, GDP_GCL_PNAME_LEN + 100, "%s/LOGCACHE%s-%lu", CACHE_DIR, printable_name, recno);
-        fd = open(cachename, O_RDWR, 00744);
-        if (fd == -1 && errno == ENOENT)
+        estat = _ent_decode(ev->ent);
+        if (!EP_STAT_ISOK(estat))
         {
-            estat = gdpfs_log_ent_init(ent);
-            if (!EP_STAT_ISOK(estat))
-                return estat;
-            fd = open(cachename, O_RDWR | O_TRUNC | O_CREAT, 00744);
-            EP_ASSERT(fd >= 0);
-            /* fill in cache */
-            estat = gdp_gcl_read(handle->gcl_handle, recno, ent->datum);
-            if (!EP_STAT_ISOK(estat))
-                goto fail0;
-            gdp_buf_t *buf = gdp_datum_getbuf(ent->datum);
-            size_t length = gdp_buf_getlength(buf);
-            void *bounce = ep_mem_zalloc(length);
-            EP_ASSERT(length == gdp_buf_read(buf, bounce, length));
-            EP_ASSERT(length == write(fd, bounce, length));
-            ep_mem_free(bounce);
-            lseek(fd, 0, SEEK_SET);
-            gdp_datum_free(ent->datum);
+            ev->type = GDPFS_LOG_EVENT_FAILURE;
+            ev->stat = estat;
         }
-        ent->cached_fd = fd;
-        ent->cached_recno = recno;
-        ent->is_cached = true;
-        ent->datum = NULL;
-        estat = GDPFS_STAT_OK;
-    }
-    else
-    {
-        estat = gdpfs_log_ent_init(ent);
-        if (!EP_STAT_ISOK(estat))
-            return estat;
-        estat = gdp_gcl_read(handle->gcl_handle, recno, ent->datum);
-        if (!EP_STAT_ISOK(estat))
-            goto fail0;
     }
+    cbs->cb(ev);
+    if (type == GDPFS_LOG_EVENT_EOS)
+        ep_mem_free(cbs);
+}
 
-    return estat;
+static EP_STAT _multiread(gdpfs_log_t *handle, gdpfs_recno_t recno, int32_t nrecs,
+        gdpfs_callback_t cb, void *udata)
+{
+    EP_STAT estat;
 
-fail0:
-    if (EP_STAT_DETAIL(estat) == _GDP_CCODE_NOTFOUND)
+    if (gcl_mode == GDPFS_LOG_MODE_AO)
     {
-        estat = GDPFS_STAT_NOTFOUND;
+        ep_app_error("Cannot read log ent in AO mode");
+        return GDPFS_STAT_BADLOGMODE;
     }
-    else
+    EP_ASSERT_REQUIRE(cb != NULL);
+    estat = backend->multiread(handle->backend_handle, recno, nrecs, cb, udata);
+    if (!EP_STAT_ISOK(estat))
     {
         char sbuf[100];
-        ep_app_error("Cannot read GCL:\n    %s",
+        ep_app_error("Cannot multiread GCL:\n    %s",
             ep_stat_tostr(estat, sbuf, sizeof sbuf));
     }
-    gdp_datum_free(ent->datum);
     return estat;
 }
 
-/*
- * Attempt to close the ent. If it's NULL, do nothing.
- */
-void gdpfs_log_ent_close(gdpfs_log_ent_t *ent)
+EP_STAT gdpfs_log_multiread(gdpfs_log_t *handle, gdpfs_recno_t recno, int32_t nrecs,
+        gdpfs_callback_t cb, void *udata)
 {
-    if (ent->is_cached)
-        close(ent->cached_fd);
-    else
-        gdp_datum_free(ent->datum);
+    EP_STAT estat;
+    decode_cbstate_t *cbs;
+
+    if (decoder == NULL)
+        return _multiread(handle, recno, nrecs, cb, udata);
+
+    cbs = ep_mem_zalloc(sizeof(decode_cbstate_t));
+    if (cbs == NULL)
+        return GDPFS_STAT_OOMEM;
+    cbs->cb = cb;
+    cbs->udata = udata;
+    estat = _multiread(handle, recno, nrecs, _multiread_decode_cb, cbs);
+    if (!EP_STAT_ISOK(estat))
+        ep_mem_free(cbs);
+    return estat;
 }
 
-size_t gdpfs_log_ent_length(gdpfs_log_ent_t *ent)
+static EP_STAT _ent_fetched(gdpfs_log_t *handle, gdpfs_log_ent_t *ent,
+        bool bypass_cache);
+
+static void _subscribe_cb(gdpfs_log_event_t *ev)
 {
-    if (ent->is_cached)
+    struct gdpfs_log_sub *sub = ev->udata;
+    gdpfs_recno_t recno = 0;
+    bool deliver;
+    bool cancelled;
+    bool own;
+    EP_STAT estat;
+
+    ep_thr_mutex_lock(&sub->deliver_lock);
+    ep_thr_mutex_lock(&sub->lock);
+    cancelled = sub->cancelled;
+    ep_thr_mutex_unlock(&sub->lock);
+    if (cancelled)
     {
-        struct stat st;
-        fstat(ent->cached_fd, &st);
-        return st.st_size;
+        ep_thr_mutex_unlock(&sub->deliver_lock);
+        return;
     }
-    return gdp_buf_getlength(gdp_datum_getbuf(ent->datum));
+    if (ev->type == GDPFS_LOG_EVENT_DATA)
+    {
+        // Someone else's append is as good as a read for the caches. Our
+        // own are already in the writer's cache, so keep them out.
+        recno = ev->ent->recno;
+        own = recno <= __atomic_load_n(&sub->handle->appended, __ATOMIC_ACQUIRE);
+        estat = _ent_fetched(sub->handle, ev->ent, own);
+        if (!EP_STAT_ISOK(estat))
+        {
+            ev->type = GDPFS_LOG_EVENT_FAILURE;
+            ev->stat = estat;
+        }
+    }
+
+    ep_thr_mutex_lock(&sub->lock);
+    if (recno >= sub->next)
+        sub->next = recno + 1;
+    // Catch-up may have handed this one over already.
+    deliver = sub->active && (recno == 0 || recno > sub->delivered);
+    if (deliver)
+        sub->delivering++;
+    ep_thr_mutex_unlock(&sub->lock);
+
+    if (deliver)
+    {
+        ev->udata = sub->udata;
+        sub->cb(ev);
+        ep_thr_mutex_lock(&sub->lock);
+        if (recno > 0)
+            sub->delivered = recno;
+        if (--sub->delivering == 0)
+            ep_thr_cond_broadcast(&sub->cond);
+        ep_thr_mutex_unlock(&sub->lock);
+    }
+    ep_thr_mutex_unlock(&sub->deliver_lock);
 }
 
 /*
- *  Read size bytes from ent into buf. If buf is NULL, skips over data. Returns
- *  number of bytes actually read.
+ * A shared handle may already be subscribed from an earlier subscriber.
+ * Records from recno up to where that subscription has got are handed over
+ * from the caches or the log, here on the calling thread, before any live
+ * event is. If the handle has been idle, the backend subscription was
+ * cancelled and is simply started again from recno.
  */
-size_t gdpfs_log_ent_read(gdpfs_log_ent_t *ent, void *buf, size_t size)
+static EP_STAT _subscribe_again(gdpfs_log_t *handle, gdpfs_recno_t recno,
+        gdpfs_callback_t cb, void *udata)
 {
-    if (ent->is_cached)
+    struct gdpfs_log_sub *sub = handle->sub;
+    EP_STAT estat = GDPFS_STAT_OK;
+    gdpfs_log_event_t ev;
+    gdpfs_log_ent_t ent;
+    gdpfs_recno_t end;
+
+    ep_thr_mutex_lock(&sub->backend_lock);
+    ep_thr_mutex_lock(&sub->lock);
+    if (sub->cancelled && !sub->active)
     {
-        EP_ASSERT(ent->cached_fd >= 0);
-        return read(ent->cached_fd, buf, size);
+        sub->cb = cb;
+        sub->udata = udata;
+        sub->next = recno;
+        sub->delivered = recno - 1;
+        sub->active = true;
+        sub->cancelled = false;
+        ep_thr_mutex_unlock(&sub->lock);
+        estat = backend->subscribe(handle->backend_handle, recno,
+                _subscribe_cb, sub);
+        if (!EP_STAT_ISOK(estat))
+        {
+            char sbuf[100];
+
+            ep_app_error("Cannot subscribe to GCL:\n    %s",
+                ep_stat_tostr(estat, sbuf, sizeof sbuf));
+            ep_thr_mutex_lock(&sub->lock);
+            sub->active = false;
+            sub->cancelled = true;
+            ep_thr_mutex_unlock(&sub->lock);
+        }
+        ep_thr_mutex_unlock(&sub->backend_lock);
+        return estat;
     }
-    else
+    ep_thr_mutex_unlock(&sub->lock);
+    ep_thr_mutex_unlock(&sub->backend_lock);
+
+    ep_thr_mutex_lock(&sub->deliver_lock);
+    ep_thr_mutex_lock(&sub->lock);
+    if (sub->active)
     {
-        gdp_buf_t *datum_buf = gdp_datum_getbuf(ent->datum);
+        ep_thr_mutex_unlock(&sub->lock);
+        ep_thr_mutex_unlock(&sub->deliver_lock);
+        return GDPFS_STAT_INVLDPARAM;
+    }
+    sub->cb = cb;
+    sub->udata = udata;
+    sub->delivered = recno - 1;
+    sub->active = true;
+    end = sub->next;
+    sub->delivering++;
+    ep_thr_mutex_unlock(&sub->lock);
 
-        if (buf == NULL)
-        {
-            if (gdp_buf_drain(datum_buf, size) != 0)
-            {
-                ep_app_error("Error draining buf");
-                return 0;
-            }
-            return size;
-        }
-        else
+    for (; recno < end; recno++)
+    {
+        memset(&ev, 0, sizeof(ev));
+        ev.udata = sub->udata;
+        estat = gdpfs_log_ent_open(handle, &ent, recno, false);
+        if (!EP_STAT_ISOK(estat))
         {
-            return gdp_buf_read(datum_buf, buf, size);
+            ev.type = GDPFS_LOG_EVENT_FAILURE;
+            ev.stat = estat;
+            sub->cb(&ev);
+            break;
         }
+        ev.type = GDPFS_LOG_EVENT_DATA;
+        ev.stat = GDPFS_STAT_OK;
+        ev.ent = &ent;
+        sub->cb(&ev);
+        gdpfs_log_ent_close(&ent);
+        ep_thr_mutex_lock(&sub->lock);
+        sub->delivered = recno;
+        ep_thr_mutex_unlock(&sub->lock);
     }
+
+    ep_thr_mutex_lock(&sub->lock);
+    if (--sub->delivering == 0)
+        ep_thr_cond_broadcast(&sub->cond);
+    ep_thr_mutex_unlock(&sub->lock);
+    ep_thr_mutex_unlock(&sub->deliver_lock);
+    return estat;
 }
-/*
- *  Read size bytes from ent into buf. Difference between read is that peek does
- *  not advance pointer in buffer
- */
-size_t gdpfs_log_ent_peek(gdpfs_log_ent_t *ent, void *buf, size_t size)
+
+EP_STAT gdpfs_log_subscribe(gdpfs_log_t *handle, gdpfs_recno_t recno,
+        gdpfs_callback_t cb, void *udata)
 {
-    if (ent->is_cached)
+    EP_STAT estat;
+    struct gdpfs_log_sub *sub = handle->sub;
+
+    if (gcl_mode == GDPFS_LOG_MODE_AO)
     {
-        off_t current = lseek(ent->cached_fd, 0, SEEK_CUR);
-        size_t length =read(ent->cached_fd, buf, size);
-        lseek(ent->cached_fd, current, SEEK_SET);
-        return length;
+        ep_app_error("Cannot subscribe to log in AO mode");
+        return GDPFS_STAT_BADLOGMODE;
     }
-    else
-    {
-        gdp_buf_t *datum_buf = gdp_datum_getbuf(ent->datum);
+    EP_ASSERT_REQUIRE(cb != NULL);
+
+    if (sub != NULL)
+        return _subscribe_again(handle, recno, cb, udata);
+
+    sub = ep_mem_zalloc(sizeof(struct gdpfs_log_sub));
+    if (sub == NULL)
+        return GDPFS_STAT_OOMEM;
+    if (ep_thr_mutex_init(&sub->lock, EP_THR_MUTEX_DEFAULT) != 0 ||
+        ep_thr_mutex_init(&sub->deliver_lock, EP_THR_MUTEX_DEFAULT) != 0 ||
+        ep_thr_mutex_init(&sub->backend_lock, EP_THR_MUTEX_DEFAULT) != 0 ||
+        ep_thr_cond_init(&sub->cond) != 0)
+    {
+        ep_mem_free(sub);
+        return GDPFS_STAT_SYNCH_FAIL;
+    }
+    sub->handle = handle;
+    sub->cb = cb;
+    sub->udata = udata;
+    sub->next = recno;
+    sub->delivered = recno - 1;
+    sub->active = true;
+
+    estat = backend->subscribe(handle->backend_handle, recno, _subscribe_cb, sub);
+    if (!EP_STAT_ISOK(estat))
+    {
+        char sbuf[100];
+
+        ep_app_error("Cannot subscribe to GCL:\n    %s",
+            ep_stat_tostr(estat, sbuf, sizeof sbuf));
+        _handle_free_sub(sub);
+        return estat;
+    }
+    handle->sub = sub;
+    return estat;
+}
+
+void gdpfs_log_unsubscribe(gdpfs_log_t *handle)
+{
+    struct gdpfs_log_sub *sub = handle->sub;
+
+    if (sub == NULL)
+        return;
+    ep_thr_mutex_lock(&sub->lock);
+    sub->active = false;
+    while (sub->delivering > 0)
+        ep_thr_cond_wait(&sub->cond, &sub->lock, NULL);
+    ep_thr_mutex_unlock(&sub->lock);
+}
+
+void gdpfs_log_set_decoder(gdpfs_log_decode_t _decoder)
+{
+    decoder = _decoder;
+}
+
+void gdpfs_log_gname(gdpfs_log_t *handle, gdpfs_log_gname_t gname)
+{
+     memcpy(gname, handle->gname, sizeof(gdpfs_log_gname_t) * sizeof(gname[0]));
+}
+
+gdpfs_log_event_type_t gdpfs_log_event_gettype(gdpfs_log_event_t *ev)
+{
+    return ev->type;
+}
+
+EP_STAT gdpfs_log_event_getstat(gdpfs_log_event_t *ev)
+{
+    return ev->stat;
+}
+
+void *gdpfs_log_event_getudata(gdpfs_log_event_t *ev)
+{
+    return ev->udata;
+}
+
+gdpfs_log_ent_t *gdpfs_log_event_getent(gdpfs_log_event_t *ev)
+{
+    return ev->ent;
+}
+
+/* Initializes an UNCACHED log entry. */
+EP_STAT
+gdpfs_log_ent_init(gdpfs_log_ent_t *log_ent)
+{
+    log_ent->datum = gdp_datum_new();
+    log_ent->is_cached = false;
+    log_ent->mem_cached = NULL;
+    log_ent->cached = NULL;
+    log_ent->cached_pos = 0;
+    log_ent->view = NULL;
+    log_ent->recno = 0;
+
+    if (log_ent->datum == NULL)
+        return GDPFS_STAT_OOMEM;
+    else
+        return GDPFS_STAT_OK;
+}
+
+static size_t
+_ent_cached_length(gdpfs_log_ent_t *ent)
+{
+    if (ent->mem_cached != NULL)
+        return gdpfs_reccache_length(ent->mem_cached);
+    if (ent->view != NULL)
+        return ent->view_len;
+    return gdpfs_logcache_rec_length(ent->cached);
+}
+
+/*
+ * Contiguous copy of the whole cached record. Memory-cached records are used
+ * in place; disk-cached ones are read in once and kept until the ent closes.
+ */
+static const char *
+_ent_cached_view(gdpfs_log_ent_t *ent)
+{
+    size_t length;
+
+    if (ent->mem_cached != NULL)
+        return gdpfs_reccache_data(ent->mem_cached);
+    if (ent->view == NULL)
+    {
+        length = gdpfs_logcache_rec_length(ent->cached);
+        ent->view = ep_mem_malloc(length > 0 ? length : 1);
+        if (ent->view == NULL)
+            return NULL;
+        ent->view_len = length;
+        if (gdpfs_logcache_pread(ent->cached, ent->view, length, 0) != length)
+        {
+            ep_mem_free(ent->view);
+            ent->view = NULL;
+        }
+    }
+    return ent->view;
+}
+
+/* Copy up to size bytes at the ent's position out of whichever cache has it. */
+static ssize_t
+_ent_cached_pread(gdpfs_log_ent_t *ent, void *buf, size_t size)
+{
+    const char *data;
+    size_t length;
+
+    if (ent->mem_cached != NULL)
+        data = gdpfs_reccache_data(ent->mem_cached);
+    else if (ent->view != NULL)
+        data = ent->view;
+    else
+        return gdpfs_logcache_pread(ent->cached, buf, size, ent->cached_pos);
+    length = _ent_cached_length(ent);
+    if (ent->cached_pos >= length)
+        return 0;
+    if (size > length - ent->cached_pos)
+        size = length - ent->cached_pos;
+    memcpy(buf, data + ent->cached_pos, size);
+    return size;
+}
+
+static void
+_ent_free_decoded(const void *data, size_t len, void *arg)
+{
+    ep_mem_free((void *) data);
+}
+
+/*
+ * Run ent through the decoder, if one is set, so readers only ever see plain
+ * records. A decoded ent reads from the decoder's output from then on.
+ */
+static EP_STAT
+_ent_decode(gdpfs_log_ent_t *ent)
+{
+    EP_STAT estat;
+    void *out = NULL;
+    size_t outlen;
+    size_t replace;
+    size_t length;
+    const char *data;
+    char *joined;
+    gdp_buf_t *buf;
+
+    if (decoder == NULL || ent->mem_cached != NULL)
+        return GDPFS_STAT_OK;   // the memory cache only holds decoded records
+    estat = decoder(ent, &out, &outlen, &replace);
+    if (!EP_STAT_ISOK(estat) || out == NULL)
+        return estat;
+    length = gdpfs_log_ent_length(ent);
+    EP_ASSERT_REQUIRE(replace <= length);
+
+    if (ent->is_cached)
+    {
+        if (replace < length)
+        {
+            // Only a prefix changed; splice it onto the rest of the record.
+            data = _ent_cached_view(ent);
+            joined = data == NULL ? NULL : ep_mem_malloc(outlen + length - replace);
+            if (joined == NULL)
+            {
+                ep_mem_free(out);
+                return GDPFS_STAT_OOMEM;
+            }
+            memcpy(joined, out, outlen);
+            memcpy(joined + outlen, data + replace, length - replace);
+            ep_mem_free(out);
+            out = joined;
+            outlen += length - replace;
+        }
+        if (ent->cached != NULL)
+            gdpfs_logcache_release(ent->cached);
+        ent->cached = NULL;
+        if (ent->view != NULL)
+            ep_mem_free(ent->view);
+        ent->view = out;
+        ent->view_len = outlen;
+    }
+    else
+    {
+        buf = gdp_datum_getbuf(ent->datum);
+        gdp_buf_drain(buf, replace);
+        if (gdp_buf_getlength(buf) == 0)
+        {
+            evbuffer_add_reference(buf, out, outlen, _ent_free_decoded, NULL);
+        }
+        else
+        {
+            evbuffer_prepend(buf, out, outlen);
+            ep_mem_free(out);
+        }
+    }
+    ent->cached_pos = 0;
+    return GDPFS_STAT_OK;
+}
+
+/*
+ * Open ent from the record caches, memory first and then disk. Disk hits are
+ * decoded and promoted to memory. Returns false on a cache miss.
+ */
+static bool
+_ent_open_cached(gdpfs_log_t *handle, gdpfs_log_ent_t *ent, gdpfs_recno_t recno)
+{
+    gdpfs_reccache_rec_t *mrec;
+    gdpfs_logcache_rec_t *rec;
+    const char *data;
+
+    ent->mem_cached = NULL;
+    ent->cached = NULL;
+    ent->cached_pos = 0;
+    ent->view = NULL;
+    ent->recno = recno;
+    ent->is_cached = true;
+    ent->datum = NULL;
+
+    mrec = gdpfs_reccache_get(handle->gname, recno);
+    if (mrec != NULL)
+    {
+        ent->mem_cached = mrec;
+        return true;
+    }
+    rec = gdpfs_logcache_get(handle->gname, recno);
+    if (rec == NULL)
+        return false;
+    ent->cached = rec;
+    if (!EP_STAT_ISOK(_ent_decode(ent)))
+    {
+        gdpfs_log_ent_close(ent);
+        return false;
+    }
+
+    data = _ent_cached_view(ent);
+    if (data != NULL &&
+        (mrec = gdpfs_reccache_put(handle->gname, recno, data, _ent_cached_length(ent))) != NULL)
+    {
+        if (ent->cached != NULL)
+            gdpfs_logcache_release(ent->cached);
+        ep_mem_free(ent->view);
+        ent->cached = NULL;
+        ent->view = NULL;
+        ent->mem_cached = mrec;
+    }
+    return true;
+}
+
+/*
+ * Gather a datum-backed ent into iovecs. Returns the count, or -1 with *iovp
+ * unset on failure. The caller frees *iovp.
+ */
+static int
+_ent_iov(gdpfs_log_ent_t *ent, struct iovec **iovp)
+{
+    size_t length = gdpfs_log_ent_length(ent);
+    int iovcnt;
+
+    iovcnt = gdpfs_log_ent_peekv(ent, length, NULL, 0);
+    if (iovcnt < 0)
+        return -1;
+    *iovp = ep_mem_malloc((iovcnt > 0 ? iovcnt : 1) * sizeof(struct iovec));
+    if (*iovp == NULL)
+        return -1;
+    gdpfs_log_ent_peekv(ent, length, *iovp, iovcnt);
+    return iovcnt;
+}
+
+/*
+ * Handle a record just read from the log: the disk cache keeps it as it
+ * came over the wire, then it is decoded and the memory cache gets the
+ * decoded form. The ent itself keeps reading from its datum.
+ */
+static EP_STAT
+_ent_fetched(gdpfs_log_t *handle, gdpfs_log_ent_t *ent, bool bypass_cache)
+{
+    EP_STAT estat;
+    gdpfs_reccache_rec_t *mrec;
+    struct iovec *iov;
+    int iovcnt;
+
+    // Gather straight from the datum's chains rather than pulling them up
+    // into one contiguous block first.
+    if (!bypass_cache && (iovcnt = _ent_iov(ent, &iov)) >= 0)
+    {
+        gdpfs_logcache_putv(handle->gname, ent->recno, iov, iovcnt);
+        ep_mem_free(iov);
+    }
+    estat = _ent_decode(ent);
+    if (!EP_STAT_ISOK(estat))
+        return estat;
+    if (!bypass_cache && (iovcnt = _ent_iov(ent, &iov)) >= 0)
+    {
+        mrec = gdpfs_reccache_putv(handle->gname, ent->recno, iov, iovcnt);
+        if (mrec != NULL)
+            gdpfs_reccache_release(mrec);
+        ep_mem_free(iov);
+    }
+    return GDPFS_STAT_OK;
+}
+
+/* Reads recno from the log server into a freshly initialized ent. */
+static EP_STAT
+_ent_fetch(gdpfs_log_t *handle, gdpfs_log_ent_t *ent, gdpfs_recno_t recno,
+        bool bypass_cache)
+{
+    EP_STAT estat;
+
+    estat = gdpfs_log_ent_init(ent);
+    if (!EP_STAT_ISOK(estat))
+        return estat;
+    estat = backend->read(handle->backend_handle, recno, ent->datum, &ent->recno);
+    if (EP_STAT_ISOK(estat))
+        estat = _ent_fetched(handle, ent, bypass_cache);
+    if (!EP_STAT_ISOK(estat))
+        gdp_datum_free(ent->datum);
+    return estat;
+}
+
+static void
+_fetch_free(fetch_t *f)
+{
+    ep_thr_cond_destroy(&f->cond);
+    if (f->data != NULL)
+        ep_mem_free(f->data);
+    ep_mem_free(f);
+}
+
+/*
+ * Looks up the fetch of recno. If one is in flight, joins it and returns it
+ * with *owner false; wait for it with _fetch_wait. Otherwise registers a new
+ * one and returns it with *owner true; the caller fetches and then hands
+ * the result on with _fetch_end. Returns NULL if there is no memory to share
+ * with, in which case the caller just fetches.
+ */
+static fetch_t *
+_fetch_begin(gdpfs_log_t *handle, gdpfs_recno_t recno, bool *owner)
+{
+    fetch_key_t key;
+    fetch_t *f;
+
+    memset(&key, 0, sizeof(key));
+    memcpy(key.gname, handle->gname, sizeof(key.gname));
+    key.recno = recno;
+
+    ep_thr_mutex_lock(&fetches_lock);
+    f = ep_hash_search(fetches, sizeof(fetch_key_t), &key);
+    if (f != NULL)
+    {
+        f->waiters++;
+        ep_thr_mutex_unlock(&fetches_lock);
+        *owner = false;
+        return f;
+    }
+
+    f = ep_mem_zalloc(sizeof(fetch_t));
+    if (f == NULL || ep_thr_cond_init(&f->cond) != 0)
+    {
+        ep_thr_mutex_unlock(&fetches_lock);
+        if (f != NULL)
+            ep_mem_free(f);
+        return NULL;
+    }
+    f->key = key;
+    ep_hash_insert(fetches, sizeof(fetch_key_t), &f->key, f);
+    ep_thr_mutex_unlock(&fetches_lock);
+    *owner = true;
+    return f;
+}
+
+/*
+ * Waits for the fetch f joined in _fetch_begin and opens ent on a copy of
+ * the record. ent can be closed even if this fails.
+ */
+static EP_STAT
+_fetch_wait(fetch_t *f, gdpfs_log_ent_t *ent, gdpfs_recno_t recno)
+{
+    EP_STAT estat;
+
+    memset(ent, 0, sizeof(gdpfs_log_ent_t));
+    ent->recno = recno;
+    ent->is_cached = true;
+
+    ep_thr_mutex_lock(&fetches_lock);
+    while (!f->done)
+        ep_thr_cond_wait(&f->cond, &fetches_lock, NULL);
+    estat = f->estat;
+    if (EP_STAT_ISOK(estat))
+    {
+        ent->view = ep_mem_malloc(f->len > 0 ? f->len : 1);
+        ent->view_len = f->len;
+        if (ent->view == NULL)
+            estat = GDPFS_STAT_OOMEM;
+        else
+            memcpy(ent->view, f->data, f->len);
+    }
+    if (--f->waiters == 0)
+        _fetch_free(f);
+    ep_thr_mutex_unlock(&fetches_lock);
+    return estat;
+}
+
+/*
+ * Hands the outcome of the fetch f registered in _fetch_begin to whoever
+ * joined it. If estat is OK, ent is the fetched record.
+ */
+static void
+_fetch_end(fetch_t *f, gdpfs_log_ent_t *ent, EP_STAT estat)
+{
+    int waiters;
+    char *data = NULL;
+    size_t len = 0;
+
+    // From here on, new opens find the record in the caches or fetch anew.
+    ep_thr_mutex_lock(&fetches_lock);
+    ep_hash_delete(fetches, sizeof(fetch_key_t), &f->key);
+    waiters = f->waiters;
+    ep_thr_mutex_unlock(&fetches_lock);
+
+    if (waiters > 0 && EP_STAT_ISOK(estat))
+    {
+        len = gdpfs_log_ent_length(ent);
+        data = ep_mem_malloc(len > 0 ? len : 1);
+        if (data == NULL || gdpfs_log_ent_peek(ent, data, len) != len)
+            estat = GDPFS_STAT_OOMEM;
+    }
+
+    ep_thr_mutex_lock(&fetches_lock);
+    f->done = true;
+    f->estat = estat;
+    f->data = data;
+    f->len = len;
+    ep_thr_cond_broadcast(&f->cond);
+    if (f->waiters == 0)
+        _fetch_free(f);
+    ep_thr_mutex_unlock(&fetches_lock);
+}
+
+/*
+ * _ent_fetch, but if the same record is already being fetched, wait for that
+ * and take a copy of the result instead of asking the log server again.
+ * recno must be absolute.
+ */
+static EP_STAT
+_ent_fetch_shared(gdpfs_log_t *handle, gdpfs_log_ent_t *ent, gdpfs_recno_t recno,
+        bool bypass_cache)
+{
+    EP_STAT estat;
+    fetch_t *f;
+    bool owner;
+
+    f = _fetch_begin(handle, recno, &owner);
+    if (f != NULL && !owner)
+        return _fetch_wait(f, ent, recno);
+
+    estat = _ent_fetch(handle, ent, recno, bypass_cache);
+    // Our own ent is fine even if the copy for the waiters isn't.
+    if (f != NULL)
+        _fetch_end(f, ent, estat);
+    return estat;
+}
+
+/*
+ * Attempt to open the ent for reco. If it fails, free resources and set ent to
+ * NULL.
+ */
+EP_STAT
+gdpfs_log_ent_open(gdpfs_log_t *handle, gdpfs_log_ent_t *ent, gdpfs_recno_t recno, bool bypass_cache)
+{
+    EP_STAT estat;
+
+    if (gcl_mode == GDPFS_LOG_MODE_AO)
+    {
+        ep_app_error("Cannot read log ent in AO mode");
+        return GDPFS_STAT_BADLOGMODE;
+    }
+
+    /* only cache if recno is not negative */
+    if (recno >= 0 && !bypass_cache && _ent_open_cached(handle, ent, recno))
+        return GDPFS_STAT_OK;
+
+    // Relative recnos name different records over time, so don't share those.
+    if (recno > 0)
+        estat = _ent_fetch_shared(handle, ent, recno, bypass_cache);
+    else
+        estat = _ent_fetch(handle, ent, recno, bypass_cache || recno < 0);
+    if (!EP_STAT_ISOK(estat) && !EP_STAT_IS_SAME(estat, GDPFS_STAT_NOTFOUND))
+    {
+        char sbuf[100];
+        ep_app_error("Cannot read GCL:\n    %s",
+            ep_stat_tostr(estat, sbuf, sizeof sbuf));
+    }
+    return estat;
+}
+
+/* Shared state of one gdpfs_log_ent_open_vec call. */
+typedef struct
+{
+    gdpfs_log_t *handle;
+    gdpfs_log_ent_t *ents;
+    fetch_t **owned;        // per ent, the fetch others may be waiting on
+    bool bypass_cache;
+    gdpfs_log_ent_cb_t cb;
+    void *udata;
+    int runsleft;
+    EP_STAT estat;
+    EP_THR_MUTEX lock;
+    EP_THR_COND cond;
+} ent_vec_t;
+
+/* A contiguous run of records fetched with a single multiread. */
+typedef struct
+{
+    ent_vec_t *vec;
+    gdpfs_recno_t first;
+    int *idx;       // index into vec->ents of each record, in recno order
+    int n;
+    int next;       // next record of the run to be delivered
+} ent_run_t;
+
+typedef struct
+{
+    gdpfs_recno_t recno;
+    int index;
+} ent_vec_slot_t;
+
+static int
+_ent_vec_slot_cmp(const void *a, const void *b)
+{
+    const ent_vec_slot_t *sa = a;
+    const ent_vec_slot_t *sb = b;
+
+    if (sa->recno < sb->recno)
+        return -1;
+    return sa->recno > sb->recno;
+}
+
+static void
+_ent_vec_cb(gdpfs_log_event_t *ev)
+{
+    ent_run_t *run = gdpfs_log_event_getudata(ev);
+    ent_vec_t *vec = run->vec;
+    gdpfs_log_ent_t *from;
+    gdpfs_log_ent_t *ent;
+    EP_STAT estat;
+    int index;
+
+    switch (gdpfs_log_event_gettype(ev))
+    {
+    case GDPFS_LOG_EVENT_DATA:
+        EP_ASSERT_INSIST(run->next < run->n);
+        index = run->idx[run->next++];
+        ent = &vec->ents[index];
+        from = gdpfs_log_event_getent(ev);
+        EP_ASSERT(gdpfs_log_ent_recno(from) == run->first + run->next - 1);
+        gdp_buf_move(gdp_datum_getbuf(ent->datum), gdp_datum_getbuf(from->datum),
+                gdpfs_log_ent_length(from));
+        ent->recno = gdpfs_log_ent_recno(from);
+        estat = _ent_fetched(vec->handle, ent, vec->bypass_cache);
+        if (!EP_STAT_ISOK(estat))
+        {
+            ep_thr_mutex_lock(&vec->lock);
+            if (EP_STAT_ISOK(vec->estat))
+                vec->estat = estat;
+            ep_thr_mutex_unlock(&vec->lock);
+            break;
+        }
+        // Don't keep anyone waiting for the rest of the run.
+        if (vec->owned[index] != NULL)
+        {
+            _fetch_end(vec->owned[index], ent, estat);
+            vec->owned[index] = NULL;
+        }
+        if (vec->cb != NULL)
+            vec->cb(ent, index, vec->udata);
+        break;
+    case GDPFS_LOG_EVENT_FAILURE:
+        run->next++;
+        ep_thr_mutex_lock(&vec->lock);
+        if (EP_STAT_ISOK(vec->estat))
+            vec->estat = gdpfs_log_event_getstat(ev);
+        ep_thr_mutex_unlock(&vec->lock);
+        break;
+    case GDPFS_LOG_EVENT_EOS:
+        ep_thr_mutex_lock(&vec->lock);
+        if (run->next != run->n && EP_STAT_ISOK(vec->estat))
+            vec->estat = GDPFS_STAT_NOTFOUND;
+        if (--vec->runsleft == 0)
+            ep_thr_cond_signal(&vec->cond);
+        ep_thr_mutex_unlock(&vec->lock);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Records someone else is already fetching aren't asked for again: they are
+ * waited for once our own multireads are done, so two overlapping calls
+ * can't end up waiting on each other.
+ */
+EP_STAT
+gdpfs_log_ent_open_vec(gdpfs_log_t *handle, gdpfs_log_ent_t *ents,
+        const gdpfs_recno_t *recnos, int nrecs, bool bypass_cache,
+        gdpfs_log_ent_cb_t cb, void *udata)
+{
+    EP_STAT estat = GDPFS_STAT_OK;
+    EP_STAT wstat;
+    ent_vec_t vec;
+    ent_vec_slot_t *slots;
+    ent_run_t *runs;
+    fetch_t **owned;
+    fetch_t **joined;
+    int *idx;
+    int nslots = 0;
+    int nruns = 0;
+    int nopen;
+    int i, j;
+    bool owner;
+
+    if (gcl_mode == GDPFS_LOG_MODE_AO)
+    {
+        ep_app_error("Cannot read log ent in AO mode");
+        return GDPFS_STAT_BADLOGMODE;
+    }
+    if (nrecs <= 0)
+        return GDPFS_STAT_OK;
+
+    slots = ep_mem_zalloc(nrecs * sizeof(ent_vec_slot_t));
+    runs = ep_mem_zalloc(nrecs * sizeof(ent_run_t));
+    idx = ep_mem_zalloc(nrecs * sizeof(int));
+    owned = ep_mem_zalloc(nrecs * sizeof(fetch_t *));
+    joined = ep_mem_zalloc(nrecs * sizeof(fetch_t *));
+    if (slots == NULL || runs == NULL || idx == NULL || owned == NULL ||
+            joined == NULL)
+    {
+        estat = GDPFS_STAT_OOMEM;
+        goto fail1;
+    }
+
+    // Anything already in the LOGCACHE doesn't need to go over the network,
+    // and anything already on its way only needs waiting for.
+    for (nopen = 0; nopen < nrecs; nopen++)
+    {
+        i = nopen;
+        EP_ASSERT_REQUIRE(recnos[i] > 0);
+        if (!bypass_cache && _ent_open_cached(handle, &ents[i], recnos[i]))
+        {
+            if (cb != NULL)
+                cb(&ents[i], i, udata);
+            continue;
+        }
+        estat = gdpfs_log_ent_init(&ents[i]);
+        if (!EP_STAT_ISOK(estat))
+            break;
+        owned[i] = _fetch_begin(handle, recnos[i], &owner);
+        if (owned[i] != NULL && !owner)
+        {
+            gdp_datum_free(ents[i].datum);
+            ents[i].datum = NULL;
+            ents[i].is_cached = true;
+            joined[i] = owned[i];
+            owned[i] = NULL;
+            continue;
+        }
+        slots[nslots].recno = recnos[i];
+        slots[nslots].index = i;
+        nslots++;
+    }
+    if (!EP_STAT_ISOK(estat))
+        nslots = 0;
+
+    // Split what's left into contiguous runs, one multiread each.
+    qsort(slots, nslots, sizeof(ent_vec_slot_t), _ent_vec_slot_cmp);
+    for (i = 0; i < nslots; i = j)
+    {
+        ent_run_t *run = &runs[nruns++];
+
+        run->vec = &vec;
+        run->first = slots[i].recno;
+        run->idx = &idx[i];
+        for (j = i; j < nslots && slots[j].recno == run->first + (j - i); j++)
+            run->idx[run->n++] = slots[j].index;
+        EP_ASSERT_REQUIRE(j == nslots || slots[j].recno != slots[j - 1].recno);
+    }
+
+    vec.handle = handle;
+    vec.ents = ents;
+    vec.owned = owned;
+    vec.bypass_cache = bypass_cache;
+    vec.cb = cb;
+    vec.udata = udata;
+    vec.runsleft = nruns;
+    vec.estat = estat;
+    if (ep_thr_mutex_init(&vec.lock, EP_THR_MUTEX_DEFAULT) != 0 ||
+        ep_thr_cond_init(&vec.cond) != 0)
+    {
+        vec.estat = GDPFS_STAT_SYNCH_FAIL;
+        nruns = 0;
+        vec.runsleft = 0;
+    }
+
+    // All runs go out before we wait on any of them.
+    for (i = 0; i < nruns; i++)
+    {
+        // _ent_vec_cb decodes after caching, so skip gdpfs_log_multiread's decoding.
+        estat = _multiread(handle, runs[i].first, runs[i].n, _ent_vec_cb, &runs[i]);
+        if (!EP_STAT_ISOK(estat))
+        {
+            ep_thr_mutex_lock(&vec.lock);
+            if (EP_STAT_ISOK(vec.estat))
+                vec.estat = estat;
+            vec.runsleft--;
+            ep_thr_mutex_unlock(&vec.lock);
+        }
+    }
+
+    ep_thr_mutex_lock(&vec.lock);
+    while (vec.runsleft > 0)
+    {
+        ep_thr_cond_wait(&vec.cond, &vec.lock, NULL);
+    }
+    ep_thr_mutex_unlock(&vec.lock);
+    ep_thr_mutex_destroy(&vec.lock);
+    ep_thr_cond_destroy(&vec.cond);
+    estat = vec.estat;
+
+    // Whatever we were to fetch and didn't get, tell its waiters so.
+    for (i = 0; i < nopen; i++)
+    {
+        if (owned[i] != NULL)
+            _fetch_end(owned[i], NULL,
+                    EP_STAT_ISOK(estat) ? GDPFS_STAT_RW_FAILED : estat);
+    }
+    // Every joined fetch has to be waited out, even after a failure.
+    for (i = 0; i < nopen; i++)
+    {
+        if (joined[i] == NULL)
+            continue;
+        wstat = _fetch_wait(joined[i], &ents[i], recnos[i]);
+        if (!EP_STAT_ISOK(wstat))
+        {
+            if (EP_STAT_ISOK(estat))
+                estat = wstat;
+        }
+        else if (EP_STAT_ISOK(estat) && cb != NULL)
+            cb(&ents[i], i, udata);
+    }
+    if (!EP_STAT_ISOK(estat))
+        goto fail0;
+
+    ep_mem_free(slots);
+    ep_mem_free(runs);
+    ep_mem_free(idx);
+    ep_mem_free(owned);
+    ep_mem_free(joined);
+    return GDPFS_STAT_OK;
+
+fail0:
+    for (i = 0; i < nopen; i++)
+        gdpfs_log_ent_close(&ents[i]);
+fail1:
+    if (slots != NULL)
+        ep_mem_free(slots);
+    if (runs != NULL)
+        ep_mem_free(runs);
+    if (idx != NULL)
+        ep_mem_free(idx);
+    if (owned != NULL)
+        ep_mem_free(owned);
+    if (joined != NULL)
+        ep_mem_free(joined);
+    return estat;
+}
+
+EP_STAT
+gdpfs_log_ent_open_range(gdpfs_log_t *handle, gdpfs_log_ent_t *ents,
+        gdpfs_recno_t recno, int nrecs, bool bypass_cache,
+        gdpfs_log_ent_cb_t cb, void *udata)
+{
+    EP_STAT estat;
+    gdpfs_recno_t *recnos;
+    int i;
+
+    recnos = ep_mem_zalloc(nrecs * sizeof(gdpfs_recno_t));
+    if (recnos == NULL)
+        return GDPFS_STAT_OOMEM;
+    for (i = 0; i < nrecs; i++)
+        recnos[i] = recno + i;
+    estat = gdpfs_log_ent_open_vec(handle, ents, recnos, nrecs, bypass_cache, cb, udata);
+    ep_mem_free(recnos);
+    return estat;
+}
+
+/*
+ * Attempt to close the ent. If it's NULL, do nothing.
+ */
+void gdpfs_log_ent_close(gdpfs_log_ent_t *ent)
+{
+    if (ent->is_cached)
+    {
+        if (ent->mem_cached != NULL)
+            gdpfs_reccache_release(ent->mem_cached);
+        if (ent->cached != NULL)
+            gdpfs_logcache_release(ent->cached);
+    }
+    else
+        gdp_datum_free(ent->datum);
+    if (ent->view != NULL)
+        ep_mem_free(ent->view);
+}
+
+size_t gdpfs_log_ent_length(gdpfs_log_ent_t *ent)
+{
+    if (ent->is_cached)
+        return _ent_cached_length(ent);
+    return gdp_buf_getlength(gdp_datum_getbuf(ent->datum));
+}
+
+/*
+ *  Read size bytes from ent into buf. If buf is NULL, skips over data. Returns
+ *  number of bytes actually read.
+ */
+size_t gdpfs_log_ent_read(gdpfs_log_ent_t *ent, void *buf, size_t size)
+{
+    if (ent->is_cached)
+    {
+        ssize_t read;
+
+        if (buf == NULL)
+        {
+            read = _ent_cached_length(ent) - ent->cached_pos;
+            if (read > size)
+                read = size;
+        }
+        else
+        {
+            read = _ent_cached_pread(ent, buf, size);
+            if (read < 0)
+                return 0;
+        }
+        ent->cached_pos += read;
+        return read;
+    }
+    else
+    {
+        gdp_buf_t *datum_buf = gdp_datum_getbuf(ent->datum);
+
+        if (buf == NULL)
+        {
+            if (gdp_buf_drain(datum_buf, size) != 0)
+            {
+                ep_app_error("Error draining buf");
+                return 0;
+            }
+            return size;
+        }
+        else
+        {
+            return gdp_buf_read(datum_buf, buf, size);
+        }
+    }
+}
+/*
+ *  Read size bytes from ent into buf. Difference between read is that peek does
+ *  not advance pointer in buffer
+ */
+size_t gdpfs_log_ent_peek(gdpfs_log_ent_t *ent, void *buf, size_t size)
+{
+    if (ent->is_cached)
+    {
+        ssize_t length = _ent_cached_pread(ent, buf, size);
+        return length < 0 ? 0 : length;
+    }
+    else
+    {
+        gdp_buf_t *datum_buf = gdp_datum_getbuf(ent->datum);
         return gdp_buf_peek(datum_buf, buf, size);
     }
 }
 
-gdpfs_recno_t gdpfs_log_ent_recno(gdpfs_log_ent_t *ent)
+int
+gdpfs_log_ent_peekv(gdpfs_log_ent_t *ent, size_t size, struct iovec *iov, int iovcnt)
 {
+    const char *base;
+    size_t length;
+    size_t left = size;
+    int n;
+    int i;
+
     if (ent->is_cached)
-        return ent->cached_recno;
-    return gdp_datum_getrecno(ent->datum);
+    {
+        base = _ent_cached_view(ent);
+        if (base == NULL)
+            return -1;
+        length = _ent_cached_length(ent);
+        if (ent->cached_pos >= length || size == 0)
+            return 0;
+        if (size > length - ent->cached_pos)
+            size = length - ent->cached_pos;
+        if (iovcnt > 0)
+        {
+            iov[0].iov_base = (void *) (base + ent->cached_pos);
+            iov[0].iov_len = size;
+        }
+        return 1;
+    }
+
+    if (size == 0)
+        return 0;
+    n = evbuffer_peek(gdp_datum_getbuf(ent->datum), size, NULL, iov, iovcnt);
+
+    // evbuffer_peek hands back whole chains; trim the last one to size.
+    for (i = 0; i < n && i < iovcnt; i++)
+    {
+        if (iov[i].iov_len > left)
+            iov[i].iov_len = left;
+        left -= iov[i].iov_len;
+    }
+    return n;
+}
+
+gdpfs_recno_t gdpfs_log_ent_recno(gdpfs_log_ent_t *ent)
+{
+    return ent->recno;
 }
 
 /*
@@ -459,12 +1821,30 @@ int gdpfs_log_ent_write(gdpfs_log_ent_t *ent, const void *buf, size_t size)
     return gdp_buf_write(datum_buf, buf, size);
 }
 
+/*
+ * The datum only has to outlive the append call: every caller closes the ent
+ * right after gdpfs_log_append returns, and the backends serialize (or copy)
+ * the record before returning.
+ */
+int gdpfs_log_ent_write_ref(gdpfs_log_ent_t *ent, const void *buf, size_t size)
+{
+    gdp_buf_t *datum_buf;
+
+    EP_ASSERT_REQUIRE(!ent->is_cached);
+
+    datum_buf = gdp_datum_getbuf(ent->datum);
+    return evbuffer_add_reference(datum_buf, buf, size, NULL, NULL);
+}
+
 int
 gdpfs_log_ent_drain(gdpfs_log_ent_t *ent, size_t size)
 {
     if (ent->is_cached)
     {
-        return lseek(ent->cached_fd, (off_t) size, SEEK_CUR) == -1 ? -1 : 0;
+        if (size > _ent_cached_length(ent) - ent->cached_pos)
+            return -1;
+        ent->cached_pos += size;
+        return 0;
     }
     else
     {
@@ -32,23 +32,32 @@
 
 #include <ep/ep.h>
 #include <gdp/gdp.h>
+#include <sys/uio.h>
+#include "list.h"
 
 typedef gdp_name_t gdpfs_log_gname_t;
-typedef gdp_event_cbfunc_t gdpfs_callback_t;
 
 typedef int64_t gdpfs_recno_t;
 struct gdpfs_log_ent
 {
-    int cached_fd;
-    gdpfs_recno_t cached_recno;
+    struct gdpfs_reccache_rec *mem_cached;  // set if served from memory
+    struct gdpfs_logcache_rec *cached;      // otherwise, from the disk cache
+    size_t cached_pos;
+    char *view;                             // whole disk-cached or decoded record
+    size_t view_len;
+    gdpfs_recno_t recno;
     bool is_cached;
     gdp_datum_t *datum;
 };
 typedef struct gdpfs_log_ent gdpfs_log_ent_t;
 struct gdpfs_log
 {
-    gdp_gcl_t *gcl_handle;
+    void *backend_handle;
     gdpfs_log_gname_t gname;
+    struct gdpfs_log_sub *sub;  // set once subscribed
+    int refs;                   // opens not yet closed; pooled when 0
+    gdpfs_recno_t appended;     // highest recno appended through this handle
+    struct list_elem idle_elem;
 };
 typedef struct gdpfs_log gdpfs_log_t;
 enum gdpfs_log_mode
@@ -59,11 +68,67 @@ enum gdpfs_log_mode
 };
 typedef enum gdpfs_log_mode gdpfs_log_mode_t;
 
+/*
+ * Which log implementation the gdpfs_log_* API sits on. GDP talks to a real
+ * router and log daemon; MEM keeps every log in process memory and is meant
+ * for measuring filesystem overhead without a network in the way.
+ */
+enum gdpfs_log_backend_type
+{
+    GDPFS_LOG_BACKEND_GDP = 0,
+    GDPFS_LOG_BACKEND_MEM,
+};
+typedef enum gdpfs_log_backend_type gdpfs_log_backend_type_t;
+
+enum gdpfs_log_event_type
+{
+    GDPFS_LOG_EVENT_DATA = 0,   // one record of a multiread or subscription
+    GDPFS_LOG_EVENT_EOS,        // end of a multiread
+    GDPFS_LOG_EVENT_SUCCESS,    // append completed
+    GDPFS_LOG_EVENT_FAILURE,    // append or multiread failed
+};
+typedef enum gdpfs_log_event_type gdpfs_log_event_type_t;
+
+/*
+ * Delivered to a gdpfs_callback_t. The event and its ent only live for the
+ * duration of the callback.
+ */
+struct gdpfs_log_event
+{
+    gdpfs_log_event_type_t type;
+    EP_STAT stat;
+    gdpfs_log_ent_t *ent;
+    void *udata;
+};
+typedef struct gdpfs_log_event gdpfs_log_event_t;
+typedef void (*gdpfs_callback_t)(gdpfs_log_event_t *ev);
+
+// Turns a raw record into the form readers expect. Sets *out to NULL if ent
+// needs no decoding. Otherwise the first *replace bytes of the record are to
+// be replaced with the *outlen bytes at *out, a new buffer that the log layer
+// takes over.
+typedef EP_STAT (*gdpfs_log_decode_t)(gdpfs_log_ent_t *ent, void **out, size_t *outlen,
+        size_t *replace);
+
 /*
  * global init of log subsystem
  */
 EP_STAT
-init_gdpfs_log(gdpfs_log_mode_t log_mode, char *gdp_router_addr);
+init_gdpfs_log(gdpfs_log_mode_t log_mode, gdpfs_log_backend_type_t backend_type,
+        char *gdp_router_addr);
+
+/*
+ * Every record read through the log layer, from the log or the caches, is
+ * passed through decoder first. The disk cache keeps records undecoded.
+ */
+void
+gdpfs_log_set_decoder(gdpfs_log_decode_t decoder);
+
+/*
+ * global shutdown of log subsystem; saves unused precreated logs
+ */
+void
+stop_gdpfs_log();
 
 /*
  * log management
@@ -71,6 +136,8 @@ init_gdpfs_log(gdpfs_log_mode_t log_mode, char *gdp_router_addr);
 EP_STAT
 gdpfs_log_get_precreated(gdp_name_t log_iname);
 
+// Handles are shared and pooled: opening a log that is open, or was closed
+// recently, returns the same handle without talking to the log server.
 EP_STAT
 gdpfs_log_open(gdpfs_log_t **handle, gdp_name_t gcl_name);
 
@@ -80,9 +147,52 @@ gdpfs_log_close(gdpfs_log_t *handle);
 EP_STAT
 gdpfs_log_append(gdpfs_log_t *handle, gdpfs_log_ent_t *ent, gdpfs_callback_t cb, void *data);
 
+// Tells the log layer that this client appends recno through handle. The
+// subscription then leaves records up to it out of the caches; the writer
+// has them already.
+void
+gdpfs_log_note_append(gdpfs_log_t *handle, gdpfs_recno_t recno);
+
+// Fetches nrecs records starting at recno. cb gets one DATA (or FAILURE) event
+// per record and a final EOS event.
+EP_STAT
+gdpfs_log_multiread(gdpfs_log_t *handle, gdpfs_recno_t recno, int32_t nrecs,
+        gdpfs_callback_t cb, void *udata);
+
+// Delivers every record from recno on, including ones appended later by this
+// or any other client, to cb as DATA events, in order and from another
+// thread. Records go through the caches and decoder just like reads. One
+// subscriber per handle at a time. A shared handle may still be subscribed
+// from an earlier subscriber; records it already got are then delivered on
+// the calling thread before this returns. The subscription is cancelled once
+// the handle goes back to the pool.
+EP_STAT
+gdpfs_log_subscribe(gdpfs_log_t *handle, gdpfs_recno_t recno,
+        gdpfs_callback_t cb, void *udata);
+
+// After this returns cb is not called again. Must not be called from cb.
+// Do this before closing the handle.
+void
+gdpfs_log_unsubscribe(gdpfs_log_t *handle);
+
 void
 gdpfs_log_gname(gdpfs_log_t *handle, gdpfs_log_gname_t gname);
 
+/*
+ * event accessors
+ */
+gdpfs_log_event_type_t
+gdpfs_log_event_gettype(gdpfs_log_event_t *ev);
+
+EP_STAT
+gdpfs_log_event_getstat(gdpfs_log_event_t *ev);
+
+void *
+gdpfs_log_event_getudata(gdpfs_log_event_t *ev);
+
+gdpfs_log_ent_t *
+gdpfs_log_event_getent(gdpfs_log_event_t *ev);
+
 /*
  * log ent management
  */
@@ -93,6 +203,26 @@ EP_STAT
 gdpfs_log_ent_open(gdpfs_log_t *handle, gdpfs_log_ent_t *ent,
 		gdpfs_recno_t recno, bool bypass_cache);
 
+/*
+ * Open many ents in one pipelined request. recnos must be positive and
+ * distinct but need not be sorted or contiguous: each contiguous run is one
+ * multiread and all runs are in flight at once. cb, if not NULL, is called
+ * (possibly from another thread) with each ent and its index as soon as it is
+ * ready. Returns once every ent is open; on failure all of them are closed.
+ */
+typedef void (*gdpfs_log_ent_cb_t)(gdpfs_log_ent_t *ent, int index, void *udata);
+
+EP_STAT
+gdpfs_log_ent_open_vec(gdpfs_log_t *handle, gdpfs_log_ent_t *ents,
+        const gdpfs_recno_t *recnos, int nrecs, bool bypass_cache,
+        gdpfs_log_ent_cb_t cb, void *udata);
+
+// same as open_vec for the records [recno, recno + nrecs)
+EP_STAT
+gdpfs_log_ent_open_range(gdpfs_log_t *handle, gdpfs_log_ent_t *ents,
+        gdpfs_recno_t recno, int nrecs, bool bypass_cache,
+        gdpfs_log_ent_cb_t cb, void *udata);
+
 void
 gdpfs_log_ent_close(gdpfs_log_ent_t *ent);
 
@@ -106,12 +236,23 @@ gdpfs_log_ent_read(gdpfs_log_ent_t *ent, void *buf, size_t size);
 size_t
 gdpfs_log_ent_peek(gdpfs_log_ent_t *ent, void *buf, size_t size);
 
+// Points iov at the next size bytes of ent without copying or advancing.
+// Returns the number of iovecs needed, of which at most iovcnt are filled in,
+// or -1 on error. The view is valid until ent is drained past or closed.
+int
+gdpfs_log_ent_peekv(gdpfs_log_ent_t *ent, size_t size, struct iovec *iov, int iovcnt);
+
 gdpfs_recno_t
 gdpfs_log_ent_recno(gdpfs_log_ent_t *ent);
 
 int
 gdpfs_log_ent_write(gdpfs_log_ent_t *ent, const void *buf, size_t size);
 
+// Like write, but buf is referenced rather than copied. It must stay valid
+// until the ent is closed.
+int
+gdpfs_log_ent_write_ref(gdpfs_log_ent_t *ent, const void *buf, size_t size);
+
 int
 gdpfs_log_ent_drain(gdpfs_log_ent_t *ent, size_t size);
 
@@ -0,0 +1,74 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#ifndef _GDPFS_LOG_BACKEND_H_
+#define _GDPFS_LOG_BACKEND_H_
+
+#include "gdpfs_log.h"
+
+/*
+ * Operations a log implementation has to provide. Handles are opaque to the
+ * log layer. Records are passed around as gdp_datum_t so both backends can
+ * share the ent code in gdpfs_log.c.
+ *
+ * read: recno <= 0 is relative to the end of the log (-1 is the last record).
+ *       Returns GDPFS_STAT_NOTFOUND if there is no such record and stores the
+ *       absolute recno that was read in *recno_out.
+ * append: synchronous if cb is NULL, otherwise cb gets a SUCCESS or FAILURE
+ *       event from another thread.
+ * multiread: cb gets a DATA (or FAILURE) event per record in order and then
+ *       exactly one EOS event, always from another thread.
+ * subscribe: like an endless multiread from recno; cb also gets every record
+ *       appended later, by anyone. At most one subscription per handle.
+ * unsubscribe: ends the subscription; cb is not called again once this
+ *       returns, and the handle can subscribe again.
+ */
+struct gdpfs_log_backend
+{
+    const char *name;
+    EP_STAT (*init)(char *gdp_router_addr);
+    EP_STAT (*create)(gdp_name_t log_iname);
+    EP_STAT (*open)(void **bhandle, gdp_name_t gcl_name, gdpfs_log_mode_t mode);
+    EP_STAT (*close)(void *bhandle);
+    EP_STAT (*read)(void *bhandle, gdpfs_recno_t recno, gdp_datum_t *datum,
+            gdpfs_recno_t *recno_out);
+    EP_STAT (*append)(void *bhandle, gdp_datum_t *datum, gdpfs_callback_t cb,
+            void *udata);
+    EP_STAT (*multiread)(void *bhandle, gdpfs_recno_t recno, int32_t nrecs,
+            gdpfs_callback_t cb, void *udata);
+    EP_STAT (*subscribe)(void *bhandle, gdpfs_recno_t recno,
+            gdpfs_callback_t cb, void *udata);
+    void (*unsubscribe)(void *bhandle);
+};
+typedef struct gdpfs_log_backend gdpfs_log_backend_t;
+
+extern gdpfs_log_backend_t gdpfs_log_backend_gdp;
+extern gdpfs_log_backend_t gdpfs_log_backend_mem;
+
+#endif // _GDPFS_LOG_BACKEND_H_
@@ -0,0 +1,352 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "gdpfs_log_backend.h"
+#include "gdpfs_stat.h"
+#include <ep/ep_app.h>
+#include <ep/ep_thr.h>
+#include <string.h>
+
+/*
+ * Log backend that talks to a real GDP router and log daemon.
+ */
+
+extern char* logd_xname;
+
+/* Carries the caller's callback through a gdp callback. */
+typedef struct
+{
+    gdpfs_callback_t cb;
+    void *udata;
+    bool multi;     // multiread state lives until EOS
+    bool sub;       // subscription state lives until the gcl is closed
+} gdp_cbstate_t;
+
+/* What the log layer holds as a backend handle. */
+typedef struct
+{
+    gdp_gcl_t *gcl;
+    gdp_gcl_t *sub_gcl;     // the subscription's own gcl, closed to cancel it
+    gdp_cbstate_t *sub;     // subscription, if any; freed with sub_gcl
+    gdp_name_t gcl_name;
+} gdp_handle_t;
+
+static EP_STAT
+_gdp_init(char *gdp_router_addr)
+{
+    EP_STAT estat;
+
+    estat = gdp_init(gdp_router_addr);
+    if (!EP_STAT_ISOK(estat))
+    {
+        ep_app_error("GDP initialization failed");
+        return estat;
+    }
+    return GDPFS_STAT_OK;
+}
+
+static EP_STAT
+_gdp_create(gdp_name_t log_iname)
+{
+    EP_STAT estat;
+    // The internal name of the log server we're going to use
+    gdp_name_t logd_iname;
+
+    // The log that we're going to create, and its internal name
+    gdp_gcl_t* gcl;
+    const gdp_name_t* gcl_iname;
+
+    gdp_parse_name(logd_xname, logd_iname);
+
+    // Metadata for the log (this allocation will succeed; the program exits otherwise)
+    gdp_gclmd_t* gmd = gdp_gclmd_new(0);
+
+    // Save creation time as metadata (to generate the log name)
+    EP_TIME_SPEC tv;
+    char timestring[40];
+
+    ep_time_now(&tv);
+    ep_time_format(&tv, timestring, sizeof timestring, EP_TIME_FMT_DEFAULT);
+    gdp_gclmd_add(gmd, GDP_GCLMD_CTIME, strlen(timestring), timestring);
+
+
+    // TODO create a keypair and use it for this log
+
+    // Safe to call concurrently; the precreate producers rely on that.
+    estat = gdp_gcl_create(NULL, logd_iname, gmd, &gcl);
+    if (!EP_STAT_ISOK(estat))
+    {
+        ep_app_error("Failed to create log.");
+        goto fail0;
+    }
+
+    // TODO:Error checking here?
+    gdp_gclmd_free(gmd);
+    gcl_iname = gdp_gcl_getname(gcl);
+    memcpy(log_iname, *gcl_iname, sizeof(gdp_name_t));
+
+    estat = gdp_gcl_close(gcl);
+    if (!EP_STAT_ISOK(estat))
+    {
+        char sbuf[100];
+
+        ep_app_error("Cannot close GCL:\n    %s",
+            ep_stat_tostr(estat, sbuf, sizeof sbuf));
+    }
+
+
+    return GDPFS_STAT_OK;
+
+fail0:
+    gdp_gclmd_free(gmd);
+    return GDPFS_STAT_CREATE_FAILED;
+}
+
+static EP_STAT
+_gdp_open(void **bhandle, gdp_name_t gcl_name, gdpfs_log_mode_t mode)
+{
+    EP_STAT estat;
+    gdp_iomode_t gcl_mode;
+    gdp_handle_t *h;
+
+    switch (mode)
+    {
+    case GDPFS_LOG_MODE_RO:
+        gcl_mode = GDP_MODE_RO;
+        break;
+    case GDPFS_LOG_MODE_RA:
+        gcl_mode = GDP_MODE_RA;
+        break;
+    case GDPFS_LOG_MODE_AO:
+        gcl_mode = GDP_MODE_AO;
+        break;
+    default:
+        return GDPFS_STAT_INVLDPARAM;
+    }
+    h = ep_mem_zalloc(sizeof(gdp_handle_t));
+    if (h == NULL)
+        return GDPFS_STAT_OOMEM;
+    estat = gdp_gcl_open(gcl_name, gcl_mode, NULL, &h->gcl);
+    if (!EP_STAT_ISOK(estat))
+    {
+        ep_mem_free(h);
+        return estat;
+    }
+    memcpy(h->gcl_name, gcl_name, sizeof(gdp_name_t));
+    *bhandle = h;
+    return estat;
+}
+
+static EP_STAT
+_gdp_close(void *bhandle)
+{
+    gdp_handle_t *h = bhandle;
+    EP_STAT estat = GDPFS_STAT_OK;
+
+    estat = gdp_gcl_close(h->gcl);
+    // Closing the gcl tears down the subscription, so its state can go too.
+    if (h->sub_gcl != NULL)
+        gdp_gcl_close(h->sub_gcl);
+    if (h->sub != NULL)
+        ep_mem_free(h->sub);
+    ep_mem_free(h);
+    return estat;
+}
+
+static EP_STAT
+_gdp_read(void *bhandle, gdpfs_recno_t recno, gdp_datum_t *datum,
+        gdpfs_recno_t *recno_out)
+{
+    gdp_handle_t *h = bhandle;
+    EP_STAT estat;
+
+    estat = gdp_gcl_read(h->gcl, recno, datum);
+    if (EP_STAT_DETAIL(estat) == _GDP_CCODE_NOTFOUND)
+        return GDPFS_STAT_NOTFOUND;
+    if (EP_STAT_ISOK(estat))
+        *recno_out = gdp_datum_getrecno(datum);
+    return estat;
+}
+
+/*
+ * Translates a gdp event into a gdpfs_log_event_t for the caller. Append
+ * callbacks get exactly one event; multiread callbacks keep their state
+ * until the end of the stream.
+ */
+static void
+_gdp_event_cb(gdp_event_t *gev)
+{
+    gdp_cbstate_t *cbs = gdp_event_getudata(gev);
+    gdpfs_log_event_t ev;
+    gdpfs_log_ent_t ent;
+    bool done = !cbs->multi;
+    bool sub = cbs->sub;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.stat = gdp_event_getstat(gev);
+    ev.udata = cbs->udata;
+    switch (gdp_event_gettype(gev))
+    {
+    case GDP_EVENT_DATA:
+        ent.datum = gdp_event_getdatum(gev);
+        ent.recno = gdp_datum_getrecno(ent.datum);
+        ent.is_cached = false;
+        ent.mem_cached = NULL;
+        ent.cached = NULL;
+        ent.view = NULL;
+        ev.type = GDPFS_LOG_EVENT_DATA;
+        ev.ent = &ent;
+        break;
+    case GDP_EVENT_EOS:
+        ev.type = GDPFS_LOG_EVENT_EOS;
+        done = true;
+        break;
+    case GDP_EVENT_SUCCESS:
+        ev.type = GDPFS_LOG_EVENT_SUCCESS;
+        break;
+    default:
+        ev.type = GDPFS_LOG_EVENT_FAILURE;
+        if (EP_STAT_ISOK(ev.stat))
+            ev.stat = GDPFS_STAT_RW_FAILED;
+        break;
+    }
+    cbs->cb(&ev);
+    if (done && !sub)
+        ep_mem_free(cbs);
+}
+
+static EP_STAT
+_gdp_append(void *bhandle, gdp_datum_t *datum, gdpfs_callback_t cb, void *udata)
+{
+    gdp_handle_t *h = bhandle;
+    EP_STAT estat;
+    gdp_cbstate_t *cbs = NULL;
+
+    if (cb != NULL)
+    {
+        cbs = ep_mem_zalloc(sizeof(gdp_cbstate_t));
+        if (cbs == NULL)
+            return GDPFS_STAT_OOMEM;
+        cbs->cb = cb;
+        cbs->udata = udata;
+    }
+    if (cbs == NULL)
+        estat = gdp_gcl_append(h->gcl, datum);
+    else
+        estat = gdp_gcl_append_async(h->gcl, datum, _gdp_event_cb, cbs);
+    if (!EP_STAT_ISOK(estat) && cbs != NULL)
+        ep_mem_free(cbs);
+    return estat;
+}
+
+static EP_STAT
+_gdp_multiread(void *bhandle, gdpfs_recno_t recno, int32_t nrecs,
+        gdpfs_callback_t cb, void *udata)
+{
+    gdp_handle_t *h = bhandle;
+    EP_STAT estat;
+    gdp_cbstate_t *cbs;
+
+    cbs = ep_mem_zalloc(sizeof(gdp_cbstate_t));
+    if (cbs == NULL)
+        return GDPFS_STAT_OOMEM;
+    cbs->cb = cb;
+    cbs->udata = udata;
+    cbs->multi = true;
+    estat = gdp_gcl_multiread(h->gcl, recno, nrecs, _gdp_event_cb, cbs);
+    if (!EP_STAT_ISOK(estat))
+        ep_mem_free(cbs);
+    return estat;
+}
+
+/*
+ * The GDP has no way to cancel a subscription short of closing the gcl it
+ * was made on. Appends and multireads in flight on the handle's gcl would
+ * lose their callbacks that way, so the subscription gets a gcl of its own.
+ */
+static EP_STAT
+_gdp_subscribe(void *bhandle, gdpfs_recno_t recno, gdpfs_callback_t cb,
+        void *udata)
+{
+    gdp_handle_t *h = bhandle;
+    EP_STAT estat;
+    gdp_cbstate_t *cbs;
+    gdp_gcl_t *gcl;
+
+    if (h->sub != NULL)
+        return GDPFS_STAT_INVLDPARAM;
+    cbs = ep_mem_zalloc(sizeof(gdp_cbstate_t));
+    if (cbs == NULL)
+        return GDPFS_STAT_OOMEM;
+    cbs->cb = cb;
+    cbs->udata = udata;
+    cbs->multi = true;
+    cbs->sub = true;
+    estat = gdp_gcl_open(h->gcl_name, GDP_MODE_RO, NULL, &gcl);
+    if (!EP_STAT_ISOK(estat))
+        goto fail0;
+    estat = gdp_gcl_subscribe(gcl, recno, 0, NULL, _gdp_event_cb, cbs);
+    if (!EP_STAT_ISOK(estat))
+        goto fail1;
+    h->sub_gcl = gcl;
+    h->sub = cbs;
+    return estat;
+
+fail1:
+    gdp_gcl_close(gcl);
+fail0:
+    ep_mem_free(cbs);
+    return estat;
+}
+
+static void
+_gdp_unsubscribe(void *bhandle)
+{
+    gdp_handle_t *h = bhandle;
+
+    if (h->sub == NULL)
+        return;
+    gdp_gcl_close(h->sub_gcl);
+    ep_mem_free(h->sub);
+    h->sub = NULL;
+    h->sub_gcl = NULL;
+}
+
+gdpfs_log_backend_t gdpfs_log_backend_gdp = {
+    .name       = "gdp",
+    .init       = _gdp_init,
+    .create     = _gdp_create,
+    .open       = _gdp_open,
+    .close      = _gdp_close,
+    .read       = _gdp_read,
+    .append     = _gdp_append,
+    .multiread  = _gdp_multiread,
+    .subscribe  = _gdp_subscribe,
+    .unsubscribe = _gdp_unsubscribe,
+};
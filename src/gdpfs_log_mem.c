@@ -0,0 +1,520 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "gdpfs_log_backend.h"
+#include "gdpfs_stat.h"
+#include "list.h"
+#include <ep/ep_app.h>
+#include <ep/ep_hash.h>
+#include <ep/ep_thr.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * In-process mock of the GDP. Logs live in memory for the lifetime of the
+ * mount and are created on first open, so any root log name works. Appends
+ * complete immediately but, as with the real GDP, callbacks and multiread
+ * results are delivered in order from a separate thread.
+ */
+
+#define MEM_LOGS_MAX 1024
+
+typedef struct
+{
+    size_t len;
+    char data[0];
+} mem_rec_t;
+
+typedef struct
+{
+    EP_THR_MUTEX lock;
+    mem_rec_t **recs;   // recs[i] is recno i + 1
+    gdpfs_recno_t nrecs;
+    gdpfs_recno_t cap;
+    struct list subs;   // subscribed mem_handle_t's
+} mem_log_t;
+
+/* One per open; several may share a log. */
+typedef struct
+{
+    mem_log_t *log;
+    struct list_elem sub_elem;
+    bool subscribed;
+    gdpfs_callback_t sub_cb;
+    void *sub_udata;
+} mem_handle_t;
+
+typedef struct
+{
+    struct list_elem elem;
+    gdpfs_log_event_type_t type;
+    EP_STAT stat;
+    mem_log_t *log;
+    gdpfs_recno_t recno;    // only for DATA events
+    gdpfs_callback_t cb;
+    void *udata;
+    mem_handle_t *sub;      // set for subscription events
+} mem_pending_t;
+
+static EP_HASH *mem_logs;
+static EP_THR_MUTEX mem_logs_lock;
+static uint64_t mem_logs_created;
+
+static struct list pending;
+static EP_THR_MUTEX pending_lock;
+static EP_THR_COND pending_cond;
+static EP_THR_COND delivered_cond;
+static mem_handle_t *delivering;    // subscription being called back, if any
+static pthread_t delivery;
+
+static void *_mem_delivery_thread(void *arg);
+
+static EP_STAT
+_mem_init(char *gdp_router_addr)
+{
+    EP_STAT estat;
+
+    (void) gdp_router_addr;
+
+    // gdp_init does this for the GDP backend. Without it libep's mutexes
+    // and conditions do nothing.
+    estat = ep_lib_init(EP_LIB_USEPTHREADS);
+    if (!EP_STAT_ISOK(estat))
+        return estat;
+
+    list_init(&pending);
+    mem_logs_created = 0;
+    if (ep_thr_mutex_init(&mem_logs_lock, EP_THR_MUTEX_DEFAULT) != 0 ||
+        ep_thr_mutex_init(&pending_lock, EP_THR_MUTEX_DEFAULT) != 0 ||
+        ep_thr_cond_init(&pending_cond) != 0 ||
+        ep_thr_cond_init(&delivered_cond) != 0)
+        return GDPFS_STAT_SYNCH_FAIL;
+    mem_logs = ep_hash_new("mem_logs", NULL, MEM_LOGS_MAX);
+    if (mem_logs == NULL)
+        return GDPFS_STAT_OOMEM;
+    if (pthread_create(&delivery, NULL, _mem_delivery_thread, NULL) != 0)
+        return GDPFS_STAT_SYNCH_FAIL;
+    ep_app_warn("Using in-memory log backend; nothing will be persisted.");
+    return GDPFS_STAT_OK;
+}
+
+/* mem_logs_lock must be held. */
+static mem_log_t *
+_mem_log_new(gdp_name_t name)
+{
+    mem_log_t *log;
+
+    log = ep_mem_zalloc(sizeof(mem_log_t));
+    if (log == NULL)
+        return NULL;
+    if (ep_thr_mutex_init(&log->lock, EP_THR_MUTEX_DEFAULT) != 0)
+    {
+        ep_mem_free(log);
+        return NULL;
+    }
+    list_init(&log->subs);
+    ep_hash_insert(mem_logs, sizeof(gdp_name_t), name, log);
+    return log;
+}
+
+static EP_STAT
+_mem_create(gdp_name_t log_iname)
+{
+    EP_TIME_SPEC tv;
+    uint64_t serial;
+    pid_t pid = getpid();
+
+    // Names only need to be unique within this process.
+    ep_time_now(&tv);
+    memset(log_iname, 0, sizeof(gdp_name_t));
+    ep_thr_mutex_lock(&mem_logs_lock);
+    serial = ++mem_logs_created;
+    memcpy(log_iname, &serial, sizeof(serial));
+    memcpy(log_iname + sizeof(serial), &tv.tv_sec, sizeof(tv.tv_sec));
+    memcpy(log_iname + sizeof(serial) + sizeof(tv.tv_sec), &pid, sizeof(pid));
+    if (_mem_log_new(log_iname) == NULL)
+    {
+        ep_thr_mutex_unlock(&mem_logs_lock);
+        return GDPFS_STAT_CREATE_FAILED;
+    }
+    ep_thr_mutex_unlock(&mem_logs_lock);
+    return GDPFS_STAT_OK;
+}
+
+static EP_STAT
+_mem_open(void **bhandle, gdp_name_t gcl_name, gdpfs_log_mode_t mode)
+{
+    mem_log_t *log;
+    mem_handle_t *h;
+
+    (void) mode;
+    h = ep_mem_zalloc(sizeof(mem_handle_t));
+    if (h == NULL)
+        return GDPFS_STAT_OOMEM;
+    ep_thr_mutex_lock(&mem_logs_lock);
+    log = ep_hash_search(mem_logs, sizeof(gdp_name_t), gcl_name);
+    if (log == NULL)
+        log = _mem_log_new(gcl_name);
+    ep_thr_mutex_unlock(&mem_logs_lock);
+    if (log == NULL)
+    {
+        ep_mem_free(h);
+        return GDPFS_STAT_OOMEM;
+    }
+    h->log = log;
+    *bhandle = h;
+    return GDPFS_STAT_OK;
+}
+
+static void _mem_unsubscribe(void *bhandle);
+
+static EP_STAT
+_mem_close(void *bhandle)
+{
+    // Logs outlive their handles, just like on a log daemon.
+    _mem_unsubscribe(bhandle);
+    ep_mem_free(bhandle);
+    return GDPFS_STAT_OK;
+}
+
+/* Copies record recno of log into datum. log->lock must be held. */
+static EP_STAT
+_mem_fill_datum(mem_log_t *log, gdpfs_recno_t recno, gdp_datum_t *datum)
+{
+    mem_rec_t *rec;
+
+    if (recno < 1 || recno > log->nrecs)
+        return GDPFS_STAT_NOTFOUND;
+    rec = log->recs[recno - 1];
+    if (gdp_buf_write(gdp_datum_getbuf(datum), rec->data, rec->len) != 0)
+        return GDPFS_STAT_OOMEM;
+    return GDPFS_STAT_OK;
+}
+
+static EP_STAT
+_mem_read(void *bhandle, gdpfs_recno_t recno, gdp_datum_t *datum,
+        gdpfs_recno_t *recno_out)
+{
+    mem_log_t *log = ((mem_handle_t *) bhandle)->log;
+    EP_STAT estat;
+
+    ep_thr_mutex_lock(&log->lock);
+    if (recno <= 0)
+        recno = log->nrecs + 1 + recno;
+    estat = _mem_fill_datum(log, recno, datum);
+    ep_thr_mutex_unlock(&log->lock);
+    if (EP_STAT_ISOK(estat))
+        *recno_out = recno;
+    return estat;
+}
+
+static void
+_mem_queue(mem_pending_t *p)
+{
+    ep_thr_mutex_lock(&pending_lock);
+    list_push_back(&pending, &p->elem);
+    ep_thr_cond_signal(&pending_cond);
+    ep_thr_mutex_unlock(&pending_lock);
+}
+
+/* Queues a DATA event for recno to subscriber h. h->log->lock must be held. */
+static void
+_mem_queue_sub(mem_handle_t *h, gdpfs_recno_t recno)
+{
+    mem_pending_t *p;
+
+    p = ep_mem_zalloc(sizeof(mem_pending_t));
+    if (p == NULL)
+    {
+        ep_app_error("Dropped subscription event for record %ld", recno);
+        return;
+    }
+    p->type = GDPFS_LOG_EVENT_DATA;
+    p->stat = GDPFS_STAT_OK;
+    p->log = h->log;
+    p->recno = recno;
+    p->cb = h->sub_cb;
+    p->udata = h->sub_udata;
+    p->sub = h;
+    _mem_queue(p);
+}
+
+/* Tells every subscriber about recno. log->lock must be held. */
+static void
+_mem_notify(mem_log_t *log, gdpfs_recno_t recno)
+{
+    struct list_elem *e;
+
+    for (e = list_begin(&log->subs); e != list_end(&log->subs); e = list_next(e))
+        _mem_queue_sub(list_entry(e, mem_handle_t, sub_elem), recno);
+}
+
+static EP_STAT
+_mem_append(void *bhandle, gdp_datum_t *datum, gdpfs_callback_t cb, void *udata)
+{
+    mem_log_t *log = ((mem_handle_t *) bhandle)->log;
+    gdp_buf_t *buf = gdp_datum_getbuf(datum);
+    size_t len = gdp_buf_getlength(buf);
+    mem_rec_t *rec;
+    mem_rec_t **recs;
+    gdpfs_recno_t cap;
+    mem_pending_t *p = NULL;
+
+    rec = ep_mem_zalloc(sizeof(mem_rec_t) + len);
+    if (rec == NULL)
+        return GDPFS_STAT_OOMEM;
+    rec->len = len;
+    gdp_buf_peek(buf, rec->data, len);
+
+    if (cb != NULL)
+    {
+        p = ep_mem_zalloc(sizeof(mem_pending_t));
+        if (p == NULL)
+        {
+            ep_mem_free(rec);
+            return GDPFS_STAT_OOMEM;
+        }
+        p->type = GDPFS_LOG_EVENT_SUCCESS;
+        p->stat = GDPFS_STAT_OK;
+        p->cb = cb;
+        p->udata = udata;
+    }
+
+    ep_thr_mutex_lock(&log->lock);
+    if (log->nrecs == log->cap)
+    {
+        cap = log->cap == 0 ? 16 : log->cap << 1;
+        recs = ep_mem_realloc(log->recs, cap * sizeof(mem_rec_t *));
+        if (recs == NULL)
+        {
+            ep_thr_mutex_unlock(&log->lock);
+            if (p != NULL)
+                ep_mem_free(p);
+            ep_mem_free(rec);
+            return GDPFS_STAT_OOMEM;
+        }
+        log->recs = recs;
+        log->cap = cap;
+    }
+    log->recs[log->nrecs++] = rec;
+    // Queued under the lock so subscribers see records in recno order.
+    _mem_notify(log, log->nrecs);
+    ep_thr_mutex_unlock(&log->lock);
+
+    if (p != NULL)
+        _mem_queue(p);
+    return GDPFS_STAT_OK;
+}
+
+/*
+ * Every event is allocated before any is queued, so a failed call has
+ * delivered nothing and the caller can free udata.
+ */
+static EP_STAT
+_mem_multiread(void *bhandle, gdpfs_recno_t recno, int32_t nrecs,
+        gdpfs_callback_t cb, void *udata)
+{
+    mem_log_t *log = ((mem_handle_t *) bhandle)->log;
+    struct list batch;
+    mem_pending_t *p;
+    int32_t i;
+
+    list_init(&batch);
+    for (i = 0; i <= nrecs; i++)
+    {
+        p = ep_mem_zalloc(sizeof(mem_pending_t));
+        if (p == NULL)
+            goto fail0;
+        if (i < nrecs)
+        {
+            p->type = GDPFS_LOG_EVENT_DATA;
+            p->log = log;
+            p->recno = recno + i;
+        }
+        else
+            p->type = GDPFS_LOG_EVENT_EOS;
+        p->stat = GDPFS_STAT_OK;
+        p->cb = cb;
+        p->udata = udata;
+        list_push_back(&batch, &p->elem);
+    }
+    while (!list_empty(&batch))
+        _mem_queue(list_entry(list_pop_front(&batch), mem_pending_t, elem));
+    return GDPFS_STAT_OK;
+
+fail0:
+    while (!list_empty(&batch))
+        ep_mem_free(list_entry(list_pop_front(&batch), mem_pending_t, elem));
+    return GDPFS_STAT_OOMEM;
+}
+
+static EP_STAT
+_mem_subscribe(void *bhandle, gdpfs_recno_t recno, gdpfs_callback_t cb,
+        void *udata)
+{
+    mem_handle_t *h = bhandle;
+    mem_log_t *log = h->log;
+    gdpfs_recno_t r;
+
+    if (recno < 1)
+        return GDPFS_STAT_INVLDPARAM;
+    ep_thr_mutex_lock(&log->lock);
+    if (h->subscribed)
+    {
+        ep_thr_mutex_unlock(&log->lock);
+        return GDPFS_STAT_INVLDPARAM;
+    }
+    h->sub_cb = cb;
+    h->sub_udata = udata;
+    list_push_back(&log->subs, &h->sub_elem);
+    h->subscribed = true;
+    // Catch up on what is already there. Holding the lock means nothing is
+    // appended in between, so no record is missed or seen twice.
+    for (r = recno; r <= log->nrecs; r++)
+        _mem_queue_sub(h, r);
+    ep_thr_mutex_unlock(&log->lock);
+    return GDPFS_STAT_OK;
+}
+
+/*
+ * Drops h's queued events and waits out one being delivered, so cb is never
+ * called again once this returns. Must not be called from cb itself.
+ */
+static void
+_mem_unsubscribe(void *bhandle)
+{
+    mem_handle_t *h = bhandle;
+    mem_log_t *log = h->log;
+    struct list_elem *e;
+    mem_pending_t *p;
+
+    ep_thr_mutex_lock(&log->lock);
+    if (!h->subscribed)
+    {
+        ep_thr_mutex_unlock(&log->lock);
+        return;
+    }
+    list_remove(&h->sub_elem);
+    h->subscribed = false;
+    ep_thr_mutex_unlock(&log->lock);
+
+    ep_thr_mutex_lock(&pending_lock);
+    for (e = list_begin(&pending); e != list_end(&pending); )
+    {
+        p = list_entry(e, mem_pending_t, elem);
+        e = list_next(e);
+        if (p->sub == h)
+        {
+            list_remove(&p->elem);
+            ep_mem_free(p);
+        }
+    }
+    while (delivering == h)
+        ep_thr_cond_wait(&delivered_cond, &pending_lock, NULL);
+    ep_thr_mutex_unlock(&pending_lock);
+}
+
+static void
+_mem_deliver(mem_pending_t *p)
+{
+    gdpfs_log_event_t ev;
+    gdpfs_log_ent_t ent;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.type = p->type;
+    ev.stat = p->stat;
+    ev.udata = p->udata;
+    if (p->type == GDPFS_LOG_EVENT_DATA)
+    {
+        ent.datum = gdp_datum_new();
+        ent.recno = p->recno;
+        ent.is_cached = false;
+        ent.mem_cached = NULL;
+        ent.cached = NULL;
+        ent.view = NULL;
+        ep_thr_mutex_lock(&p->log->lock);
+        ev.stat = _mem_fill_datum(p->log, p->recno, ent.datum);
+        ep_thr_mutex_unlock(&p->log->lock);
+        if (!EP_STAT_ISOK(ev.stat))
+        {
+            // The GDP reports a missing record as a failed read.
+            ev.type = GDPFS_LOG_EVENT_FAILURE;
+            gdp_datum_free(ent.datum);
+        }
+        else
+        {
+            ev.ent = &ent;
+        }
+    }
+    p->cb(&ev);
+    if (ev.ent != NULL)
+        gdp_datum_free(ent.datum);
+}
+
+static void *
+_mem_delivery_thread(void *arg)
+{
+    mem_pending_t *p;
+
+    while (1)
+    {
+        ep_thr_mutex_lock(&pending_lock);
+        while (list_empty(&pending))
+        {
+            ep_thr_cond_wait(&pending_cond, &pending_lock, NULL);
+        }
+        p = list_entry(list_pop_front(&pending), mem_pending_t, elem);
+        delivering = p->sub;
+        ep_thr_mutex_unlock(&pending_lock);
+
+        _mem_deliver(p);
+
+        ep_thr_mutex_lock(&pending_lock);
+        delivering = NULL;
+        ep_thr_cond_broadcast(&delivered_cond);
+        ep_thr_mutex_unlock(&pending_lock);
+        ep_mem_free(p);
+    }
+    // NOT REACHED
+    return NULL;
+}
+
+gdpfs_log_backend_t gdpfs_log_backend_mem = {
+    .name       = "mem",
+    .init       = _mem_init,
+    .create     = _mem_create,
+    .open       = _mem_open,
+    .close      = _mem_close,
+    .read       = _mem_read,
+    .append     = _mem_append,
+    .multiread  = _mem_multiread,
+    .subscribe  = _mem_subscribe,
+    .unsubscribe = _mem_unsubscribe,
+};
@@ -0,0 +1,383 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "gdpfs_logcache.h"
+#include "gdpfs_stat.h"
+#include "list.h"
+
+#include <ep/ep_app.h>
+#include <ep/ep_assert.h>
+#include <ep/ep_hash.h>
+#include <ep/ep_thr.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#define LOGCACHE_HASH_SIZE 65536
+
+typedef struct
+{
+    gdp_name_t gname;
+    int64_t recno;
+} logcache_key_t;
+
+typedef struct logcache_seg
+{
+    struct list_elem elem;      // in segs, oldest first
+    uint32_t id;
+    int fd;
+    off_t size;                 // bytes handed out so far
+    struct list ents;           // index entries stored in this segment
+    int refs;                   // readers and in-progress writers
+    bool retired;               // compacted away; delete when refs hits 0
+} logcache_seg_t;
+
+typedef struct
+{
+    struct list_elem seg_elem;
+    logcache_key_t key;
+    logcache_seg_t *seg;
+    off_t offset;
+    size_t len;
+    bool referenced;            // read since written or last compacted
+} logcache_ent_t;
+
+struct gdpfs_logcache_rec
+{
+    logcache_seg_t *seg;
+    off_t offset;
+    size_t len;
+};
+
+static bool initialized = false;
+static char *seg_dir;
+static size_t max_bytes;
+static size_t total_bytes;
+static uint32_t next_seg_id;
+static struct list segs;
+static logcache_seg_t *active;
+static EP_HASH *index_hash;
+static EP_THR_MUTEX logcache_lock;
+
+static void
+_seg_name(uint32_t id, char *name, size_t len)
+{
+    snprintf(name, len, "%s/LOGSEG%08u", seg_dir, id);
+}
+
+/* logcache_lock must be held. */
+static logcache_seg_t *
+_seg_new()
+{
+    char name[PATH_MAX];
+    logcache_seg_t *seg;
+
+    seg = ep_mem_zalloc(sizeof(logcache_seg_t));
+    if (seg == NULL)
+        return NULL;
+    seg->id = next_seg_id++;
+    _seg_name(seg->id, name, sizeof name);
+    seg->fd = open(name, O_RDWR | O_TRUNC | O_CREAT, 00744);
+    if (seg->fd == -1)
+    {
+        ep_app_error("Could not create log cache segment %s", name);
+        ep_mem_free(seg);
+        return NULL;
+    }
+    list_init(&seg->ents);
+    list_push_back(&segs, &seg->elem);
+    return seg;
+}
+
+/* logcache_lock must be held. */
+static void
+_seg_destroy(logcache_seg_t *seg)
+{
+    char name[PATH_MAX];
+
+    EP_ASSERT(seg->retired && seg->refs == 0);
+    close(seg->fd);
+    _seg_name(seg->id, name, sizeof name);
+    unlink(name);
+    ep_mem_free(seg);
+}
+
+/*
+ * Reserve len bytes in the active segment, starting a new one if it is full.
+ * Returns the segment with a reference held. logcache_lock must be held.
+ */
+static logcache_seg_t *
+_seg_reserve(size_t len, off_t *offset)
+{
+    if (active == NULL || (active->size > 0 && active->size + len > LOGCACHE_SEGMENT_SIZE))
+    {
+        active = _seg_new();
+        if (active == NULL)
+            return NULL;
+    }
+    *offset = active->size;
+    active->size += len;
+    active->refs++;
+    total_bytes += len;
+    return active;
+}
+
+/* logcache_lock must be held. */
+static void
+_seg_unref(logcache_seg_t *seg)
+{
+    if (--seg->refs == 0 && seg->retired)
+        _seg_destroy(seg);
+}
+
+/*
+ * Compact a sealed segment: if keep_hot, records that were read since they
+ * were last written move to the active segment. Everything else is dropped.
+ * logcache_lock must be held.
+ */
+static void
+_seg_compact(logcache_seg_t *seg, bool keep_hot)
+{
+    logcache_ent_t *ent;
+    logcache_seg_t *to;
+    off_t offset;
+    void *buf;
+
+    while (!list_empty(&seg->ents))
+    {
+        ent = list_entry(list_pop_front(&seg->ents), logcache_ent_t, seg_elem);
+        if (keep_hot && ent->referenced && (buf = ep_mem_zalloc(ent->len)) != NULL)
+        {
+            to = _seg_reserve(ent->len, &offset);
+            if (to != NULL &&
+                pread(seg->fd, buf, ent->len, ent->offset) == ent->len &&
+                pwrite(to->fd, buf, ent->len, offset) == ent->len)
+            {
+                ent->seg = to;
+                ent->offset = offset;
+                ent->referenced = false;
+                list_push_back(&to->ents, &ent->seg_elem);
+                _seg_unref(to);
+                ep_mem_free(buf);
+                continue;
+            }
+            if (to != NULL)
+                _seg_unref(to);
+            ep_mem_free(buf);
+        }
+        ep_hash_delete(index_hash, sizeof(logcache_key_t), &ent->key);
+        ep_mem_free(ent);
+    }
+
+    list_remove(&seg->elem);
+    total_bytes -= seg->size;
+    seg->retired = true;
+    seg->refs++;
+    _seg_unref(seg);
+}
+
+/* logcache_lock must be held. */
+static void
+_enforce_bound()
+{
+    size_t sealed = list_size(&segs) - 1;
+
+    // Every pass retires one segment, so this terminates even if all the
+    // records are hot and get copied forward.
+    while (total_bytes > max_bytes && sealed-- > 0)
+    {
+        logcache_seg_t *oldest = list_entry(list_front(&segs), logcache_seg_t, elem);
+        if (oldest == active)
+            break;
+        _seg_compact(oldest, true);
+    }
+}
+
+EP_STAT
+init_gdpfs_logcache(const char *dir, size_t _max_bytes)
+{
+    seg_dir = ep_mem_zalloc(strlen(dir) + 1);
+    if (seg_dir == NULL)
+        return GDPFS_STAT_OOMEM;
+    strcpy(seg_dir, dir);
+    max_bytes = _max_bytes;
+    total_bytes = 0;
+    next_seg_id = 0;
+    active = NULL;
+    list_init(&segs);
+    if (ep_thr_mutex_init(&logcache_lock, EP_THR_MUTEX_DEFAULT) != 0)
+        return GDPFS_STAT_SYNCH_FAIL;
+    index_hash = ep_hash_new("logcache_index", NULL, LOGCACHE_HASH_SIZE);
+    if (index_hash == NULL)
+        return GDPFS_STAT_OOMEM;
+    initialized = true;
+    return GDPFS_STAT_OK;
+}
+
+void
+stop_gdpfs_logcache()
+{
+    if (!initialized)
+        return;
+    ep_thr_mutex_lock(&logcache_lock);
+    initialized = false;
+    active = NULL;
+    while (!list_empty(&segs))
+    {
+        logcache_seg_t *seg = list_entry(list_front(&segs), logcache_seg_t, elem);
+        _seg_compact(seg, false);
+    }
+    ep_thr_mutex_unlock(&logcache_lock);
+}
+
+EP_STAT
+gdpfs_logcache_put(gdp_name_t gname, int64_t recno, const void *data, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) data;
+    iov.iov_len = len;
+    return gdpfs_logcache_putv(gname, recno, &iov, 1);
+}
+
+EP_STAT
+gdpfs_logcache_putv(gdp_name_t gname, int64_t recno, const struct iovec *iov, int iovcnt)
+{
+    logcache_key_t key;
+    logcache_ent_t *ent;
+    logcache_seg_t *seg;
+    off_t offset;
+    ssize_t written;
+    size_t len = 0;
+    int i;
+
+    if (!initialized)
+        return GDPFS_STAT_OK;
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    memset(&key, 0, sizeof(key));
+    memcpy(key.gname, gname, sizeof(gdp_name_t));
+    key.recno = recno;
+
+    ep_thr_mutex_lock(&logcache_lock);
+    if (ep_hash_search(index_hash, sizeof(key), &key) != NULL)
+    {
+        ep_thr_mutex_unlock(&logcache_lock);
+        return GDPFS_STAT_OK;
+    }
+    seg = _seg_reserve(len, &offset);
+    ep_thr_mutex_unlock(&logcache_lock);
+    if (seg == NULL)
+        return GDPFS_STAT_LOCAL_FS_FAIL;
+
+    // The space is ours, so the write itself doesn't need the lock.
+    written = pwritev(seg->fd, iov, iovcnt, offset);
+
+    ep_thr_mutex_lock(&logcache_lock);
+    if (written == len && !seg->retired &&
+        ep_hash_search(index_hash, sizeof(key), &key) == NULL &&
+        (ent = ep_mem_zalloc(sizeof(logcache_ent_t))) != NULL)
+    {
+        ent->key = key;
+        ent->seg = seg;
+        ent->offset = offset;
+        ent->len = len;
+        list_push_back(&seg->ents, &ent->seg_elem);
+        ep_hash_insert(index_hash, sizeof(key), &ent->key, ent);
+    }
+    _seg_unref(seg);
+    _enforce_bound();
+    ep_thr_mutex_unlock(&logcache_lock);
+
+    if (written != len)
+        return GDPFS_STAT_LOCAL_FS_FAIL;
+    return GDPFS_STAT_OK;
+}
+
+gdpfs_logcache_rec_t *
+gdpfs_logcache_get(gdp_name_t gname, int64_t recno)
+{
+    logcache_key_t key;
+    logcache_ent_t *ent;
+    gdpfs_logcache_rec_t *rec;
+
+    if (!initialized)
+        return NULL;
+
+    memset(&key, 0, sizeof(key));
+    memcpy(key.gname, gname, sizeof(gdp_name_t));
+    key.recno = recno;
+
+    rec = ep_mem_zalloc(sizeof(gdpfs_logcache_rec_t));
+    if (rec == NULL)
+        return NULL;
+
+    ep_thr_mutex_lock(&logcache_lock);
+    ent = ep_hash_search(index_hash, sizeof(key), &key);
+    if (ent == NULL)
+    {
+        ep_thr_mutex_unlock(&logcache_lock);
+        ep_mem_free(rec);
+        return NULL;
+    }
+    ent->referenced = true;
+    rec->seg = ent->seg;
+    rec->offset = ent->offset;
+    rec->len = ent->len;
+    rec->seg->refs++;
+    ep_thr_mutex_unlock(&logcache_lock);
+    return rec;
+}
+
+size_t
+gdpfs_logcache_rec_length(gdpfs_logcache_rec_t *rec)
+{
+    return rec->len;
+}
+
+ssize_t
+gdpfs_logcache_pread(gdpfs_logcache_rec_t *rec, void *buf, size_t size, off_t offset)
+{
+    if (offset >= rec->len)
+        return 0;
+    if (size > rec->len - offset)
+        size = rec->len - offset;
+    return pread(rec->seg->fd, buf, size, rec->offset + offset);
+}
+
+void
+gdpfs_logcache_release(gdpfs_logcache_rec_t *rec)
+{
+    ep_thr_mutex_lock(&logcache_lock);
+    _seg_unref(rec->seg);
+    ep_thr_mutex_unlock(&logcache_lock);
+    ep_mem_free(rec);
+}
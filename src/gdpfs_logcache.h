@@ -0,0 +1,83 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#ifndef _GDPFS_LOGCACHE_H_
+#define _GDPFS_LOGCACHE_H_
+
+#include <ep/ep.h>
+#include <gdp/gdp.h>
+#include <sys/uio.h>
+
+/*
+ * Local cache of log records. Records are appended to a handful of large
+ * segment files and found through an in-memory (log, recno) index, so caching
+ * a record costs one pwrite and reading it back only preads.
+ *
+ * The store is bounded: once it grows past max_bytes the oldest segment is
+ * compacted. Records read since they were written are copied forward into
+ * the active segment; the rest are dropped and the segment is deleted once no
+ * reader holds it.
+ */
+
+#define LOGCACHE_SEGMENT_SIZE   (16 * 1024 * 1024)
+#define LOGCACHE_MAX_BYTES      (1024LL * 1024 * 1024)
+
+typedef struct gdpfs_logcache_rec gdpfs_logcache_rec_t;
+
+EP_STAT
+init_gdpfs_logcache(const char *dir, size_t max_bytes);
+
+void
+stop_gdpfs_logcache();
+
+// Caches len bytes of data as record recno of log gname. A no-op if the
+// record is already cached or the cache isn't initialized.
+EP_STAT
+gdpfs_logcache_put(gdp_name_t gname, int64_t recno, const void *data, size_t len);
+
+// Same as put, with the record gathered from iovcnt pieces.
+EP_STAT
+gdpfs_logcache_putv(gdp_name_t gname, int64_t recno, const struct iovec *iov, int iovcnt);
+
+// Returns a reference to the cached record or NULL on a miss. The record
+// stays readable until gdpfs_logcache_release, even if it is compacted away.
+gdpfs_logcache_rec_t *
+gdpfs_logcache_get(gdp_name_t gname, int64_t recno);
+
+size_t
+gdpfs_logcache_rec_length(gdpfs_logcache_rec_t *rec);
+
+// Reads up to size bytes starting offset bytes into the record.
+ssize_t
+gdpfs_logcache_pread(gdpfs_logcache_rec_t *rec, void *buf, size_t size, off_t offset);
+
+void
+gdpfs_logcache_release(gdpfs_logcache_rec_t *rec);
+
+#endif // _GDPFS_LOGCACHE_H_
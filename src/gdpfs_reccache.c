@@ -0,0 +1,333 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "gdpfs_reccache.h"
+#include "gdpfs_stat.h"
+#include "list.h"
+
+#include <ep/ep_app.h>
+#include <ep/ep_assert.h>
+#include <ep/ep_hash.h>
+#include <ep/ep_thr.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECCACHE_HASH_SIZE 4096
+
+typedef struct
+{
+    gdp_name_t gname;
+    int64_t recno;
+} reccache_key_t;
+
+typedef struct reccache_shard
+{
+    EP_THR_MUTEX lock;
+    EP_HASH *index;
+    struct list clock;          // CLOCK ring, the hand is at the front
+    size_t bytes;
+    size_t budget;
+} reccache_shard_t;
+
+struct gdpfs_reccache_rec
+{
+    struct list_elem clock_elem;
+    reccache_key_t key;
+    reccache_shard_t *shard;
+    int refs;                   // one for the index plus one per reader
+    bool referenced;            // CLOCK bit
+    size_t len;
+    char data[];
+};
+
+// Both only accessed through __atomic builtins.
+static bool initialized = false;
+static int users = 0;           // calls in progress plus records handed out
+static reccache_shard_t shards[RECCACHE_SHARDS];
+
+/*
+ * Register a caller with the cache. The increment is ordered before the
+ * flag check so stop either sees the caller or the caller sees the cache
+ * going away.
+ */
+static bool
+_cache_enter()
+{
+    __atomic_add_fetch(&users, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&initialized, __ATOMIC_SEQ_CST))
+        return true;
+    __atomic_sub_fetch(&users, 1, __ATOMIC_RELEASE);
+    return false;
+}
+
+static void
+_cache_leave()
+{
+    __atomic_sub_fetch(&users, 1, __ATOMIC_RELEASE);
+}
+
+static void
+_make_key(reccache_key_t *key, gdp_name_t gname, int64_t recno)
+{
+    memset(key, 0, sizeof(*key));
+    memcpy(key->gname, gname, sizeof(gdp_name_t));
+    key->recno = recno;
+}
+
+static reccache_shard_t *
+_shard_of(const reccache_key_t *key)
+{
+    const unsigned char *p = (const unsigned char *) key;
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    // FNV-1a over the whole key; the name alone is already uniformly
+    // distributed but consecutive recnos of one log should spread too.
+    for (i = 0; i < sizeof(*key); i++)
+        h = (h ^ p[i]) * 16777619u;
+    return &shards[h % RECCACHE_SHARDS];
+}
+
+/* shard->lock must be held. */
+static void
+_rec_unref(gdpfs_reccache_rec_t *rec)
+{
+    if (--rec->refs == 0)
+        ep_mem_free(rec);
+}
+
+/* shard->lock must be held. */
+static void
+_rec_evict(reccache_shard_t *shard, gdpfs_reccache_rec_t *rec)
+{
+    list_remove(&rec->clock_elem);
+    ep_hash_delete(shard->index, sizeof(reccache_key_t), &rec->key);
+    shard->bytes -= rec->len;
+    _rec_unref(rec);
+}
+
+/*
+ * Sweep the CLOCK hand until there is room for len more bytes. Records
+ * that are still being read are unlinked from the index right away and
+ * freed by their last reader. shard->lock must be held.
+ */
+static void
+_shard_make_room(reccache_shard_t *shard, size_t len)
+{
+    gdpfs_reccache_rec_t *rec;
+
+    while (shard->bytes + len > shard->budget && !list_empty(&shard->clock))
+    {
+        rec = list_entry(list_front(&shard->clock), gdpfs_reccache_rec_t, clock_elem);
+        if (rec->referenced)
+        {
+            rec->referenced = false;
+            list_remove(&rec->clock_elem);
+            list_push_back(&shard->clock, &rec->clock_elem);
+            continue;
+        }
+        _rec_evict(shard, rec);
+    }
+}
+
+EP_STAT
+init_gdpfs_reccache(size_t budget)
+{
+    int i;
+
+    if (budget == 0)
+        return GDPFS_STAT_OK;
+    for (i = 0; i < RECCACHE_SHARDS; i++)
+    {
+        reccache_shard_t *shard = &shards[i];
+
+        if (ep_thr_mutex_init(&shard->lock, EP_THR_MUTEX_DEFAULT) != 0)
+            return GDPFS_STAT_SYNCH_FAIL;
+        shard->index = ep_hash_new("reccache_index", NULL, RECCACHE_HASH_SIZE);
+        if (shard->index == NULL)
+            return GDPFS_STAT_OOMEM;
+        list_init(&shard->clock);
+        shard->bytes = 0;
+        shard->budget = budget / RECCACHE_SHARDS;
+    }
+    __atomic_store_n(&initialized, true, __ATOMIC_RELEASE);
+    return GDPFS_STAT_OK;
+}
+
+/*
+ * Callers must have stopped the file layer first. New lookups miss once
+ * the flag is cleared; stop then waits for the calls already inside and
+ * for every record handed out to be released before tearing down the
+ * shards, since a release takes the shard lock.
+ */
+void
+stop_gdpfs_reccache()
+{
+    int i;
+
+    if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE))
+        return;
+    __atomic_store_n(&initialized, false, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&users, __ATOMIC_SEQ_CST) > 0)
+        usleep(1000);
+    for (i = 0; i < RECCACHE_SHARDS; i++)
+    {
+        reccache_shard_t *shard = &shards[i];
+
+        ep_thr_mutex_lock(&shard->lock);
+        while (!list_empty(&shard->clock))
+            _rec_evict(shard, list_entry(list_front(&shard->clock),
+                    gdpfs_reccache_rec_t, clock_elem));
+        ep_thr_mutex_unlock(&shard->lock);
+        ep_hash_free(shard->index);
+        shard->index = NULL;
+        ep_thr_mutex_destroy(&shard->lock);
+    }
+}
+
+gdpfs_reccache_rec_t *
+gdpfs_reccache_get(gdp_name_t gname, int64_t recno)
+{
+    reccache_key_t key;
+    reccache_shard_t *shard;
+    gdpfs_reccache_rec_t *rec;
+
+    if (!_cache_enter())
+        return NULL;
+
+    _make_key(&key, gname, recno);
+    shard = _shard_of(&key);
+    ep_thr_mutex_lock(&shard->lock);
+    rec = ep_hash_search(shard->index, sizeof(key), &key);
+    if (rec != NULL)
+    {
+        rec->referenced = true;
+        rec->refs++;
+    }
+    ep_thr_mutex_unlock(&shard->lock);
+    // A hit stays registered until gdpfs_reccache_release.
+    if (rec == NULL)
+        _cache_leave();
+    return rec;
+}
+
+gdpfs_reccache_rec_t *
+gdpfs_reccache_put(gdp_name_t gname, int64_t recno, const void *data, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) data;
+    iov.iov_len = len;
+    return gdpfs_reccache_putv(gname, recno, &iov, 1);
+}
+
+gdpfs_reccache_rec_t *
+gdpfs_reccache_putv(gdp_name_t gname, int64_t recno, const struct iovec *iov, int iovcnt)
+{
+    reccache_key_t key;
+    reccache_shard_t *shard;
+    gdpfs_reccache_rec_t *rec;
+    gdpfs_reccache_rec_t *old;
+    size_t len = 0;
+    size_t pos = 0;
+    int i;
+
+    if (!_cache_enter())
+        return NULL;
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    _make_key(&key, gname, recno);
+    shard = _shard_of(&key);
+    if (len > shard->budget)
+    {
+        _cache_leave();
+        return NULL;
+    }
+
+    // Copy outside the lock; records are immutable once published.
+    rec = ep_mem_malloc(sizeof(gdpfs_reccache_rec_t) + len);
+    if (rec == NULL)
+    {
+        _cache_leave();
+        return NULL;
+    }
+    rec->key = key;
+    rec->shard = shard;
+    rec->refs = 2;
+    rec->referenced = false;
+    rec->len = len;
+    for (i = 0; i < iovcnt; i++)
+    {
+        memcpy(rec->data + pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+
+    ep_thr_mutex_lock(&shard->lock);
+    old = ep_hash_search(shard->index, sizeof(key), &key);
+    if (old != NULL)
+    {
+        // Lost a race with another filler. Records never change, so just
+        // hand out the one that is already there.
+        old->referenced = true;
+        old->refs++;
+        ep_thr_mutex_unlock(&shard->lock);
+        ep_mem_free(rec);
+        return old;
+    }
+    _shard_make_room(shard, len);
+    list_push_back(&shard->clock, &rec->clock_elem);
+    ep_hash_insert(shard->index, sizeof(key), &rec->key, rec);
+    shard->bytes += len;
+    ep_thr_mutex_unlock(&shard->lock);
+    return rec;
+}
+
+const void *
+gdpfs_reccache_data(gdpfs_reccache_rec_t *rec)
+{
+    return rec->data;
+}
+
+size_t
+gdpfs_reccache_length(gdpfs_reccache_rec_t *rec)
+{
+    return rec->len;
+}
+
+void
+gdpfs_reccache_release(gdpfs_reccache_rec_t *rec)
+{
+    reccache_shard_t *shard = rec->shard;
+
+    ep_thr_mutex_lock(&shard->lock);
+    _rec_unref(rec);
+    ep_thr_mutex_unlock(&shard->lock);
+    _cache_leave();
+}
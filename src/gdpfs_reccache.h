@@ -0,0 +1,79 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#ifndef _GDPFS_RECCACHE_H_
+#define _GDPFS_RECCACHE_H_
+
+#include <ep/ep.h>
+#include <gdp/gdp.h>
+#include <sys/uio.h>
+
+/*
+ * In-memory cache of whole log records keyed by (log, recno). It sits in
+ * front of the on-disk log cache so hot records (checkpoint nodes, recently
+ * read data) are served without a syscall.
+ *
+ * The cache is split into RECCACHE_SHARDS independently locked shards, each
+ * getting an equal share of the byte budget and evicting with CLOCK.
+ */
+
+#define RECCACHE_SHARDS             16
+#define RECCACHE_DEFAULT_BYTES      (64 * 1024 * 1024)
+
+typedef struct gdpfs_reccache_rec gdpfs_reccache_rec_t;
+
+EP_STAT
+init_gdpfs_reccache(size_t budget);
+
+void
+stop_gdpfs_reccache();
+
+// Returns a reference to the cached record or NULL on a miss.
+gdpfs_reccache_rec_t *
+gdpfs_reccache_get(gdp_name_t gname, int64_t recno);
+
+// Copies len bytes of data into the cache. Returns a reference to the cached
+// record, or NULL if it could not be cached (e.g. it is bigger than a shard).
+gdpfs_reccache_rec_t *
+gdpfs_reccache_put(gdp_name_t gname, int64_t recno, const void *data, size_t len);
+
+// Same as put, with the record gathered from iovcnt pieces.
+gdpfs_reccache_rec_t *
+gdpfs_reccache_putv(gdp_name_t gname, int64_t recno, const struct iovec *iov, int iovcnt);
+
+const void *
+gdpfs_reccache_data(gdpfs_reccache_rec_t *rec);
+
+size_t
+gdpfs_reccache_length(gdpfs_reccache_rec_t *rec);
+
+void
+gdpfs_reccache_release(gdpfs_reccache_rec_t *rec);
+
+#endif // _GDPFS_RECCACHE_H_
@@ -28,6 +28,7 @@
 */
 
 #include "gdpfs.h"
+#include "gdpfs_reccache.h"
 
 #include <ep/ep.h>
 #include <ep/ep_app.h>
@@ -46,13 +47,25 @@ static void
 usage(void)
 {
     fprintf(stderr,
-        "Usage: %s [-hrd] [-G gdp_router] logname servername -- [fuse args]\n"
+        "Usage: %s [-hrdmz] [-G gdp_router] [-M cache_mb]\n"
+        "        [-w appends] [-W appends] [-c records] [-b mb] [-a seconds]\n"
+        "        [-j journal]\n"
+        "        logname servername -- [fuse args]\n"
         "    logname: GDP address of filesystem root directory log\n"
         "    servername: GDP address of log daemon to create new logs on\n"
         "    -h display this usage message and exit\n"
         "    -r mount the filesys in read only mode\n"
         "    -d disable the cache\n"
-        "    -G IP host to contact for GDP router\n",
+        "    -m use an in-memory mock of the GDP (no router or log daemon)\n"
+        "    -z compress records written to the log when it pays off\n"
+        "    -G IP host to contact for GDP router\n"
+        "    -M size of the in-memory record cache in MiB (0 disables it)\n"
+        "    -w max appends in flight per file\n"
+        "    -W max appends in flight across all files\n"
+        "    -c checkpoint open files after this many records (0 never)\n"
+        "    -b checkpoint open files after this many MiB written (0 never)\n"
+        "    -a checkpoint open files this many seconds after a write (0 never)\n"
+        "    -j journal writes to this local file and ack them once it's on disk\n",
         ep_app_getprogname());
     exit(EX_USAGE);
 }
@@ -72,6 +85,15 @@ main(int argc, char *argv[])
     int fuseargc;
     bool read_only = false;
     bool use_cache = true;
+    bool mock_log = false;
+    bool compress = false;
+    size_t mem_cache_bytes = RECCACHE_DEFAULT_BYTES;
+    int append_window = 0;          // 0 picks the default
+    int append_window_global = 0;
+    int chkpt_records = -1;         // -1 picks the default
+    int chkpt_mb = -1;
+    int chkpt_age = -1;
+    char *journal_path = NULL;
     bool show_usage = false;
     char *argv0 = argv[0];
 
@@ -81,7 +103,7 @@ main(int argc, char *argv[])
          fuseargc--);
     argc -= fuseargc;
 
-    while ((opt = getopt(argc, argv, "G:hrd::")) > 0)
+    while ((opt = getopt(argc, argv, "G:M:w:W:c:b:a:j:hrmzd::")) > 0)
     {
         switch (opt)
         {
@@ -97,10 +119,46 @@ main(int argc, char *argv[])
             use_cache = false;
             break;
 
+        case 'm':
+            mock_log = true;
+            break;
+
+        case 'z':
+            compress = true;
+            break;
+
         case 'G':
             gdp_router_addr = optarg;
             break;
 
+        case 'M':
+            mem_cache_bytes = (size_t) strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+
+        case 'w':
+            append_window = atoi(optarg);
+            break;
+
+        case 'W':
+            append_window_global = atoi(optarg);
+            break;
+
+        case 'c':
+            chkpt_records = atoi(optarg);
+            break;
+
+        case 'b':
+            chkpt_mb = atoi(optarg);
+            break;
+
+        case 'a':
+            chkpt_age = atoi(optarg);
+            break;
+
+        case 'j':
+            journal_path = optarg;
+            break;
+
         default:
             show_usage = true;
             break;
@@ -130,5 +188,7 @@ main(int argc, char *argv[])
     argc++;
 
     signal(SIGINT, sig_int);
-    return gdpfs_run(gclpname, gdp_router_addr, read_only, use_cache, argc, argv);
+    return gdpfs_run(gclpname, gdp_router_addr, read_only, use_cache, mock_log,
+            mem_cache_bytes, append_window, append_window_global, compress,
+            chkpt_records, chkpt_mb, chkpt_age, journal_path, argc, argv);
 }
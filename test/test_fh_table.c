@@ -0,0 +1,201 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "test.h"
+#include "fh_table.h"
+
+#include <ep/ep_thr.h>
+
+#define RACE_THREADS    8
+#define RACE_ROUNDS     20000
+
+typedef struct
+{
+    uint64_t fh;
+    uint64_t owner;
+} slot_t;
+
+static void
+test_reserve_release()
+{
+    fh_table_t *fht = fh_table_create(sizeof(slot_t));
+    slot_t *slot;
+    uint64_t fh;
+
+    CHECK(fht != NULL);
+    CHECK(fh_table_reserve(fht) == 0);
+    CHECK(fh_table_reserve(fht) == 1);
+    CHECK(fh_table_reserve(fht) == 2);
+
+    slot = fh_table_slot(fht, 1);
+    CHECK(slot != NULL);
+    slot->fh = 1;
+    CHECK(((slot_t *) fh_table_slot(fht, 1))->fh == 1);
+    CHECK(fh_table_slot(fht, 0) != slot && fh_table_slot(fht, 2) != slot);
+
+    // Released handles stop resolving and come back most recent first.
+    CHECK(fh_table_release(fht, 1) == 0);
+    CHECK(fh_table_slot(fht, 1) == NULL);
+    CHECK(fh_table_release(fht, 1) != 0);
+    CHECK(fh_table_release(fht, 0) == 0);
+    CHECK(fh_table_reserve(fht) == 0);
+    CHECK(fh_table_reserve(fht) == 1);
+    CHECK(fh_table_reserve(fht) == 3);
+
+    // Handles nobody has had, in and past the allocated chunks.
+    CHECK(fh_table_slot(fht, 4) == NULL);
+    CHECK(fh_table_release(fht, 4) != 0);
+    CHECK(fh_table_slot(fht, FH_TABLE_CHUNK) == NULL);
+    CHECK(fh_table_release(fht, FH_TABLE_CHUNK) != 0);
+    CHECK(fh_table_slot(fht, FH_TABLE_MAX) == NULL);
+    CHECK(fh_table_release(fht, FH_TABLE_MAX) != 0);
+    CHECK(fh_table_slot(fht, -1) == NULL);
+
+    fh = fh_table_reserve(NULL);
+    CHECK(fh == -1);
+    CHECK(fh_table_release(NULL, 0) != 0);
+    CHECK(fh_table_slot(NULL, 0) == NULL);
+    fh_table_free(fht);
+}
+
+static void
+test_grow()
+{
+    fh_table_t *fht = fh_table_create(sizeof(slot_t));
+    uint64_t n = 3 * FH_TABLE_CHUNK + 17;
+    slot_t *slot;
+    uint64_t fh;
+    uint64_t i;
+
+    // Every slot across several chunks is distinct and keeps its contents.
+    for (i = 0; i < n; i++)
+    {
+        fh = fh_table_reserve(fht);
+        CHECK(fh == i);
+        slot = fh_table_slot(fht, fh);
+        CHECK(slot != NULL);
+        if (slot == NULL)
+            break;
+        CHECK(slot->fh == 0);
+        slot->fh = ~fh;
+    }
+    for (i = 0; i < n; i++)
+    {
+        slot = fh_table_slot(fht, i);
+        CHECK(slot != NULL && slot->fh == ~i);
+    }
+
+    // Freed handles are reused before the table grows any further.
+    for (i = 0; i < n; i += 2)
+        CHECK(fh_table_release(fht, i) == 0);
+    for (i = 0; i < n; i += 2)
+        CHECK(fh_table_reserve(fht) < n);
+    CHECK(fh_table_reserve(fht) == n);
+    fh_table_free(fht);
+}
+
+static void
+test_full()
+{
+    fh_table_t *fht = fh_table_create(0);
+    uint64_t i;
+    uint64_t fh = 0;
+
+    for (i = 0; i < FH_TABLE_MAX && fh != -1; i++)
+        fh = fh_table_reserve(fht);
+    CHECK(fh == FH_TABLE_MAX - 1);
+    CHECK(fh_table_reserve(fht) == -1);
+    CHECK(fh_table_reserve(fht) == -1);
+
+    // A full table still hands back what is released.
+    CHECK(fh_table_release(fht, 12345) == 0);
+    CHECK(fh_table_reserve(fht) == 12345);
+    CHECK(fh_table_reserve(fht) == -1);
+    fh_table_free(fht);
+}
+
+static fh_table_t *race_table;
+
+static void *
+_race_thread(void *arg)
+{
+    uint64_t me = (uintptr_t) arg;
+    uint64_t held[4];
+    slot_t *slot;
+    int round;
+    int i;
+
+    for (round = 0; round < RACE_ROUNDS; round++)
+    {
+        for (i = 0; i < 4; i++)
+        {
+            held[i] = fh_table_reserve(race_table);
+            CHECK(held[i] != -1);
+            slot = fh_table_slot(race_table, held[i]);
+            CHECK(slot != NULL);
+            if (slot != NULL)
+                __atomic_store_n(&slot->owner, me, __ATOMIC_RELAXED);
+        }
+        // Nobody else may have been handed one of ours in the meantime.
+        for (i = 0; i < 4; i++)
+        {
+            slot = fh_table_slot(race_table, held[i]);
+            CHECK(slot != NULL && __atomic_load_n(&slot->owner, __ATOMIC_RELAXED) == me);
+            CHECK(fh_table_release(race_table, held[i]) == 0);
+        }
+    }
+    return NULL;
+}
+
+static void
+test_race()
+{
+    EP_THR thrs[RACE_THREADS];
+    uintptr_t i;
+
+    race_table = fh_table_create(sizeof(slot_t));
+    for (i = 0; i < RACE_THREADS; i++)
+        CHECK(ep_thr_spawn(&thrs[i], _race_thread, (void *) (i + 1)) == 0);
+    for (i = 0; i < RACE_THREADS; i++)
+        pthread_join(thrs[i], NULL);
+
+    // Only as many handles as were ever held at once got created.
+    CHECK(race_table->next <= RACE_THREADS * 4);
+    fh_table_free(race_table);
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_reserve_release();
+    test_grow();
+    test_full();
+    test_race();
+    return TEST_RESULT("test_fh_table");
+}
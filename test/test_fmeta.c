@@ -0,0 +1,230 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "test.h"
+#include "gdpfs_fmeta.h"
+
+#include <string.h>
+
+/* The v1 on-log layout, private to gdpfs_fmeta.c. */
+typedef struct
+{
+    size_t file_size;
+    uint16_t file_perm;
+    gdpfs_file_type_t file_type;
+    gdpfs_logent_type_t logent_type;
+    off_t ent_offset;
+    size_t ent_size;
+    uint64_t magic;
+} fmeta_v1_t;
+
+static bool
+_meta_equal(const gdpfs_fmeta_t *a, const gdpfs_fmeta_t *b)
+{
+    return a->file_size == b->file_size &&
+           a->file_perm == b->file_perm &&
+           a->file_type == b->file_type &&
+           a->logent_type == b->logent_type &&
+           a->ent_offset == b->ent_offset &&
+           a->ent_size == b->ent_size &&
+           a->chkpt_recno == b->chkpt_recno;
+}
+
+static void
+_check_round_trip(const gdpfs_fmeta_t *meta, uint8_t flags)
+{
+    uint8_t buf[GDPFS_FMETA_MAX_SIZE + 16];
+    gdpfs_fmeta_t out;
+    uint8_t out_flags;
+    size_t n;
+    size_t k;
+
+    memset(buf, 0xa5, sizeof(buf));
+    n = gdpfs_fmeta_encode(meta, flags, buf);
+    CHECK(n > 0 && n <= GDPFS_FMETA_MAX_SIZE);
+    CHECK(buf[GDPFS_FMETA_MAX_SIZE] == 0xa5);
+
+    // Trailing record data must not be read as part of the header.
+    CHECK(gdpfs_fmeta_decode(buf, sizeof(buf), sizeof(buf), &out, &out_flags) == n);
+    CHECK(_meta_equal(meta, &out));
+    CHECK(out.magic == GDPFS_FMETA_V1_MAGIC);
+    if (meta->chkpt_recno > 0)
+        CHECK(out_flags == (flags | GDPFS_FMETA_FLAG_CHKPT));
+    else
+        CHECK(out_flags == flags);
+
+    // Every proper prefix ends mid-header.
+    for (k = 0; k < n; k++)
+    {
+        CHECK(gdpfs_fmeta_decode(buf, k, sizeof(buf), &out, &out_flags) == 0);
+        CHECK(gdpfs_fmeta_decode(buf, sizeof(buf), k, &out, &out_flags) == 0);
+    }
+}
+
+static void
+test_round_trip()
+{
+    static const uint64_t sizes[] = {
+        0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 4096, 1ULL << 32,
+        (1ULL << 63) - 1, UINT64_MAX,
+    };
+    static const int64_t offsets[] = {
+        0, 1, -1, 63, -64, 64, -65, 1LL << 40, INT64_MAX, INT64_MIN,
+    };
+    gdpfs_fmeta_t meta;
+    size_t i;
+
+    memset(&meta, 0, sizeof(meta));
+    _check_round_trip(&meta, 0);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        memset(&meta, 0, sizeof(meta));
+        meta.file_size = sizes[i];
+        meta.ent_size = sizes[i];
+        meta.ent_offset = offsets[i];
+        meta.file_perm = 0644 + i;
+        meta.file_type = GDPFS_FILE_TYPE_REGULAR + (i % 3);
+        meta.logent_type = i % 2 ? GDPFS_LOGENT_TYPE_CHKPT : GDPFS_LOGENT_TYPE_DATA;
+        meta.chkpt_recno = i % 2 ? (gdpfs_recno_t) (sizes[i] >> 1) : 0;
+        _check_round_trip(&meta, 0);
+        _check_round_trip(&meta, GDPFS_FMETA_FLAG_COMPRESSED);
+        _check_round_trip(&meta, GDPFS_FMETA_FLAG_HOLE | GDPFS_FMETA_FLAG_MULTI_EXTENT);
+    }
+
+    memset(&meta, 0, sizeof(meta));
+    meta.file_type = GDPFS_FILE_TYPE_UNKNOWN;
+    meta.file_perm = UINT16_MAX;
+    _check_round_trip(&meta, 0);
+}
+
+static void
+test_decode_v1()
+{
+    uint8_t buf[sizeof(fmeta_v1_t) + 8];
+    fmeta_v1_t v1;
+    gdpfs_fmeta_t out;
+    uint8_t flags = 0xff;
+
+    memset(&v1, 0, sizeof(v1));
+    v1.file_size = 123456789;
+    v1.file_perm = 0755;
+    v1.file_type = GDPFS_FILE_TYPE_DIR;
+    v1.logent_type = GDPFS_LOGENT_TYPE_DATA;
+    v1.ent_offset = 4096;
+    v1.ent_size = 512;
+    v1.magic = GDPFS_FMETA_V1_MAGIC;
+    memcpy(buf, &v1, sizeof(v1));
+    memset(buf + sizeof(v1), 0, sizeof(buf) - sizeof(v1));
+
+    CHECK(gdpfs_fmeta_decode(buf, sizeof(buf), sizeof(buf), &out, &flags) == sizeof(v1));
+    CHECK(flags == 0);
+    CHECK(out.file_size == v1.file_size);
+    CHECK(out.file_perm == v1.file_perm);
+    CHECK(out.file_type == v1.file_type);
+    CHECK(out.logent_type == v1.logent_type);
+    CHECK(out.ent_offset == v1.ent_offset);
+    CHECK(out.ent_size == v1.ent_size);
+    CHECK(out.chkpt_recno == 0);
+    CHECK(out.ent_count == 0);
+
+    // Short of the magic it isn't a v1 header, and not a v2 one either.
+    CHECK(gdpfs_fmeta_decode(buf, sizeof(v1) - 1, sizeof(buf), &out, &flags) == 0);
+    v1.magic ^= 1;
+    memcpy(buf, &v1, sizeof(v1));
+    CHECK(gdpfs_fmeta_decode(buf, sizeof(buf), sizeof(buf), &out, &flags) == 0);
+}
+
+static void
+test_decode_garbage()
+{
+    uint8_t buf[GDPFS_FMETA_MAX_SIZE];
+    gdpfs_fmeta_t out;
+    uint8_t flags;
+
+    // Unknown version.
+    memset(buf, 0, sizeof(buf));
+    buf[0] = GDPFS_FMETA_VERSION + 1;
+    CHECK(gdpfs_fmeta_decode(buf, sizeof(buf), sizeof(buf), &out, &flags) == 0);
+
+    // A varint that never terminates.
+    memset(buf, 0xff, sizeof(buf));
+    buf[0] = GDPFS_FMETA_VERSION;
+    buf[1] = GDPFS_LOGENT_TYPE_DATA;
+    buf[2] = 0;
+    CHECK(gdpfs_fmeta_decode(buf, sizeof(buf), sizeof(buf), &out, &flags) == 0);
+}
+
+static void
+test_extents()
+{
+    static gdpfs_extent_t exts[GDPFS_FMETA_MAX_EXTENTS + 1];
+    static gdpfs_extent_t out[GDPFS_FMETA_MAX_EXTENTS];
+    static uint8_t buf[GDPFS_FMETA_EXTENTS_MAX_SIZE + 32];
+    uint32_t n;
+    uint32_t i;
+    size_t len;
+    size_t k;
+
+    for (i = 0; i <= GDPFS_FMETA_MAX_EXTENTS; i++)
+    {
+        exts[i].offset = i % 2 ? (off_t) i << 33 : -(off_t) i;
+        exts[i].size = i % 3 ? (size_t) i * 4096 : SIZE_MAX - i;
+    }
+
+    // One extent, and the most a table may hold.
+    len = gdpfs_fmeta_encode_extents(exts, 1, buf);
+    CHECK(gdpfs_fmeta_decode_extents(buf, len, out, &n) == len);
+    CHECK(n == 1 && out[0].offset == exts[0].offset && out[0].size == exts[0].size);
+
+    len = gdpfs_fmeta_encode_extents(exts, GDPFS_FMETA_MAX_EXTENTS, buf);
+    CHECK(len <= GDPFS_FMETA_EXTENTS_MAX_SIZE);
+    CHECK(gdpfs_fmeta_decode_extents(buf, len, out, &n) == len);
+    CHECK(n == GDPFS_FMETA_MAX_EXTENTS);
+    for (i = 0; i < n; i++)
+        CHECK(out[i].offset == exts[i].offset && out[i].size == exts[i].size);
+    for (k = 0; k < len; k++)
+        CHECK(gdpfs_fmeta_decode_extents(buf, k, out, &n) == 0);
+
+    // Empty and oversized tables are corrupt.
+    len = gdpfs_fmeta_encode_extents(exts, 0, buf);
+    CHECK(gdpfs_fmeta_decode_extents(buf, len, out, &n) == 0);
+    len = gdpfs_fmeta_encode_extents(exts, GDPFS_FMETA_MAX_EXTENTS + 1, buf);
+    CHECK(gdpfs_fmeta_decode_extents(buf, len, out, &n) == 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_round_trip();
+    test_decode_v1();
+    test_decode_garbage();
+    test_extents();
+    return TEST_RESULT("test_fmeta");
+}
@@ -0,0 +1,211 @@
+/*
+**  ----- BEGIN LICENSE BLOCK -----
+**  GDPFS: Global Data Plane File System
+**  From the Ubiquitous Swarm Lab, 490 Cory Hall, U.C. Berkeley.
+**
+**  Copyright (c) 2016, Regents of the University of California.
+**  Copyright (c) 2016, Paul Bramsen, Sam Kumar, and Andrew Chen
+**  All rights reserved.
+**
+**  Permission is hereby granted, without written agreement and without
+**  license or royalty fees, to use, copy, modify, and distribute this
+**  software and its documentation for any purpose, provided that the above
+**  copyright notice and the following two paragraphs appear in all copies
+**  of this software.
+**
+**  IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+**  SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST
+**  PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+**  EVEN IF REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+**  REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+**  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+**  FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING DOCUMENTATION,
+**  IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS". REGENTS HAS NO
+**  OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+**  OR MODIFICATIONS.
+**  ----- END LICENSE BLOCK -----
+*/
+
+#include "test.h"
+#include "gdpfs_logcache.h"
+
+#include <ep/ep_mem.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+// Four records fill a segment.
+#define REC_SIZE        (LOGCACHE_SEGMENT_SIZE / 4)
+
+static char dir[] = "/tmp/gdpfs_test_logcache.XXXXXX";
+static gdp_name_t gname;
+static char *buf;
+
+static void
+_fill(int64_t recno, char *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        data[i] = (char) (recno * 31 + i / 4096);
+}
+
+static void
+_put(int64_t recno)
+{
+    _fill(recno, buf, REC_SIZE);
+    CHECK(EP_STAT_ISOK(gdpfs_logcache_put(gname, recno, buf, REC_SIZE)));
+}
+
+/* Whether rec holds recno's contents. */
+static bool
+_rec_ok(gdpfs_logcache_rec_t *rec, int64_t recno)
+{
+    char *want = ep_mem_malloc(REC_SIZE);
+    bool ok;
+
+    _fill(recno, want, REC_SIZE);
+    ok = gdpfs_logcache_rec_length(rec) == REC_SIZE &&
+         gdpfs_logcache_pread(rec, buf, REC_SIZE, 0) == REC_SIZE &&
+         memcmp(buf, want, REC_SIZE) == 0;
+    ep_mem_free(want);
+    return ok;
+}
+
+static bool
+_cached(int64_t recno)
+{
+    gdpfs_logcache_rec_t *rec = gdpfs_logcache_get(gname, recno);
+    bool ok;
+
+    if (rec == NULL)
+        return false;
+    ok = _rec_ok(rec, recno);
+    CHECK(ok);
+    gdpfs_logcache_release(rec);
+    return ok;
+}
+
+static bool
+_seg_exists(uint32_t id)
+{
+    char name[PATH_MAX];
+
+    snprintf(name, sizeof name, "%s/LOGSEG%08u", dir, id);
+    return access(name, F_OK) == 0;
+}
+
+static void
+test_put_get()
+{
+    gdp_name_t other;
+    gdpfs_logcache_rec_t *rec;
+    struct iovec iov[3];
+    char small[10];
+
+    CHECK(gdpfs_logcache_get(gname, 100) == NULL);
+
+    // Gathered from pieces, read back in part.
+    iov[0].iov_base = "abc";
+    iov[0].iov_len = 3;
+    iov[1].iov_base = "";
+    iov[1].iov_len = 0;
+    iov[2].iov_base = "defg";
+    iov[2].iov_len = 4;
+    CHECK(EP_STAT_ISOK(gdpfs_logcache_putv(gname, 100, iov, 3)));
+    rec = gdpfs_logcache_get(gname, 100);
+    CHECK(rec != NULL);
+    if (rec != NULL)
+    {
+        CHECK(gdpfs_logcache_rec_length(rec) == 7);
+        CHECK(gdpfs_logcache_pread(rec, small, sizeof small, 0) == 7);
+        CHECK(memcmp(small, "abcdefg", 7) == 0);
+        CHECK(gdpfs_logcache_pread(rec, small, 2, 3) == 2);
+        CHECK(memcmp(small, "de", 2) == 0);
+        CHECK(gdpfs_logcache_pread(rec, small, sizeof small, 5) == 2);
+        CHECK(gdpfs_logcache_pread(rec, small, sizeof small, 7) == 0);
+        gdpfs_logcache_release(rec);
+    }
+
+    // The first copy of a record wins.
+    CHECK(EP_STAT_ISOK(gdpfs_logcache_put(gname, 100, "xyz", 3)));
+    rec = gdpfs_logcache_get(gname, 100);
+    CHECK(rec != NULL && gdpfs_logcache_rec_length(rec) == 7);
+    if (rec != NULL)
+        gdpfs_logcache_release(rec);
+
+    // Records are keyed by log as well as recno.
+    memset(other, 'b', sizeof other);
+    CHECK(gdpfs_logcache_get(other, 100) == NULL);
+}
+
+/*
+ * Fill two segments, then overflow into a third so the oldest gets
+ * compacted: records read since they were written move forward, the rest
+ * go, and the segment file stays around until its last reader is done.
+ * Runs first so segment ids start at 0.
+ */
+static void
+test_compaction()
+{
+    gdpfs_logcache_rec_t *held;
+    int64_t r;
+
+    for (r = 0; r < 8; r++)
+        _put(r);
+    CHECK(_seg_exists(0) && _seg_exists(1) && !_seg_exists(2));
+
+    CHECK(_cached(1));
+    held = gdpfs_logcache_get(gname, 3);
+    CHECK(held != NULL);
+    if (held == NULL)
+        return;
+
+    // Segment 0 (recnos 0-3) goes; 1 and 3 were read and move to the
+    // active segment. The held reference keeps reading the old file.
+    _put(8);
+    CHECK(_seg_exists(0) && _seg_exists(2));
+    CHECK(_rec_ok(held, 3));
+    CHECK(gdpfs_logcache_get(gname, 0) == NULL);
+    CHECK(gdpfs_logcache_get(gname, 2) == NULL);
+    CHECK(_cached(1));
+    CHECK(_cached(3));
+    gdpfs_logcache_release(held);
+    CHECK(!_seg_exists(0));
+
+    // Segment 1 (recnos 4-7) was never read and is dropped whole.
+    _put(9);
+    CHECK(_seg_exists(1));
+    _put(10);
+    CHECK(!_seg_exists(1) && _seg_exists(3));
+    for (r = 4; r < 8; r++)
+        CHECK(gdpfs_logcache_get(gname, r) == NULL);
+    for (r = 8; r < 11; r++)
+        CHECK(_cached(r));
+    CHECK(_cached(1));
+    CHECK(_cached(3));
+}
+
+int
+main(int argc, char *argv[])
+{
+    memset(gname, 'a', sizeof gname);
+    buf = ep_mem_malloc(REC_SIZE);
+    if (buf == NULL || mkdtemp(dir) == NULL)
+    {
+        perror("test_logcache");
+        return 1;
+    }
+    CHECK(EP_STAT_ISOK(init_gdpfs_logcache(dir, 2 * LOGCACHE_SEGMENT_SIZE)));
+
+    test_compaction();
+    test_put_get();
+
+    // Stopping deletes every segment, leaving the directory empty.
+    stop_gdpfs_logcache();
+    CHECK(rmdir(dir) == 0);
+    ep_mem_free(buf);
+    return TEST_RESULT("test_logcache");
+}